@@ -0,0 +1,193 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "ThreadTopology.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Analysis Stage - one kind of analysis that runs on the recorded tracks
+// (loudness, etc). Stages never run on the audio thread.
+//==============================================================================
+class AnalysisStage
+{
+public:
+    virtual ~AnalysisStage() = default;
+
+    virtual String getName() const = 0; // Key of the results in the take's sidecar file
+    virtual void prepare(double sampleRate, int numChannels) = 0; // Called at the start of every take
+    virtual void process(const AudioBuffer<float>& block, int numSamples) = 0; // Next piece of the take, at most maxChunkSize samples
+    virtual var getResults() = 0; // Called once the whole take has been processed
+
+    static constexpr int maxChunkSize = 4096; // Biggest block process() is ever given
+};
+
+//==============================================================================
+// Analysis Thread - takes a copy of the capture stream off the audio thread
+// The audio callback only copies into a lock free FIFO (AbstractFifo), this
+// thread picks the samples up and runs every stage on them.
+//==============================================================================
+class AnalysisThread : private Thread
+{
+public:
+    AnalysisThread() : Thread("Analysis Thread") {}
+
+    ~AnalysisThread() override
+    {
+        stopThread(2000);
+    }
+
+    // Stages are owned by whoever adds them and have to outlive this thread
+    void addStage(AnalysisStage* stage)
+    {
+        const ScopedLock sl(stageLock);
+        stages.add(stage);
+    }
+
+    // Sets up the FIFO and the stages for a new take (message thread, before the audio thread pushes anything)
+    void startTake(double sampleRate, int numChannels)
+    {
+        const ScopedLock sl(stageLock);
+
+        fifoBuffer.setSize(numChannels, fifoSize);
+        chunkBuffer.setSize(numChannels, AnalysisStage::maxChunkSize);
+        fifo.reset();
+        overruns = 0;
+
+        for (auto* stage : stages)
+            stage->prepare(sampleRate, numChannels);
+
+        if (!isThreadRunning())
+            startThread(Thread::Priority::low); // Analysis can always wait, recording can't
+
+        takeActive = true;
+    }
+
+    // Audio thread - copies the tracks into the FIFO, never waits (if the FIFO is full the block is skipped and counted)
+    void push(const AudioBuffer<float>& tracks, int numChannels, int numSamples)
+    {
+        if (!takeActive)
+            return;
+
+        int start1, size1, start2, size2;
+        fifo.prepareToWrite(numSamples, start1, size1, start2, size2);
+
+        if (size1 + size2 < numSamples)
+        {
+            ++overruns;
+            return;
+        }
+
+        numChannels = jmin(numChannels, fifoBuffer.getNumChannels());
+        for (int ch = 0; ch < numChannels; ++ch)
+        {
+            FloatVectorOperations::copy(fifoBuffer.getWritePointer(ch, start1), tracks.getReadPointer(ch), size1);
+            if (size2 > 0)
+                FloatVectorOperations::copy(fifoBuffer.getWritePointer(ch, start2), tracks.getReadPointer(ch, size1), size2);
+        }
+
+        fifo.finishedWrite(size1 + size2);
+    }
+
+    // Runs the stages over whatever is still in the FIFO and returns all results (the engine's finalizer thread,
+    // after the audio thread stopped pushing - the stage lock keeps this thread out, and the message thread
+    // only reads the spectrogram's columns, which it takes from its own FIFO)
+    var finishTake()
+    {
+        takeActive = false;
+
+        const ScopedLock sl(stageLock);
+        processPendingSamples();
+
+        auto* results = new DynamicObject();
+        for (auto* stage : stages)
+            results->setProperty(stage->getName(), stage->getResults());
+
+        return var(results);
+    }
+
+    int getOverruns() const { return overruns; } // Blocks the analysis missed because it fell behind
+
+    // The FIFO and the chunk, for the memory governor (message thread)
+    size_t getMemoryUsed() const
+    {
+        return sizeof(float) * (size_t) (fifoBuffer.getNumChannels() * fifoBuffer.getNumSamples()
+                                         + chunkBuffer.getNumChannels() * chunkBuffer.getNumSamples());
+    }
+
+private:
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            ThreadTopology::applyToCurrentThread(ThreadTopology::analysis);
+
+            {
+                const ScopedLock sl(stageLock);
+                processPendingSamples();
+            }
+
+            wait(10); // Polling, so the audio thread never has to signal (which could block)
+        }
+    }
+
+    void processPendingSamples()
+    {
+        while (fifo.getNumReady() > 0)
+        {
+            int start1, size1, start2, size2;
+            fifo.prepareToRead(jmin(fifo.getNumReady(), AnalysisStage::maxChunkSize), start1, size1, start2, size2);
+
+            for (int ch = 0; ch < chunkBuffer.getNumChannels(); ++ch)
+            {
+                FloatVectorOperations::copy(chunkBuffer.getWritePointer(ch), fifoBuffer.getReadPointer(ch, start1), size1);
+                if (size2 > 0)
+                    FloatVectorOperations::copy(chunkBuffer.getWritePointer(ch, size1), fifoBuffer.getReadPointer(ch, start2), size2);
+            }
+
+            fifo.finishedRead(size1 + size2);
+
+            for (auto* stage : stages)
+                stage->process(chunkBuffer, size1 + size2);
+        }
+    }
+
+    static constexpr int fifoSize = 131072; // About 2.7 seconds at 48 kHz before the analysis would miss anything
+
+    CriticalSection stageLock; // Taken by this thread, the message thread (startTake) and the engine's finalizer (finishTake)
+    Array<AnalysisStage*> stages;
+
+    AbstractFifo fifo{ fifoSize };
+    AudioBuffer<float> fifoBuffer;
+    AudioBuffer<float> chunkBuffer; // One contiguous piece for the stages
+    atomic<bool> takeActive{ false };
+    atomic<int> overruns{ 0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AnalysisThread)
+};
+
+//==============================================================================
+// Take Sidecar - extra information saved next to a recording
+// Recording_x.wav gets a Recording_x.take.json with one section per feature
+//==============================================================================
+struct TakeSidecar
+{
+    static File getFileFor(const File& takeFile)
+    {
+        return takeFile.withFileExtension(".take.json");
+    }
+
+    static var load(const File& takeFile)
+    {
+        File file = getFileFor(takeFile);
+        var root = file.existsAsFile() ? JSON::parse(file) : var();
+        return root.getDynamicObject() != nullptr ? root : var(new DynamicObject());
+    }
+
+    static bool setSection(const File& takeFile, const Identifier& section, const var& value)
+    {
+        var root = load(takeFile);
+        root.getDynamicObject()->setProperty(section, value);
+        return getFileFor(takeFile).replaceWithText(JSON::toString(root));
+    }
+};
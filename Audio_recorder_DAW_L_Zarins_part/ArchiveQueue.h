@@ -0,0 +1,507 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <vector>
+#include "AnalysisThread.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Flac Chunk Joiner - glues separately encoded FLAC streams into one file
+// Every chunk of a take is encoded on its own (in parallel) as a complete
+// FLAC stream. With a fixed block size a frame only knows its own number,
+// so joining them means keeping the first chunk's header and renumbering the
+// frames of the later chunks (which changes their header and both CRCs).
+// Frames are found from the encoder's writes, libFLAC writes one frame per call.
+//==============================================================================
+struct FlacChunkJoiner
+{
+    // Output stream of one chunk encoder, keeps the data and where each frame starts
+    class FrameRecordingStream : public MemoryOutputStream
+    {
+    public:
+        FrameRecordingStream(MemoryBlock& dataToWriteTo, vector<size_t>& frameStartsToFill)
+            : MemoryOutputStream(dataToWriteTo, false), frameStarts(frameStartsToFill)
+        {
+        }
+
+        bool write(const void* data, size_t numBytes) override
+        {
+            auto* bytes = static_cast<const uint8*>(data);
+            bool appending = getPosition() == (int64) getDataSize();
+
+            if (appending && numBytes >= 2 && bytes[0] == 0xFF && (bytes[1] & 0xFE) == 0xF8) // Frame sync code
+                frameStarts.push_back((size_t) getPosition());
+
+            return MemoryOutputStream::write(data, numBytes);
+        }
+
+    private:
+        vector<size_t>& frameStarts;
+    };
+
+    static constexpr int streamInfoOffset = 8; // After "fLaC" and the STREAMINFO block header
+
+    // Block size of a finished stream (every frame but the last has this many samples), 0 if it isn't FLAC
+    static int getBlockSize(const MemoryBlock& stream)
+    {
+        auto* data = static_cast<const uint8*>(stream.getData());
+        if (stream.getSize() < 42 || memcmp(data, "fLaC", 4) != 0 || (data[4] & 0x7F) != 0)
+            return 0;
+
+        int minBlockSize = (data[streamInfoOffset] << 8) | data[streamInfoOffset + 1];
+        int maxBlockSize = (data[streamInfoOffset + 2] << 8) | data[streamInfoOffset + 3];
+        return minBlockSize == maxBlockSize || maxBlockSize == 0 ? minBlockSize : 0;
+    }
+
+    // Header of the joined file: the first chunk's metadata, with the length of the whole take
+    // (frame sizes and the MD5 only describe the first chunk, so they are set to "unknown")
+    static MemoryBlock makeHeader(const MemoryBlock& firstChunk, size_t firstFrameStart, int64 totalSamples)
+    {
+        MemoryBlock header(firstChunk.getData(), firstFrameStart);
+        auto* data = static_cast<uint8*>(header.getData());
+
+        for (int i = 4; i < 10; ++i)
+            data[streamInfoOffset + i] = 0; // Min and max frame size
+
+        data[streamInfoOffset + 13] = (uint8) ((data[streamInfoOffset + 13] & 0xF0) | ((totalSamples >> 32) & 0x0F));
+        data[streamInfoOffset + 14] = (uint8) (totalSamples >> 24);
+        data[streamInfoOffset + 15] = (uint8) (totalSamples >> 16);
+        data[streamInfoOffset + 16] = (uint8) (totalSamples >> 8);
+        data[streamInfoOffset + 17] = (uint8) totalSamples;
+
+        for (int i = 18; i < 34; ++i)
+            data[streamInfoOffset + i] = 0; // MD5
+
+        return header;
+    }
+
+    // Writes one frame with a new frame number, returns false if it doesn't look like a frame
+    static bool writeRenumberedFrame(OutputStream& out, const uint8* frame, size_t size, int64 frameNumber)
+    {
+        if (size < 8)
+            return false;
+
+        int numberLength = getCodedNumberLength(frame[4]);
+        int blockSizeCode = frame[2] >> 4, sampleRateCode = frame[2] & 0x0F;
+        int extraLength = (blockSizeCode == 6 ? 1 : blockSizeCode == 7 ? 2 : 0)
+            + (sampleRateCode == 12 ? 1 : (sampleRateCode == 13 || sampleRateCode == 14) ? 2 : 0);
+        size_t headerEnd = (size_t) (4 + numberLength + extraLength); // Where the CRC-8 is
+
+        if (numberLength == 0 || headerEnd + 3 > size)
+            return false;
+
+        MemoryOutputStream newFrame(size + 8);
+        newFrame.write(frame, 4);
+        writeCodedNumber(newFrame, frameNumber);
+        newFrame.write(frame + 4 + numberLength, (size_t) extraLength);
+        newFrame.writeByte((char) crc8(static_cast<const uint8*>(newFrame.getData()), newFrame.getDataSize()));
+        newFrame.write(frame + headerEnd + 1, size - headerEnd - 3); // Subframes, without the old CRC-16
+
+        uint16 crc = crc16(static_cast<const uint8*>(newFrame.getData()), newFrame.getDataSize());
+        newFrame.writeByte((char) (crc >> 8));
+        newFrame.writeByte((char) (crc & 0xFF));
+
+        return out.write(newFrame.getData(), newFrame.getDataSize());
+    }
+
+private:
+    // Frame numbers are stored like UTF-8 (1 to 7 bytes)
+    static int getCodedNumberLength(uint8 firstByte)
+    {
+        if ((firstByte & 0x80) == 0) return 1;
+        for (int length = 2; length <= 7; ++length)
+            if ((firstByte & (0xFF << (7 - length))) == (uint8) (0xFF << (8 - length)))
+                return length;
+        return 0;
+    }
+
+    static void writeCodedNumber(OutputStream& out, int64 value)
+    {
+        if (value < 0x80)
+        {
+            out.writeByte((char) value);
+            return;
+        }
+
+        int length = value < 0x800 ? 2 : value < 0x10000 ? 3 : value < 0x200000 ? 4
+            : value < 0x4000000 ? 5 : value < 0x80000000LL ? 6 : 7;
+
+        out.writeByte((char) ((0xFF00 >> length) | (length == 7 ? 0 : (int) (value >> (6 * (length - 1))))));
+        for (int i = length - 2; i >= 0; --i)
+            out.writeByte((char) (0x80 | ((value >> (6 * i)) & 0x3F)));
+    }
+
+    static uint8 crc8(const uint8* data, size_t size)
+    {
+        uint8 crc = 0;
+        for (size_t i = 0; i < size; ++i)
+        {
+            crc ^= data[i];
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (uint8) ((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+        }
+        return crc;
+    }
+
+    static uint16 crc16(const uint8* data, size_t size)
+    {
+        uint16 crc = 0;
+        for (size_t i = 0; i < size; ++i)
+        {
+            crc ^= (uint16) (data[i] << 8);
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (uint16) ((crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1);
+        }
+        return crc;
+    }
+};
+
+//==============================================================================
+// Archive Queue - turns finished WAV takes into FLAC in the background
+// One coordinator thread works through the queue a take at a time. A take is
+// cut into chunks (a whole number of FLAC blocks each) that are encoded in
+// parallel on a low priority thread pool and joined in order into a temporary
+// file. That file is decoded again and compared with the WAV sample by sample,
+// only then it is renamed to the .flac name (a rename is atomic). While
+// shouldYield() says so (a take is recording, the CPU is busy) no new chunks
+// are started, so archiving never competes with a recording for the disk.
+//==============================================================================
+class ArchiveQueue : private Thread
+{
+public:
+    struct Result
+    {
+        File source, archive;
+        bool succeeded = false;
+        String message;
+        int64 sourceBytes = 0, archiveBytes = 0;
+        int numChunks = 0;
+    };
+
+    explicit ArchiveQueue(int numWorkers = jmax(1, SystemStats::getNumCpus() - 1))
+        : Thread("Archive Queue"),
+        pool(ThreadPoolOptions{}.withThreadName("Archive Encoder")
+            .withNumberOfThreads(numWorkers)
+            .withDesiredThreadPriority(Thread::Priority::background)),
+        maxChunksInFlight(numWorkers + 1)
+    {
+        formatManager.registerBasicFormats();
+    }
+
+    ~ArchiveQueue() override
+    {
+        signalThreadShouldExit();
+        notify();
+        pool.removeAllJobs(true, 10000);
+        stopThread(10000);
+    }
+
+    // Message thread - queues a finished take, it is archived when its turn comes
+    void addTake(const File& wavFile)
+    {
+        {
+            const ScopedLock sl(queueLock);
+            pending.addIfNotAlreadyThere(wavFile);
+        }
+
+        if (!isThreadRunning())
+            startThread(Thread::Priority::low);
+
+        notify();
+    }
+
+    // Take is being deleted - takes it off the queue, or stops it if it is being archived right now
+    void cancel(const File& wavFile)
+    {
+        const ScopedLock sl(queueLock);
+        pending.removeFirstMatchingValue(wavFile);
+        if (current == wavFile)
+            cancelCurrent = true;
+    }
+
+    int getNumPending() const
+    {
+        const ScopedLock sl(queueLock);
+        return pending.size() + (current != File() ? 1 : 0);
+    }
+
+    // Asked before every chunk, true = wait (called on the coordinator thread)
+    function<bool()> shouldYield;
+
+    // Message thread, after each take - if this isn't set the WAV is deleted straight away
+    // when the archive was verified, otherwise the callback has to do it (once nothing reads it any more)
+    function<void(const Result&)> onTakeArchived;
+
+private:
+    struct EncodedChunk
+    {
+        MemoryBlock data;
+        vector<size_t> frameStarts;
+        atomic<bool> finished{ false };
+        bool succeeded = false;
+    };
+
+    // Encodes samples [start, start + length) of the source as a FLAC stream of its own
+    class ChunkJob : public ThreadPoolJob
+    {
+    public:
+        ChunkJob(ArchiveQueue& queueToUse, const File& sourceFile, int64 startSample, int64 numSamples, EncodedChunk& chunkToFill)
+            : ThreadPoolJob("Archive Chunk"), queue(queueToUse), source(sourceFile), start(startSample), length(numSamples), chunk(chunkToFill)
+        {
+        }
+
+        JobStatus runJob() override
+        {
+            ThreadTopology::applyToCurrentThread(ThreadTopology::background);
+            chunk.succeeded = encode();
+            chunk.finished = true;
+            queue.notify();
+            return jobHasFinished;
+        }
+
+    private:
+        bool encode()
+        {
+            unique_ptr<AudioFormatReader> reader(queue.formatManager.createReaderFor(source));
+            if (reader == nullptr)
+                return false;
+
+            FlacAudioFormat flac;
+            unique_ptr<AudioFormatWriter> writer(flac.createWriterFor(new FlacChunkJoiner::FrameRecordingStream(chunk.data, chunk.frameStarts),
+                reader->sampleRate, reader->numChannels, (int) reader->bitsPerSample, {}, 5));
+            if (writer == nullptr)
+                return false;
+
+            // Integer samples all the way, so nothing gets rounded
+            int numChannels = (int) reader->numChannels;
+            HeapBlock<int> samples((size_t) (numChannels * blockSize));
+            vector<int*> channels((size_t) numChannels + 1, nullptr);
+            for (int ch = 0; ch < numChannels; ++ch)
+                channels[(size_t) ch] = samples + ch * blockSize;
+
+            for (int64 done = 0; done < length; done += blockSize)
+            {
+                if (shouldExit())
+                    return false;
+
+                int num = (int) jmin((int64) blockSize, length - done);
+                reader->read(channels.data(), numChannels, start + done, num, false);
+                if (!writer->write((const int**) channels.data(), num))
+                    return false;
+            }
+
+            writer.reset(); // Flushes the last frame and fills in the STREAMINFO
+            return true;
+        }
+
+        static constexpr int blockSize = 8192;
+
+        ArchiveQueue& queue;
+        File source;
+        int64 start, length;
+        EncodedChunk& chunk;
+    };
+
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            ThreadTopology::applyToCurrentThread(ThreadTopology::background);
+            File next;
+            {
+                const ScopedLock sl(queueLock);
+                if (!pending.isEmpty())
+                    next = current = pending.removeAndReturn(0);
+                cancelCurrent = false;
+            }
+
+            if (next == File())
+            {
+                wait(-1);
+                continue;
+            }
+
+            Result result = archive(next);
+
+            {
+                const ScopedLock sl(queueLock);
+                current = File();
+            }
+
+            if (result.succeeded && onTakeArchived == nullptr)
+                result.source.deleteFile();
+
+            MessageManager::callAsync([callback = onTakeArchived, result]
+            {
+                if (callback != nullptr)
+                    callback(result);
+            });
+        }
+    }
+
+    Result archive(const File& source)
+    {
+        Result result;
+        result.source = source;
+        result.archive = source.withFileExtension(".flac");
+        result.sourceBytes = source.getSize();
+
+        File temporary = source.getSiblingFile(source.getFileNameWithoutExtension() + ".flac.tmp");
+        result.message = encodeAndJoin(source, temporary, result.numChunks);
+
+        if (result.message.isEmpty())
+            result.message = verify(source, temporary);
+
+        if (result.message.isEmpty() && !temporary.moveFileTo(result.archive))
+            result.message = "Could not rename " + temporary.getFileName();
+
+        temporary.deleteFile(); // Only still there if something went wrong
+        result.succeeded = result.message.isEmpty();
+        result.archiveBytes = result.succeeded ? result.archive.getSize() : 0;
+
+        // Noted in the take's sidecar (the per channel files of a take share the first one's)
+        if (result.succeeded && TakeSidecar::getFileFor(result.archive).existsAsFile())
+        {
+            auto* info = new DynamicObject();
+            info->setProperty("source", source.getFileName());
+            info->setProperty("source_bytes", result.sourceBytes);
+            info->setProperty("archive_bytes", result.archiveBytes);
+            info->setProperty("chunks", result.numChunks);
+            info->setProperty("verified", true);
+            TakeSidecar::setSection(result.archive, "archive", var(info));
+        }
+
+        return result;
+    }
+
+    String encodeAndJoin(const File& source, const File& destination, int& numChunks)
+    {
+        unique_ptr<AudioFormatReader> reader(formatManager.createReaderFor(source));
+        if (reader == nullptr)
+            return "Can't read " + source.getFileName();
+
+        if (reader->usesFloatingPointData || (reader->bitsPerSample != 16 && reader->bitsPerSample != 24) || reader->numChannels > 8)
+            return "FLAC can only hold 16 or 24 bit audio with up to 8 channels";
+
+        // About the same amount of audio per chunk whatever the channel count, always whole FLAC blocks
+        int64 length = reader->lengthInSamples;
+        int64 chunkSamples = (int64) flacBlockSize * jmax(16, 1024 / (int) reader->numChannels);
+        numChunks = (int) jmax((int64) 1, (length + chunkSamples - 1) / chunkSamples);
+
+        vector<unique_ptr<EncodedChunk>> chunks((size_t) numChunks);
+        const ScopeGuard stopChunkJobs{ [this] { pool.removeAllJobs(true, 10000); } }; // Before the chunks go, whichever way this returns
+        int nextToStart = 0;
+        int64 framesWritten = 0;
+
+        FileOutputStream out(destination);
+        if (out.failedToOpen() || !out.setPosition(0) || !out.truncate().wasOk())
+            return "Can't write " + destination.getFileName();
+
+        for (int nextToWrite = 0; nextToWrite < numChunks; ++nextToWrite)
+        {
+            // Keep a few chunks going, but none new while a recording needs the machine
+            while (true)
+            {
+                if (threadShouldExit() || cancelCurrent)
+                    return "Cancelled";
+
+                while (nextToStart < numChunks && nextToStart - nextToWrite < maxChunksInFlight && !isYielding())
+                {
+                    chunks[(size_t) nextToStart] = make_unique<EncodedChunk>();
+                    int64 start = nextToStart * chunkSamples;
+                    pool.addJob(new ChunkJob(*this, source, start, jmin(chunkSamples, length - start), *chunks[(size_t) nextToStart]), true);
+                    ++nextToStart;
+                }
+
+                if (chunks[(size_t) nextToWrite] != nullptr && chunks[(size_t) nextToWrite]->finished)
+                    break;
+
+                wait(50);
+            }
+
+            auto& chunk = *chunks[(size_t) nextToWrite];
+            if (!chunk.succeeded || chunk.frameStarts.empty() || FlacChunkJoiner::getBlockSize(chunk.data) != flacBlockSize)
+                return "Encoding failed";
+
+            if (nextToWrite == 0)
+                out << FlacChunkJoiner::makeHeader(chunk.data, chunk.frameStarts[0], length);
+
+            // Frames of the first chunk go in as they are, the others get numbered on from it
+            auto* data = static_cast<const uint8*>(chunk.data.getData());
+            for (size_t frame = 0; frame < chunk.frameStarts.size(); ++frame)
+            {
+                size_t frameStart = chunk.frameStarts[frame];
+                size_t frameEnd = frame + 1 < chunk.frameStarts.size() ? chunk.frameStarts[frame + 1] : chunk.data.getSize();
+
+                bool ok = nextToWrite == 0 ? out.write(data + frameStart, frameEnd - frameStart)
+                    : FlacChunkJoiner::writeRenumberedFrame(out, data + frameStart, frameEnd - frameStart, framesWritten + (int64) frame);
+                if (!ok)
+                    return "Could not join the chunks";
+            }
+
+            framesWritten += (int64) chunk.frameStarts.size();
+            chunks[(size_t) nextToWrite].reset(); // Only the chunks in flight are kept in memory
+        }
+
+        out.flush();
+        return out.getStatus().wasOk() ? String() : "Could not write " + destination.getFileName();
+    }
+
+    // Decodes the archive and compares it with the source, sample for sample
+    String verify(const File& source, const File& archive)
+    {
+        unique_ptr<AudioFormatReader> original(formatManager.createReaderFor(source));
+        unique_ptr<AudioFormatReader> copy(formatManager.createReaderFor(archive));
+
+        if (original == nullptr || copy == nullptr)
+            return "Can't read the archive back";
+
+        if (copy->lengthInSamples != original->lengthInSamples || copy->numChannels != original->numChannels
+            || copy->sampleRate != original->sampleRate || copy->bitsPerSample != original->bitsPerSample)
+            return "Archive doesn't match the format of the take";
+
+        const int blockSize = 65536, numChannels = (int) original->numChannels;
+        HeapBlock<int> originalSamples((size_t) (numChannels * blockSize)), copySamples((size_t) (numChannels * blockSize));
+        vector<int*> originalChannels((size_t) numChannels + 1, nullptr), copyChannels((size_t) numChannels + 1, nullptr);
+        for (int ch = 0; ch < numChannels; ++ch)
+        {
+            originalChannels[(size_t) ch] = originalSamples + ch * blockSize;
+            copyChannels[(size_t) ch] = copySamples + ch * blockSize;
+        }
+
+        for (int64 position = 0; position < original->lengthInSamples; position += blockSize)
+        {
+            while (isYielding() && !threadShouldExit())
+                wait(50);
+
+            if (threadShouldExit() || cancelCurrent)
+                return "Cancelled";
+
+            int num = (int) jmin((int64) blockSize, original->lengthInSamples - position);
+            original->read(originalChannels.data(), numChannels, position, num, false);
+            copy->read(copyChannels.data(), numChannels, position, num, false);
+
+            for (int ch = 0; ch < numChannels; ++ch)
+                if (memcmp(originalChannels[(size_t) ch], copyChannels[(size_t) ch], sizeof(int) * (size_t) num) != 0)
+                    return "Archive differs from the take at sample " + String(position);
+        }
+
+        return {};
+    }
+
+    bool isYielding() const { return shouldYield != nullptr && shouldYield(); }
+
+    static constexpr int flacBlockSize = 4096; // Block size libFLAC uses at quality 5
+
+    AudioFormatManager formatManager; // Only used to create readers, which every thread does for itself
+    ThreadPool pool;
+    const int maxChunksInFlight;
+
+    CriticalSection queueLock;
+    Array<File> pending;
+    File current;
+    atomic<bool> cancelCurrent{ false };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ArchiveQueue)
+};
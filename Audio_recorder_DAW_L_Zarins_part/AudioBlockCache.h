@@ -0,0 +1,375 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include "ThreadTopology.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Audio Block Cache - decoded audio of every file, shared by the whole program
+// Files are decoded in blocks of 32768 samples (all channels, as floats) and
+// kept by (file, block index), so the thumbnails, the sample view and anything
+// else reading a file only decode each part once. The least recently used
+// blocks are thrown away when the cache goes over its memory budget.
+// Readers that go through the file forwards (or backwards, when scrolling
+// left) get the next blocks decoded ahead of them on the prefetch threads.
+// Use it through SharedResourcePointer<AudioBlockCache>, every reader keeps
+// the cache alive for as long as it exists.
+//==============================================================================
+class AudioBlockCache
+{
+    struct Source;
+
+public:
+    static constexpr int blockSize = 32768; // Samples per block
+
+    AudioBlockCache()
+        : prefetchPool(ThreadPoolOptions{}.withThreadName("Audio Block Prefetch")
+            .withNumberOfThreads(2)
+            .withDesiredThreadPriority(Thread::Priority::low))
+    {
+        formatManager.registerBasicFormats();
+    }
+
+    ~AudioBlockCache()
+    {
+        prefetchPool.removeAllJobs(true, 5000);
+    }
+
+    //==========================================================================
+    // A normal AudioFormatReader (always float data) that reads through the cache
+    // Like any reader it's for one thread at a time, every thread makes its own
+    class Reader : public AudioFormatReader
+    {
+    public:
+        bool readSamples(int* const* destChannels, int numDestChannels, int startOffsetInDestBuffer,
+            int64 startSampleInFile, int numSamples) override
+        {
+            int done = 0;
+            int64 lastBlock = -1;
+
+            while (done < numSamples)
+            {
+                int64 position = startSampleInFile + done;
+                int64 blockIndex = position / blockSize;
+                int offset = (int) (position % blockSize);
+                int num = jmin(numSamples - done, blockSize - offset);
+
+                Block block = position < lengthInSamples ? cache->getBlock(source, blockIndex) : nullptr;
+                int available = block != nullptr ? jlimit(0, num, block->getNumSamples() - offset) : 0;
+
+                for (int ch = 0; ch < numDestChannels; ++ch)
+                {
+                    auto* dest = reinterpret_cast<float*>(destChannels[ch]);
+                    if (dest == nullptr)
+                        continue;
+
+                    dest += startOffsetInDestBuffer + done;
+                    int copied = ch < (int) numChannels ? available : 0;
+                    if (copied > 0)
+                        FloatVectorOperations::copy(dest, block->getReadPointer(ch, offset), copied);
+
+                    FloatVectorOperations::clear(dest + copied, num - copied); // Past the end of the file
+                }
+
+                lastBlock = blockIndex;
+                done += num;
+            }
+
+            if (lastBlock >= 0)
+                followAccessPattern(lastBlock);
+
+            return true;
+        }
+
+    private:
+        friend class AudioBlockCache;
+
+        explicit Reader(shared_ptr<Source> fileSource)
+            : AudioFormatReader(nullptr, "Cached Audio"), source(move(fileSource))
+        {
+            sampleRate = source->sampleRate;
+            bitsPerSample = source->bitsPerSample;
+            lengthInSamples = source->lengthInSamples;
+            numChannels = (unsigned int) source->numChannels;
+            usesFloatingPointData = true;
+        }
+
+        // Two blocks in a row in the same direction = reading through the file, the next ones get decoded ahead
+        void followAccessPattern(int64 blockIndex)
+        {
+            int direction = blockIndex == previousBlock + 1 ? 1 : (blockIndex == previousBlock - 1 ? -1 : 0);
+            if (blockIndex == previousBlock)
+                return;
+
+            runLength = (direction != 0 && direction == runDirection) ? runLength + 1 : 1;
+            runDirection = direction;
+            previousBlock = blockIndex;
+
+            if (direction != 0 && runLength >= 2)
+                for (int i = 1; i <= cache->getReadAhead(); ++i)
+                    cache->prefetch(source, blockIndex + direction * i);
+        }
+
+        SharedResourcePointer<AudioBlockCache> cache; // The same one that made this reader
+        shared_ptr<Source> source;
+        int64 previousBlock = -2;
+        int runDirection = 0, runLength = 0;
+    };
+
+    //==========================================================================
+    // Any thread - a reader of the file, or nullptr if it can't be read
+    unique_ptr<AudioFormatReader> createReader(const File& file)
+    {
+        auto source = getSource(file);
+        return unique_ptr<AudioFormatReader>(source != nullptr ? new Reader(source) : nullptr);
+    }
+
+    // The file was changed, replaced or deleted - drops its blocks and closes it
+    void invalidate(const File& file)
+    {
+        shared_ptr<Source> source;
+        {
+            const ScopedLock sl(cacheLock);
+            auto found = sources.find(file.getFullPathName());
+            if (found == sources.end())
+                return;
+
+            source = found->second;
+            sources.erase(found);
+            removeSource(*source);
+        }
+
+        const ScopedLock sl(source->decoderLock);
+        source->idleDecoders.clear(); // Open file handles would stop it from being deleted on Windows
+    }
+
+    void setMemoryBudget(size_t newBudgetBytes)
+    {
+        const ScopedLock sl(cacheLock);
+        memoryBudget = newBudgetBytes;
+        evictToBudget();
+    }
+
+    // Blocks decoded ahead of a reader going through a file (0 = no prefetching)
+    void setReadAhead(int numBlocks) { readAhead = jmax(0, numBlocks); }
+    int getReadAhead() const { return readAhead; }
+
+    size_t getMemoryUsed() const { const ScopedLock sl(cacheLock); return bytesUsed; }
+    size_t getMemoryBudget() const { const ScopedLock sl(cacheLock); return memoryBudget; }
+    int getNumBlocks() const { const ScopedLock sl(cacheLock); return (int) blocks.size(); }
+    int64 getHits() const { return hits; }
+    int64 getMisses() const { return misses; } // Blocks a reader had to wait for
+    int64 getPrefetched() const { return prefetched; }
+
+private:
+    using Block = shared_ptr<const AudioBuffer<float>>; // Shared, so a reader can still copy one that was just evicted
+
+    // One file as it was when it was opened - a changed file (other size or date) is a new source
+    struct Source
+    {
+        uint32 id = 0;
+        File file;
+        Time modified;
+        int64 fileSize = 0;
+        double sampleRate = 0.0;
+        unsigned int bitsPerSample = 0;
+        int64 lengthInSamples = 0;
+        int numChannels = 0;
+
+        CriticalSection decoderLock;
+        OwnedArray<AudioFormatReader> idleDecoders; // Decoders aren't thread safe, every decode borrows one
+        atomic<bool> valid{ true }; // Cleared with the cache lock held, after that no block of it gets in any more
+    };
+
+    struct Entry
+    {
+        uint64 key;
+        Block block;
+    };
+
+    using EntryList = list<Entry>;
+
+    static uint64 makeKey(uint32 sourceId, int64 blockIndex) { return ((uint64) sourceId << 32) | (uint64) (uint32) blockIndex; }
+    static uint32 getSourceId(uint64 key) { return (uint32) (key >> 32); }
+
+    static size_t getBlockBytes(const Block& block)
+    {
+        return (size_t) block->getNumChannels() * (size_t) block->getNumSamples() * sizeof(float);
+    }
+
+    shared_ptr<Source> getSource(const File& file)
+    {
+        const ScopedLock sl(cacheLock);
+        auto found = sources.find(file.getFullPathName());
+
+        if (found != sources.end())
+        {
+            auto& source = *found->second;
+            if (source.modified == file.getLastModificationTime() && source.fileSize == file.getSize())
+                return found->second;
+
+            // Written again since it was opened, nothing cached for it is right any more
+            removeSource(source);
+            sources.erase(found);
+        }
+
+        unique_ptr<AudioFormatReader> decoder(file.existsAsFile() ? formatManager.createReaderFor(file) : nullptr);
+        if (decoder == nullptr)
+            return nullptr;
+
+        auto source = make_shared<Source>();
+        source->id = ++lastSourceId;
+        source->file = file;
+        source->modified = file.getLastModificationTime();
+        source->fileSize = file.getSize();
+        source->sampleRate = decoder->sampleRate;
+        source->bitsPerSample = decoder->bitsPerSample;
+        source->lengthInSamples = decoder->lengthInSamples;
+        source->numChannels = (int) decoder->numChannels;
+        source->idleDecoders.add(decoder.release());
+
+        sources[file.getFullPathName()] = source;
+        return source;
+    }
+
+    // The block from the cache, or decoded right now if it isn't there yet
+    Block getBlock(const shared_ptr<Source>& source, int64 blockIndex)
+    {
+        uint64 key = makeKey(source->id, blockIndex);
+        {
+            const ScopedLock sl(cacheLock);
+            auto found = blocks.find(key);
+            if (found != blocks.end())
+            {
+                leastRecentlyUsed.splice(leastRecentlyUsed.begin(), leastRecentlyUsed, found->second); // Now the most recent
+                ++hits;
+                return found->second->block;
+            }
+        }
+
+        ++misses;
+        Block block = decodeBlock(*source, blockIndex);
+        if (block != nullptr)
+            addBlock(*source, key, block);
+        return block;
+    }
+
+    // Not locked while decoding, so two threads can decode the same block at once - the second one is just dropped
+    Block decodeBlock(Source& source, int64 blockIndex)
+    {
+        unique_ptr<AudioFormatReader> decoder;
+        {
+            const ScopedLock sl(source.decoderLock);
+            if (!source.valid)
+                return nullptr;
+
+            decoder.reset(source.idleDecoders.isEmpty() ? nullptr : source.idleDecoders.removeAndReturn(source.idleDecoders.size() - 1));
+        }
+
+        if (decoder == nullptr)
+            decoder.reset(formatManager.createReaderFor(source.file));
+        if (decoder == nullptr)
+            return nullptr;
+
+        int64 start = blockIndex * blockSize;
+        int num = (int) jlimit((int64) 0, (int64) blockSize, source.lengthInSamples - start);
+        auto buffer = make_shared<AudioBuffer<float>>(source.numChannels, jmax(1, num));
+        decoder->read(buffer.get(), 0, num, start, true, true);
+
+        const ScopedLock sl(source.decoderLock);
+        if (source.valid)
+            source.idleDecoders.add(decoder.release());
+
+        return buffer;
+    }
+
+    void addBlock(const Source& source, uint64 key, const Block& block)
+    {
+        const ScopedLock sl(cacheLock);
+        if (blocks.find(key) != blocks.end() || !source.valid)
+            return;
+
+        leastRecentlyUsed.push_front({ key, block });
+        blocks[key] = leastRecentlyUsed.begin();
+        bytesUsed += getBlockBytes(block);
+        evictToBudget();
+    }
+
+    // Decodes the block on a prefetch thread if nobody has it or asked for it yet
+    void prefetch(const shared_ptr<Source>& source, int64 blockIndex)
+    {
+        if (blockIndex < 0 || blockIndex * blockSize >= source->lengthInSamples)
+            return;
+
+        uint64 key = makeKey(source->id, blockIndex);
+        {
+            const ScopedLock sl(cacheLock);
+            if (blocks.find(key) != blocks.end() || !prefetching.insert(key).second)
+                return;
+        }
+
+        prefetchPool.addJob([this, source, blockIndex, key]
+        {
+            ThreadTopology::applyToCurrentThread(ThreadTopology::background);
+            if (Block block = decodeBlock(*source, blockIndex))
+            {
+                addBlock(*source, key, block);
+                ++prefetched;
+            }
+
+            const ScopedLock sl(cacheLock);
+            prefetching.erase(key);
+        });
+    }
+
+    // With the cache lock held - the file is gone or changed, so are its blocks
+    void removeSource(Source& source)
+    {
+        source.valid = false;
+
+        for (auto it = blocks.begin(); it != blocks.end();)
+        {
+            auto next = std::next(it);
+            if (getSourceId(it->first) == source.id)
+                removeBlock(it);
+            it = next;
+        }
+    }
+
+    void removeBlock(map<uint64, EntryList::iterator>::iterator entry)
+    {
+        bytesUsed -= getBlockBytes(entry->second->block);
+        leastRecentlyUsed.erase(entry->second);
+        blocks.erase(entry);
+    }
+
+    void evictToBudget()
+    {
+        // Keep at least the block just read, even if the budget is tiny
+        while (bytesUsed > memoryBudget && leastRecentlyUsed.size() > 1)
+            removeBlock(blocks.find(leastRecentlyUsed.back().key));
+    }
+
+    AudioFormatManager formatManager;
+    CriticalSection cacheLock; // Around everything below, never held while decoding
+    map<String, shared_ptr<Source>> sources; // By full path
+    uint32 lastSourceId = 0;
+
+    EntryList leastRecentlyUsed; // Most recently used at the front
+    map<uint64, EntryList::iterator> blocks;
+    set<uint64> prefetching; // Blocks with a prefetch job waiting or running
+    size_t memoryBudget = 256 * 1024 * 1024;
+    size_t bytesUsed = 0;
+
+    atomic<int> readAhead{ 4 };
+    atomic<int64> hits{ 0 }, misses{ 0 }, prefetched{ 0 };
+
+    ThreadPool prefetchPool; // Last, so its jobs are finished before anything they use goes away
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AudioBlockCache)
+};
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include "AudioBlockCache.h"
+#include "ThreadTopology.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Audio Importer - existing audio files as tracks, without copying them
+// The file stays where it is. WAV and AIFF are read straight out of the file
+// mapped into memory, so the samples are never copied or decoded (the OS
+// keeps the pages it needs). Anything compressed (FLAC etc.) goes through the
+// block cache instead, so it's decoded once and shared with every reader.
+// Either way the track shows up straight away with its full length: its
+// thumbnail is filled on a background pool from the start of the file, and
+// the waveform fills in as the peaks come.
+//==============================================================================
+class AudioImporter
+{
+public:
+    // What an imported file is, known as soon as it's opened
+    struct Info
+    {
+        File file;
+        double sampleRate = 0.0;
+        int numChannels = 0;
+        int64 lengthInSamples = 0;
+        bool mapped = false; // Read in place, otherwise decoded through the block cache
+    };
+
+    explicit AudioImporter(int numWorkers = 2)
+        : pool(ThreadPoolOptions{}.withThreadName("Import Peaks")
+            .withNumberOfThreads(numWorkers)
+            .withDesiredThreadPriority(Thread::Priority::low))
+    {
+        formatManager.registerBasicFormats();
+    }
+
+    ~AudioImporter()
+    {
+        pool.removeAllJobs(true, 10000);
+    }
+
+    // For the file chooser
+    String getWildcard() const { return formatManager.getWildcardForAllFormats(); }
+
+    // Message thread - opens the file and starts filling the thumbnail with its peaks.
+    // The thumbnail has to stay until the import is cancelled (or finished)
+    bool addFile(const File& file, AudioThumbnail& thumbnail, int peakResolution, Info& info, String& error)
+    {
+        if (isImported(file))
+        {
+            error = file.getFileName() + " is already in the session";
+            return false;
+        }
+
+        unique_ptr<AudioFormatReader> reader = openMapped(file);
+        info.mapped = reader != nullptr;
+        if (reader == nullptr)
+            reader = blockCache->createReader(file);
+
+        if (reader == nullptr || reader->lengthInSamples <= 0 || reader->numChannels == 0)
+        {
+            error = "Can't read " + file.getFileName();
+            return false;
+        }
+
+        info.file = file;
+        info.sampleRate = reader->sampleRate;
+        info.numChannels = (int) reader->numChannels;
+        info.lengthInSamples = reader->lengthInSamples;
+
+        // The full length straight away, the peaks fill in from the left
+        thumbnail.reset(info.numChannels, info.sampleRate, info.lengthInSamples);
+
+        auto import = make_shared<Import>();
+        import->info = info;
+        imports[file.getFullPathName()] = import;
+
+        pool.addJob(new PeaksJob(import, move(reader), thumbnail, peakResolution), true);
+        return true;
+    }
+
+    // Message thread - the track is being deleted, stops filling its thumbnail (the file itself is left alone)
+    void cancel(const File& file)
+    {
+        auto found = imports.find(file.getFullPathName());
+        if (found == imports.end())
+            return;
+
+        found->second->cancelled = true;
+        pool.waitForJobToFinish(found->second->job, 10000);
+        imports.erase(found);
+    }
+
+    // Message thread - before the thumbnails go away
+    void cancelAll()
+    {
+        for (auto& import : imports)
+            import.second->cancelled = true;
+
+        pool.removeAllJobs(true, 10000);
+        imports.clear();
+    }
+
+    // Message thread - true for files that belong to someone else and must never be deleted
+    bool isImported(const File& file) const { return imports.find(file.getFullPathName()) != imports.end(); }
+
+    // 0..1 while the peaks are being made, 1 when they're done (or it isn't an import)
+    double getProgress(const File& file) const
+    {
+        auto found = imports.find(file.getFullPathName());
+        if (found == imports.end())
+            return 1.0;
+
+        auto& import = *found->second;
+        return import.finished ? 1.0 : (double) import.samplesDone / (double) jmax((int64) 1, import.info.lengthInSamples);
+    }
+
+    // Message thread - a reader straight from the mapped file if it was imported as one, otherwise nullptr
+    // (every reader maps it again, they all share the same pages)
+    unique_ptr<AudioFormatReader> createMappedReader(const File& file) const
+    {
+        auto found = imports.find(file.getFullPathName());
+        return found != imports.end() && found->second->info.mapped ? openMapped(file) : nullptr;
+    }
+
+    // Uncompressed WAV or AIFF, mapped as a whole - nullptr for anything else, or if it can't be mapped
+    static unique_ptr<AudioFormatReader> openMapped(const File& file)
+    {
+        unique_ptr<MemoryMappedAudioFormatReader> reader;
+        if (file.hasFileExtension("wav;bwf"))
+            reader.reset(WavAudioFormat().createMemoryMappedReader(file));
+        else if (file.hasFileExtension("aif;aiff"))
+            reader.reset(AiffAudioFormat().createMemoryMappedReader(file));
+
+        // Mapping fails when the address space is too small for the file, the block cache reads it then
+        if (reader == nullptr || !reader->mapEntireFile() || reader->getMappedSection().isEmpty())
+            return nullptr;
+
+        return reader;
+    }
+
+private:
+    struct Import
+    {
+        Info info;
+        ThreadPoolJob* job = nullptr; // Message thread only
+        atomic<int64> samplesDone{ 0 };
+        atomic<bool> finished{ false }, cancelled{ false };
+    };
+
+    // Reads the file from the start and adds it to the thumbnail one chunk at a time
+    class PeaksJob : public ThreadPoolJob
+    {
+    public:
+        PeaksJob(shared_ptr<Import> importToFill, unique_ptr<AudioFormatReader> readerToUse, AudioThumbnail& thumbnailToFill, int peakResolution)
+            : ThreadPoolJob("Import Peaks"), import(move(importToFill)), reader(move(readerToUse)),
+            thumbnail(thumbnailToFill),
+            chunkSize(jmax(AudioBlockCache::blockSize, peakResolution * 16)) // Whole peaks in every chunk
+        {
+            import->job = this;
+        }
+
+        JobStatus runJob() override
+        {
+            ThreadTopology::applyToCurrentThread(ThreadTopology::background);
+
+            int numChannels = (int) reader->numChannels;
+            int64 length = reader->lengthInSamples;
+            AudioBuffer<float> buffer(numChannels, chunkSize);
+
+            for (int64 done = 0; done < length; done += chunkSize)
+            {
+                if (shouldExit() || import->cancelled)
+                    return jobHasFinished;
+
+                // A compressed file is decoded into the block cache here, and read ahead of this by its prefetch threads
+                int num = (int) jmin((int64) chunkSize, length - done);
+                reader->read(&buffer, 0, num, done, true, true);
+                thumbnail.addBlock(done, buffer, 0, num);
+                import->samplesDone = done + num;
+            }
+
+            import->finished = true;
+            return jobHasFinished;
+        }
+
+    private:
+        shared_ptr<Import> import;
+        unique_ptr<AudioFormatReader> reader;
+        AudioThumbnail& thumbnail;
+        const int chunkSize;
+    };
+
+    AudioFormatManager formatManager;
+    SharedResourcePointer<AudioBlockCache> blockCache;
+    map<String, shared_ptr<Import>> imports; // By full path, message thread only
+
+    ThreadPool pool; // Last, so its jobs are finished before anything they use goes away
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AudioImporter)
+};
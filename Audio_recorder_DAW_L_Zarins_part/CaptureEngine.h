@@ -0,0 +1,1028 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "AnalysisThread.h"
+#include "InputMonitor.h"
+#include "SilenceGate.h"
+#include "LoudnessMeter.h"
+#include "Spectrogram.h"
+#include "OnsetDetector.h"
+#include "TripleBuffer.h"
+#include "RealtimeChecker.h"
+#include "SegmentedTake.h"
+#include "CaptureWavWriter.h"
+#include "CaptureTap.h"
+#include "ThreadTopology.h"
+#include "TakeDestination.h"
+#include "DeviceAggregator.h"
+#include "TakeContinuity.h"
+#include "MemoryGovernor.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Capture Settings - what a take is recorded as
+//==============================================================================
+struct CaptureSettings
+{
+    int numChannels = 2; // Stereo by default
+    int bitsPerSample = 16; // 16 bit like the original recorder
+    String formatName = "wav"; // File extension of the format - "wav", "aiff" or "flac"
+
+    // Routing matrix - track i records device input inputRouting[i] (0 based)
+    // Empty means track i records input i for the first numChannels inputs
+    Array<int> inputRouting;
+    bool monoFilePerChannel = false; // true = one mono file per track instead of one multichannel file
+    GateSettings gate; // Silence gated recording, off by default
+    bool fiveOneLayout = false; // The 6 tracks are L, R, C, LFE, Ls, Rs - the loudness weights them like BS.1770 (otherwise all the same)
+
+    // Rolling takes - a new file (set of files) every segmentSeconds and/or before it gets bigger than segmentMegabytes
+    // 0 and 0 = one file for the whole take (WAV turns into RF64 past 4 GB, AIFF can't, so it always rolls over before)
+    double segmentSeconds = 0.0;
+    int segmentMegabytes = 0;
+
+    String tapName; // Publish the live tracks to other programs through the shared memory tap with this name (empty = off)
+
+    // More copies of every take (a backup disk, a safety copy 12 dB down), each with its own writer thread.
+    // The take is recorded even if some of them fail, how they did is in the take's "destinations" section
+    Array<DestinationSettings> mirrors;
+
+    int getNumTracks() const { return inputRouting.isEmpty() ? numChannels : inputRouting.size(); }
+    int getInputForTrack(int track) const { return inputRouting.isEmpty() ? track : inputRouting[track]; }
+
+    // Samples in every segment file, 0 = not rolling (a segment is never shorter than a second)
+    int64 getSegmentLength(double sampleRate) const
+    {
+        int64 megabytes = segmentMegabytes > 0 ? segmentMegabytes : (formatName == "aiff" ? 4000 : 0);
+        int64 length = segmentSeconds > 0.0 ? (int64) (segmentSeconds * sampleRate) : 0;
+
+        if (megabytes > 0)
+        {
+            int64 frameBytes = (int64) (monoFilePerChannel ? 1 : getNumTracks()) * (bitsPerSample / 8);
+            int64 bySize = (megabytes * 1024 * 1024 - 65536) / jmax((int64) 1, frameBytes); // Room for the header
+            length = length > 0 ? jmin(length, bySize) : bySize;
+        }
+
+        return length > 0 ? jmax(length, (int64) sampleRate) : 0;
+    }
+
+    Array<int> getTrackInputs() const
+    {
+        Array<int> inputs;
+        for (int track = 0; track < getNumTracks(); ++track)
+            inputs.add(getInputForTrack(track));
+        return inputs;
+    }
+
+    // Reads a list like "1,2,5-8" (1 based, like the channel names on the interface) into the routing
+    static Array<int> parseRouting(const String& text)
+    {
+        Array<int> routing;
+        for (auto& part : StringArray::fromTokens(text, ",", {}))
+        {
+            int first = part.upToFirstOccurrenceOf("-", false, false).getIntValue();
+            int last = part.contains("-") ? part.fromFirstOccurrenceOf("-", false, false).getIntValue() : first;
+
+            for (int input = first; input <= last && input > 0; ++input)
+                routing.add(input - 1);
+        }
+        return routing;
+    }
+};
+
+//==============================================================================
+// Capture State - what the audio thread did in its last block
+// Published once per block, the UI and the headless metrics read a copy of
+// it, so the level, the playhead and the sample count always belong together.
+//==============================================================================
+struct CaptureState
+{
+    static constexpr int maxTracks = 64;
+
+    bool isRecording = false; // Audio of a take went to the writers in this block
+    int64 nextSampleNum = 0; // Samples recorded so far
+    double playheadPosition = 0.0; // Same in seconds
+    float currentLevel = 0.0f; // Average level of the first track
+    int droppedBlocks = 0; // Blocks the writer could not take
+    int numTracks = 0;
+    array<float, maxTracks> trackPeaks{}; // Last block peak of every track
+};
+
+//==============================================================================
+// Capture Engine - the recording pipeline without any UI
+// Gets the input from the audio callback, sends it to the file writer and
+// measures the level. The main window and the headless mode both use it, so
+// there is only one place where audio gets recorded.
+//==============================================================================
+class CaptureEngine : public AudioSource
+{
+public:
+    static constexpr int maxTracks = CaptureState::maxTracks; // Most inputs one take can record
+
+    CaptureEngine()
+    {
+        formatManager.registerBasicFormats(); // registers the formats
+        trackBuffer.setSize(maxTracks, 512);
+        mirrorBuffer.setSize(maxTracks, 4096);
+
+        analysisThread.addStage(&loudnessMeter);
+        analysisThread.addStage(&spectrogram);
+        analysisThread.addStage(&onsetDetector);
+
+        backgroundThread.addTimeSliceClient(&writerRole); // Waits there until the thread starts
+    }
+
+    ~CaptureEngine() override
+    {
+        stopTake();
+        backgroundThread.removeTimeSliceClient(&writerRole);
+        backgroundThread.stopThread(2000);
+    }
+
+    // Also called when the device restarts during a take (new buffer size or rate, or it came back after it was
+    // lost) - the take goes on with the same writers and thumbnail, converted to its own rate if the device's changed
+    void prepareToPlay(int samplesPerBlockExpected, double newSampleRate) override
+    {
+        sampleRate = newSampleRate;
+        deviceBlockSize = samplesPerBlockExpected;
+        if (!isRecording)
+            takeSampleRate = sampleRate;
+
+        // Scratch buffer for the routed tracks, bigger blocks are handled in pieces
+        if (samplesPerBlockExpected > trackBuffer.getNumSamples())
+            trackBuffer.setSize(maxTracks, samplesPerBlockExpected);
+
+        monitor.prepare(samplesPerBlockExpected);
+
+        if (auto* devices = aggregator.load())
+            devices->prepare(sampleRate, samplesPerBlockExpected);
+
+        if (isRecording)
+        {
+            rateConverter.prepare(sampleRate, takeSampleRate, numTakeTracks, trackBuffer.getNumSamples());
+            interruptions.deviceStarted(sampleRate, samplesPerBlockExpected, rateConverter.isActive());
+        }
+    }
+
+    // Inputs of more interfaces, numbered after the device's own (message thread, between takes).
+    // The engine pulls them every block, so they stay drift corrected while nothing is recorded too.
+    // Whoever owns it prepares it for the running device, after that prepareToPlay keeps it up to date
+    void setAggregator(DeviceAggregator* devices) { aggregator = devices; }
+
+    void getNextAudioBlock(const AudioSourceChannelInfo& bufferToFill) override //it has like audio data from Juce itself and it stores the audio i make
+    {
+        ThreadTopology::applyToCurrentThread(ThreadTopology::audio); // A system call the first time only
+        const RealtimeChecker::ScopedRealtime realtime; // Debug builds report anything in here that allocates, locks or waits
+        bool capturing = false;
+
+        // Every block, recording or not, so the secondary devices' rings never fill up
+        DeviceAggregator* devices = aggregator.load();
+        aggregated = devices != nullptr && !devices->isEmpty() && devices->pull(bufferToFill.numSamples) ? devices : nullptr;
+        firstAggregated = devices != nullptr && !devices->isEmpty() ? devices->getFirstInput() : maxTracks; // Even if the pull failed
+
+        if (isRecording)
+        {
+            // Only tried, never waited for - it is held just while a take starts or stops, and that block can go
+            const ScopedTryLock sl(writerLock);
+
+            if (sl.isLocked() && writersActive)
+            {
+                capturing = true;
+
+                if (newTake) // The counters belong to the audio thread, so it resets them itself
+                {
+                    newTake = false;
+                    nextSampleNum = 0;
+                    droppedBlocks = 0;
+                    currentLevel = 0.0f;
+                    trackPeaks.fill(0.0f);
+                }
+
+                // The first samples of a take are from before the start, they left the outputs a round trip ago
+                int samplesDone = (int) jmin((int64) bufferToFill.numSamples, samplesToSkip);
+                samplesToSkip -= samplesDone;
+
+                while (samplesDone < bufferToFill.numSamples)
+                {
+                    int numSamples = jmin(bufferToFill.numSamples - samplesDone, trackBuffer.getNumSamples());
+
+                    routeInputs(*bufferToFill.buffer, bufferToFill.startSample, samplesDone, numSamples);
+
+                    // The device came back at another rate, the take keeps its own
+                    if (rateConverter.isActive())
+                        captureTracks(rateConverter.getOutput(), rateConverter.process(trackBuffer, numTakeTracks, numSamples));
+                    else
+                        captureTracks(trackBuffer, numSamples);
+
+                    samplesDone += numSamples;
+                }
+            }
+        }
+
+        publishState(capturing);
+
+        // Outputs get the monitored inputs, or silence when monitoring is off (after recording, as the inputs get overwritten)
+        monitor.process(*bufferToFill.buffer, bufferToFill.startSample, bufferToFill.numSamples);
+    }
+
+    // The device stopped - during a take that's an interruption, the take waits for it to start again
+    void releaseResources() override
+    {
+        if (isRecording)
+            interruptions.deviceStopped(nextSampleNum);
+    }
+
+    // Opens the file(s) and starts writing into them, returns false if a file or writer could not be created
+    bool startTake(const File& file, const CaptureSettings& settings, AudioThumbnail* thumbnail)
+    {
+        if (isRecording)
+            return false;
+
+        if (finalizing) // The writers, the analysis and the file list still belong to the last take
+        {
+            lastError = "The last take is still being finished";
+            return false;
+        }
+
+        int numTracks = settings.getNumTracks();
+        if (numTracks < 1 || numTracks > maxTracks)
+        {
+            lastError = "A take needs between 1 and " + String(maxTracks) + " tracks";
+            return false;
+        }
+
+        AudioFormat* format = formatManager.findFormatForFileExtension(settings.formatName);
+        if (format == nullptr)
+        {
+            lastError = "Unknown audio format: " + settings.formatName;
+            return false;
+        }
+
+        if (!format->getPossibleBitDepths().contains(settings.bitsPerSample))
+        {
+            lastError = format->getFormatName() + " can't be written with " + String(settings.bitsPerSample) + " bits";
+            return false;
+        }
+
+        // One multichannel file, or one mono file per track named like Recording_..._ch01.wav
+        Array<File> files;
+        if (settings.monoFilePerChannel)
+        {
+            for (int track = 0; track < numTracks; ++track)
+                files.add(file.getSiblingFile(file.getFileNameWithoutExtension()
+                    + "_ch" + String(track + 1).paddedLeft('0', 2) + file.getFileExtension()));
+        }
+        else
+        {
+            files.add(file);
+        }
+
+        // Mirrors are never rolled, one file each has to hold the whole take (WAV and FLAC can, AIFF can't past 4 GB)
+        takeSampleRate = sampleRate; // The files keep it, even if the device changes during the take
+        segmentLength = settings.getSegmentLength(takeSampleRate);
+        if (segmentLength > 0 && !settings.mirrors.isEmpty() && dynamic_cast<AiffAudioFormat*>(format) != nullptr)
+        {
+            lastError = "Rolling AIFF takes can't be mirrored, one AIFF file can't hold the whole take";
+            return false;
+        }
+
+        Array<File> mirroredFiles = files;
+
+        // Rolling takes start with part 1 of every file, the parts after it are opened by the segment roller
+        if (segmentLength > 0)
+        {
+            takeBaseFiles = files;
+            for (auto& takeFile : files)
+                takeFile = SegmentedTake::getSegmentFile(takeFile, 0);
+        }
+
+        // WAV takes are converted by the kernel for their channel count and bits, picked once here
+        takeKernel = dynamic_cast<WavAudioFormat*>(format) != nullptr
+            ? CaptureKernels::find(settings.monoFilePerChannel ? 1 : numTracks, settings.bitsPerSample) : nullptr;
+
+        primaryHealth.reset();
+        OwnedArray<AudioFormatWriter> writers;
+        for (auto& takeFile : files)
+        {
+            auto* writer = createWriter(*format, takeFile, settings.monoFilePerChannel ? 1 : numTracks, settings.bitsPerSample, primaryHealth, lastError);
+            if (writer == nullptr)
+                return false;
+
+            writers.add(writer);
+        }
+
+        takeSettings = settings;
+        takeFiles = files;
+        takeFormat = format;
+        samplesToSkip = latencyCompensation;
+
+        // The routing is copied into a plain array so the audio thread never touches the Array
+        numTakeTracks = numTracks;
+        for (int track = 0; track < numTracks; ++track)
+            trackInputs[(size_t) track] = settings.getInputForTrack(track);
+
+        loudnessMeter.setFiveOneLayout(settings.fiveOneLayout && numTracks == 6);
+        analysisThread.startTake(takeSampleRate, numTracks);
+        gate.startTake(settings.gate, takeSampleRate, numTracks);
+        rateConverter.prepare(sampleRate, takeSampleRate, numTracks, trackBuffer.getNumSamples());
+        interruptions.reset(sampleRate, deviceBlockSize);
+        lastTakeAnalysis = var();
+
+        // The take is recorded even if the tap can't be made, other programs just don't get it
+        // (why is in lastError, isTapOpen() says whether it worked)
+        String tapError;
+        if (settings.tapName.isEmpty())
+            tap.close();
+        else if (!tap.open(settings.tapName, numTracks, takeSampleRate, tapError))
+            lastError = tapError;
+
+        backgroundThread.startThread(); // Start background thread for file writing
+
+        // Every writer gets its own buffer, 32768 samples each like before
+        // (plus room for the whole pre-roll, a gate opening writes it all in one block)
+        writerBufferSize = 32768 + (settings.gate.enabled ? (int) (settings.gate.preRollMs * 0.001 * takeSampleRate) : 0);
+        threadedWriters.clear();
+        while (!writers.isEmpty())
+            threadedWriters.add(new AudioFormatWriter::ThreadedWriter(writers.removeAndReturn(0), // create threa writet to not block the audio thread
+                backgroundThread,
+                writerBufferSize));
+
+        openMirrors(*format, mirroredFiles, settings, numTracks);
+
+        segmentPosition = 0;
+        segmentLengths.clear();
+        segmentLengths.reserve(maxSegments);
+        {
+            const ScopedLock sl(segmentLock);
+            segmentFiles.clear();
+            segmentFiles.add(files);
+            nextSegment = 1;
+        }
+
+        if (segmentLength > 0)
+            backgroundThread.addTimeSliceClient(&segmentRoller); // Opens the next part long before it's needed
+
+        accountTakeMemory();
+
+        const ScopedLock sl(writerLock);
+        liveThumbnail = thumbnail;
+        newTake = true; // Counters start from 0 in the first block
+        writersActive = true; //for thread saftey
+        isRecording = true;
+        return true;
+    }
+
+    // What a finished take ended up as, handed to the stopTakeAsync callback
+    struct FinishedTake
+    {
+        Array<File> files; // Every file of the take (all parts of a rolling one)
+        var analysis; // The same as getLastTakeAnalysis()
+        int64 length = 0; // Samples
+        int droppedBlocks = 0;
+    };
+
+    // Message thread - stops writing straight away, everything slow (flushing the writers, the final
+    // headers, fsync, the analysis and the sidecar) happens on the finalizer thread. onFinished is called
+    // on the message thread once the take is on disk, a new take can't start before that
+    void stopTakeAsync(function<void(const FinishedTake&)> onFinished)
+    {
+        if (!isRecording)
+            return;
+
+        isRecording = false;
+
+        {
+            const ScopedLock sl(writerLock);
+            writersActive = false; //signal to audi thread to stop writing
+            liveThumbnail = nullptr;
+        }
+
+        tap.stop();
+
+        finalizing = true;
+        finalizedEvent.reset();
+
+        finalizer.addJob([this, onFinished]
+        {
+            ThreadTopology::applyToCurrentThread(ThreadTopology::writer);
+            finalizeTake();
+            FinishedTake take{ takeFiles, lastTakeAnalysis, nextSampleNum, droppedBlocks };
+
+            finalizing = false;
+            finalizedEvent.signal();
+
+            if (onFinished != nullptr)
+                MessageManager::callAsync([onFinished, take] { onFinished(take); });
+        });
+    }
+
+    // Stops and waits until the files are finished (headless mode and shutdown, never on the message thread while the UI runs)
+    void stopTake()
+    {
+        stopTakeAsync(nullptr);
+        waitUntilFinalized();
+    }
+
+    bool isFinalizing() const { return finalizing; }
+    void waitUntilFinalized() { if (finalizing) finalizedEvent.wait(); }
+
+    // Round trip of the device in samples - every take drops this many samples from its start, so it
+    // lines up with what was playing when it was recorded (0 = not calibrated). Message thread, between takes
+    void setLatencyCompensation(int samples) { latencyCompensation = jmax(0, samples); }
+    int getLatencyCompensation() const { return latencyCompensation; }
+
+    // Newest state the audio thread published, read by one thread only (the message thread, or the headless thread)
+    // It's a copy, so everything in it is from the same block even while the audio thread goes on
+    CaptureState getState() const { return publishedState.read(); }
+
+    // Primary first, then every mirror - file, gain, status (ok, dropping or failed), dropped blocks and bytes
+    // Message thread, while recording too (it's all atomics)
+    var getDestinationReport() const
+    {
+        Array<var> report;
+        report.add(primaryHealth.getReport(getTakeFile(), 0.0f));
+        for (auto* mirror : mirrors)
+            report.add(mirror->getReport());
+        return report;
+    }
+
+    int getNumFailedDestinations() const
+    {
+        int failed = primaryHealth.failed ? 1 : 0;
+        for (auto* mirror : mirrors)
+            failed += mirror->health.failed ? 1 : 0;
+        return failed;
+    }
+
+    int getNumMirrors() const { return mirrors.size(); }
+
+    // Between takes (after stopTake) - exact numbers of the last take, the state can still be a block behind
+    bool isTapOpen() const { return tap.isOpen(); }
+    File getTapFile() const { return tap.getFile(); }
+
+    int64 getTakeLength() const { return isRecording ? 0 : nextSampleNum; }
+    int getDroppedBlocks() const { return isRecording ? 0 : droppedBlocks; }
+
+    // Getter methods
+    bool getIsRecording() const { return isRecording; } // Set by startTake/stopTake, the audio thread follows from its next block
+    double getSampleRate() const { return sampleRate; } // Of the device
+    double getTakeSampleRate() const { return takeSampleRate; } // Of the take being recorded (or the next one)
+    int getNumInterruptions() const { return interruptions.getNumInterruptions(); } // Device restarts and losses in this take
+    bool isWaitingForDevice() const { return isRecording && interruptions.isDeviceStopped(); }
+    int getNumTakeTracks() const { return numTakeTracks; }
+    const LoudnessMeter& getLoudnessMeter() const { return loudnessMeter; }
+    SpectrogramAnalyser& getSpectrogram() { return spectrogram; } // Columns are read on the message thread
+    const var& getLastTakeAnalysis() const { return lastTakeAnalysis; } // Results of the last finished take, by stage name
+    int getAnalysisOverruns() const { return analysisThread.getOverruns(); }
+    const CaptureSettings& getTakeSettings() const { return takeSettings; }
+    File getTakeFile() const { return takeFiles[0]; } // First file of the take
+    const Array<File>& getTakeFiles() const { return takeFiles; } // While recording only the first part of a rolling take
+    int64 getSegmentLength() const { return segmentLength; } // Of the current (or last) take, 0 = one file
+    const String& getLastError() const { return lastError; }
+    const SilenceGate& getGate() const { return gate; }
+    AudioFormatManager& getFormatManager() { return formatManager; }
+    InputMonitor& getMonitor() { return monitor; } // Direct monitoring of the armed inputs
+
+private:
+    // Finalizer thread - everything a stopped take still needs before its files are done
+    void finalizeTake()
+    {
+        if (segmentLength > 0)
+            finishSegments();
+
+        threadedWriters.clear(); //close files and clear the buffers (flushes what's left and writes the final headers)
+        writerMemory.set(0);
+
+        for (auto& file : takeFiles) // On the disk, not only in the OS cache, before anyone is told it's done
+            syncToDisk(file);
+
+        // Every destination flushes on its own - a dead one is only waited for here, never while recording
+        for (auto* mirror : mirrors)
+        {
+            mirror->finish();
+            if (!mirror->health.failed)
+                for (auto& file : mirror->files)
+                    syncToDisk(file);
+        }
+
+        // Finish the analysis and keep the results with the recording
+        lastTakeAnalysis = analysisThread.finishTake();
+        if (auto* results = lastTakeAnalysis.getDynamicObject())
+            for (auto& section : results->getProperties())
+                TakeSidecar::setSection(getTakeFile(), section.name, section.value);
+
+        // Gated takes keep the timing index next to them, the file alone has lost where its regions were
+        if (takeSettings.gate.enabled)
+        {
+            var gateResults = gate.getResults(nextSampleNum);
+            TakeSidecar::setSection(getTakeFile(), "gate", gateResults);
+            if (auto* results = lastTakeAnalysis.getDynamicObject())
+                results->setProperty("gate", gateResults);
+        }
+
+        auto* latency = new DynamicObject();
+        latency->setProperty("compensation_samples", latencyCompensation);
+        TakeSidecar::setSection(getTakeFile(), "latency", var(latency));
+
+        // Where the device went away during the take, the file goes on straight after every gap
+        if (interruptions.getNumInterruptions() > 0)
+        {
+            var report = interruptions.getReport();
+            TakeSidecar::setSection(getTakeFile(), "interruptions", report);
+            if (auto* results = lastTakeAnalysis.getDynamicObject())
+                results->setProperty("interruptions", report);
+        }
+
+        // What the program held while the take was recorded, against the budget
+        TakeSidecar::setSection(getTakeFile(), "memory", memoryGovernor->getReport());
+
+        // Which inputs came from other interfaces, and how far their clocks were off
+        if (auto* devices = aggregator.load(); devices != nullptr && !devices->isEmpty())
+        {
+            var aggregation = devices->getReport();
+            TakeSidecar::setSection(getTakeFile(), "aggregation", aggregation);
+            if (auto* results = lastTakeAnalysis.getDynamicObject())
+                results->setProperty("aggregation", aggregation);
+        }
+
+        // Rolling takes get the index that puts their parts back together
+        if (segmentLength > 0)
+        {
+            var index;
+            {
+                const ScopedLock sl(segmentLock);
+                index = SegmentedTake::makeIndex(segmentLengths, segmentFiles, segmentLength);
+            }
+
+            TakeSidecar::setSection(getTakeFile(), "segments", index);
+            if (auto* results = lastTakeAnalysis.getDynamicObject())
+                results->setProperty("segments", index);
+        }
+
+        // How every destination did, and the mirrors get the same sidecar so a backup is complete on its own
+        if (!mirrors.isEmpty())
+        {
+            var destinations = getDestinationReport();
+            TakeSidecar::setSection(getTakeFile(), "destinations", destinations);
+            if (auto* results = lastTakeAnalysis.getDynamicObject())
+                results->setProperty("destinations", destinations);
+
+            for (auto* mirror : mirrors)
+                if (!mirror->files.isEmpty())
+                    TakeSidecar::getFileFor(getTakeFile()).copyFileTo(TakeSidecar::getFileFor(mirror->files[0]));
+        }
+    }
+
+    // FileOutputStream::flush() is fsync (FlushFileBuffers on Windows), opening it doesn't change the file
+    static void syncToDisk(const File& file)
+    {
+        FileOutputStream stream(file);
+        if (stream.openedOk())
+            stream.flush();
+    }
+
+    //==========================================================================
+    // Rolling segments
+    static constexpr int maxSegments = 100000; // Lengths are kept in a reserved vector, after that the last part just grows
+    static constexpr int maxFinishedSegments = 8;
+
+    // The writers and files of one part of a rolling take
+    struct Segment
+    {
+        OwnedArray<AudioFormatWriter::ThreadedWriter> writers;
+        Array<File> files;
+    };
+
+    // Runs on the writer thread - closes the parts the audio thread is done with and opens the next one
+    struct SegmentRoller : public TimeSliceClient
+    {
+        explicit SegmentRoller(CaptureEngine& engineToUse) : engine(engineToUse) {}
+        int useTimeSlice() override { return engine.rollSegments(); }
+        CaptureEngine& engine;
+    };
+
+    int rollSegments()
+    {
+        finishedFifo.read(finishedFifo.getNumReady()).forEach([this](int index)
+        {
+            delete finishedSegments[(size_t) index]; // Flushes and closes the files of that part
+            finishedSegments[(size_t) index] = nullptr;
+        });
+
+        if (preparedSegment.load() != nullptr)
+            return 100;
+
+        int segment;
+        Array<File> baseFiles;
+        {
+            const ScopedLock sl(segmentLock);
+            segment = nextSegment;
+            baseFiles = takeBaseFiles;
+        }
+
+        auto next = make_unique<Segment>();
+        String error;
+        for (auto& baseFile : baseFiles)
+        {
+            File file = SegmentedTake::getSegmentFile(baseFile, segment);
+            auto* writer = createWriter(*takeFormat, file, takeSettings.monoFilePerChannel ? 1 : numTakeTracks, takeSettings.bitsPerSample, primaryHealth, error);
+            if (writer == nullptr)
+            {
+                for (auto& created : next->files)
+                    created.deleteFile();
+                return 500; // Tried again later, until then the current part just gets longer
+            }
+
+            next->writers.add(new AudioFormatWriter::ThreadedWriter(writer, backgroundThread, writerBufferSize));
+            next->files.add(file);
+        }
+
+        {
+            const ScopedLock sl(segmentLock);
+            segmentFiles.add(next->files);
+            ++nextSegment;
+        }
+
+        preparedSegment.store(next.release());
+        return 100;
+    }
+
+    // Audio thread - the current part is full, the prepared one takes over from the next sample
+    // Returns false if it isn't ready, the current part then goes on and it's tried again with the next write
+    bool startNextSegment()
+    {
+        Segment* next = preparedSegment.load();
+        if (next == nullptr || finishedFifo.getFreeSpace() == 0 || segmentLengths.size() >= (size_t) maxSegments - 1)
+            return false;
+
+        preparedSegment.store(nullptr);
+        threadedWriters.swapWith(next->writers); // No allocation, the segment now holds the full part's writers
+        finishedFifo.write(1).forEach([this, next](int index) { finishedSegments[(size_t) index] = next; });
+
+        segmentLengths.push_back(segmentPosition);
+        segmentPosition = 0;
+        return true;
+    }
+
+    // Finalizer thread (from finalizeTake), once the audio thread stopped writing - closes everything and deletes the part
+    // that was never used. The message thread leaves the take's files alone until it's told the take is finished
+    // (startTake refuses while finalizing), so takeFiles can be rebuilt here
+    void finishSegments()
+    {
+        backgroundThread.removeTimeSliceClient(&segmentRoller);
+
+        finishedFifo.read(finishedFifo.getNumReady()).forEach([this](int index)
+        {
+            delete finishedSegments[(size_t) index];
+            finishedSegments[(size_t) index] = nullptr;
+        });
+
+        segmentLengths.push_back(segmentPosition); // The last part
+
+        const ScopedLock sl(segmentLock);
+        if (unique_ptr<Segment> unused{ preparedSegment.exchange(nullptr) })
+        {
+            Array<File> files = unused->files;
+            unused.reset();
+            for (auto& file : files)
+                file.deleteFile();
+            segmentFiles.removeLast();
+        }
+
+        takeFiles.clear();
+        for (auto& files : segmentFiles)
+            takeFiles.addArray(files);
+    }
+
+    // Every file of every destination is written through a stream that keeps that destination's health
+    AudioFormatWriter* createWriter(AudioFormat& format, const File& file, int numChannels, int bitsPerSample,
+                                    DestinationHealth& health, String& error)
+    {
+        if (file.exists())
+            file.deleteFile();
+
+        unique_ptr<FileOutputStream> stream(file.createOutputStream());
+        if (stream == nullptr)
+        {
+            error = "Could not create " + file.getFullPathName();
+            return nullptr;
+        }
+
+        auto fileStream = make_unique<HealthCheckingStream>(move(stream), health);
+
+        // WAV files switch to RF64 by themselves when they grow past 4 GB (both writers)
+        AudioFormatWriter* writer = takeKernel != nullptr
+            ? new CaptureWavWriter(fileStream.get(), takeSampleRate, numChannels, bitsPerSample, takeKernel)
+            : format.createWriterFor(fileStream.get(),
+                takeSampleRate,
+                (unsigned int) numChannels,
+                bitsPerSample,
+                {},
+                0);
+
+        if (writer == nullptr)
+        {
+            error = "Could not create a " + format.getFormatName() + " writer";
+            return nullptr;
+        }
+
+        fileStream.release(); // Writer owns the stream now
+        return writer;
+    }
+
+    // Copies each routed device input into its track (the copies are SIMD), inputs past the device's own
+    // come from the aggregated devices (silence in a block they couldn't be pulled for). offset is where this piece
+    // starts in the device block
+    void routeInputs(const AudioBuffer<float>& input, int startSample, int offset, int numSamples)
+    {
+        for (int track = 0; track < numTakeTracks; ++track)
+        {
+            int inputChannel = trackInputs[(size_t) track];
+            float* dest = trackBuffer.getWritePointer(track);
+
+            if (inputChannel >= firstAggregated && aggregated != nullptr && inputChannel - firstAggregated < aggregated->getNumInputs())
+                FloatVectorOperations::copy(dest, aggregated->getInput(inputChannel - firstAggregated) + offset, numSamples);
+            else if (inputChannel < input.getNumChannels() && inputChannel < firstAggregated)
+                FloatVectorOperations::copy(dest, input.getReadPointer(inputChannel, startSample + offset), numSamples);
+            else
+                FloatVectorOperations::clear(dest, numSamples); // Input is not open on the device
+        }
+    }
+
+    // Audio thread, end of every block - fills the writer's slot completely and swaps it in
+    void publishState(bool capturing)
+    {
+        CaptureState& state = publishedState.getWriteSlot();
+        state.isRecording = capturing;
+        state.nextSampleNum = nextSampleNum;
+        state.playheadPosition = nextSampleNum / takeSampleRate; //calculates time
+        state.currentLevel = currentLevel;
+        state.droppedBlocks = droppedBlocks;
+        state.numTracks = numTakeTracks;
+        state.trackPeaks = trackPeaks;
+        publishedState.publish();
+    }
+
+    // Rolling takes are split here, on the exact sample where the part is full
+    void writeTracks(const float* const* tracks, int numSamples)
+    {
+        int done = 0;
+        while (done < numSamples)
+        {
+            if (segmentLength > 0 && segmentPosition >= segmentLength)
+                startNextSegment();
+
+            int num = numSamples - done;
+            if (segmentLength > 0 && segmentPosition < segmentLength)
+                num = (int) jmin((int64) num, segmentLength - segmentPosition);
+
+            for (int track = 0; track < numTakeTracks; ++track)
+                chunkPointers[(size_t) track] = tracks[track] + done;
+
+            writeToFiles(chunkPointers.data(), num);
+            segmentPosition += num;
+            done += num;
+        }
+    }
+
+    void writeToFiles(const float* const* tracks, int numSamples)
+    {
+        if (takeSettings.monoFilePerChannel)
+        {
+            for (int track = 0; track < threadedWriters.size(); ++track)
+                if (!threadedWriters.getUnchecked(track)->write(tracks + track, numSamples))
+                    countDroppedBlock(); // Writer buffer was full, this block is lost
+        }
+        else if (!threadedWriters.getFirst()->write(tracks, numSamples)) //writes audio buffer to file
+        {
+            countDroppedBlock();
+        }
+
+        if (!mirrors.isEmpty())
+            writeToMirrors(tracks, numSamples);
+    }
+
+    void countDroppedBlock()
+    {
+        ++droppedBlocks;
+        ++primaryHealth.droppedBlocks;
+    }
+
+    // The same tracks again for every mirror, through the scratch buffer if the mirror has a gain
+    void writeToMirrors(const float* const* tracks, int numSamples)
+    {
+        for (auto* mirror : mirrors)
+        {
+            if (mirror->gain == 1.0f)
+            {
+                writeToMirror(*mirror, tracks, numSamples);
+                continue;
+            }
+
+            for (int done = 0; done < numSamples;)
+            {
+                int num = jmin(numSamples - done, mirrorBuffer.getNumSamples()); // A gate's pre-roll can be longer than the buffer
+                for (int track = 0; track < numTakeTracks; ++track)
+                    FloatVectorOperations::copyWithMultiply(mirrorBuffer.getWritePointer(track), tracks[track] + done, mirror->gain, num);
+
+                writeToMirror(*mirror, mirrorBuffer.getArrayOfReadPointers(), num);
+                done += num;
+            }
+        }
+    }
+
+    void writeToMirror(TakeMirror& mirror, const float* const* tracks, int numSamples)
+    {
+        if (takeSettings.monoFilePerChannel)
+        {
+            for (int track = 0; track < numTakeTracks; ++track)
+                mirror.write(track, tracks + track, numSamples);
+        }
+        else
+        {
+            mirror.write(0, tracks, numSamples);
+        }
+    }
+
+    // Message thread, in startTake - a mirror that can't be made is kept as failed, the take goes on without it
+    void openMirrors(AudioFormat& format, const Array<File>& files, const CaptureSettings& settings, int numTracks)
+    {
+        mirrors.clear(); // The last take's, their files were closed when it was finished
+
+        for (int index = 0; index < settings.mirrors.size(); ++index)
+        {
+            auto* mirror = mirrors.add(new TakeMirror(settings.mirrors.getReference(index), index));
+
+            for (auto& file : files)
+            {
+                File mirrorFile = mirror->settings.getFileFor(file);
+                mirror->files.add(mirrorFile);
+                mirrorFile.getParentDirectory().createDirectory();
+
+                String error;
+                auto* writer = createWriter(format, mirrorFile, settings.monoFilePerChannel ? 1 : numTracks, settings.bitsPerSample, mirror->health, error);
+                if (writer == nullptr)
+                {
+                    mirror->health.fail(error);
+                    mirror->writers.clear();
+                    break;
+                }
+
+                mirror->writers.add(new AudioFormatWriter::ThreadedWriter(writer, mirror->thread, writerBufferSize));
+            }
+
+            mirror->thread.startThread();
+        }
+    }
+
+    // Message thread, in startTake - the take's buffers go into the memory governor's accounts. Every writer
+    // (and every mirror's) has writerBufferSize samples per channel, a rolling take opens the next part ahead
+    void accountTakeMemory()
+    {
+        size_t writerBytes = sizeof(float) * (size_t) writerBufferSize * (size_t) numTakeTracks;
+        size_t destinations = (size_t) (1 + mirrors.size());
+        writerMemory.set(writerBytes * destinations * (segmentLength > 0 ? 2 : 1)
+            + (mirrors.isEmpty() ? 0 : sizeof(float) * (size_t) (mirrorBuffer.getNumChannels() * mirrorBuffer.getNumSamples())));
+
+        preRollMemory.set(gate.getMemoryUsed());
+        analysisMemory.set(analysisThread.getMemoryUsed());
+    }
+
+    // Audio thread - routed tracks at the take's rate, from here on everything is the same whatever the device did
+    void captureTracks(const AudioBuffer<float>& tracks, int numSamples)
+    {
+        if (numSamples <= 0)
+            return;
+
+        tap.write(tracks, numTakeTracks, numSamples); // Other programs get every sample, gated or not
+
+        if (gate.isEnabled()) // Only the active parts (and their pre-roll) reach the file
+            gate.process(tracks, numSamples, nextSampleNum,
+                [this](const float* const* gated, int num) { writeTracks(gated, num); });
+        else
+            writeTracks(tracks.getArrayOfReadPointers(), numSamples);
+
+        analysisThread.push(tracks, numTakeTracks, numSamples); // Copy for loudness etc, analysed on its own thread
+        measureTracks(tracks, numSamples);
+
+        // Add audio data to the thumbnail for waveform visualization
+        if (liveThumbnail != nullptr)
+            liveThumbnail->addBlock(nextSampleNum, tracks, 0, numSamples);
+
+        nextSampleNum += numSamples;
+    }
+
+    // Peak of every track with one SIMD min/max pass each, so 64 tracks are still cheap
+    void measureTracks(const AudioBuffer<float>& tracks, int numSamples)
+    {
+        for (int track = 0; track < numTakeTracks; ++track)
+        {
+            auto range = FloatVectorOperations::findMinAndMax(tracks.getReadPointer(track), numSamples);
+            trackPeaks[(size_t) track] = jmax(-range.getStart(), range.getEnd());
+        }
+
+        auto* channelData = tracks.getReadPointer(0); // calculates audio lever for meter display at the exact moment
+        float sum = 0.0f;
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            sum += abs(channelData[i]);
+        }
+
+        currentLevel = sum / numSamples;
+    }
+
+    AudioFormatManager formatManager; //audio file format
+
+    TimeSliceThread backgroundThread{ "Audio Recorder Thread" }; //background thread for file
+
+    ThreadTopology::TimeSliceRole writerRole{ ThreadTopology::writer }; // Gives the writer thread its place in the thread topology
+    DestinationHealth primaryHealth; // Of the files in takeFiles, before the writers whose streams count into it
+    OwnedArray<AudioFormatWriter::ThreadedWriter> threadedWriters; //thread safe file writers, one per file
+
+    //thread saftey for writer to access
+    bool writersActive = false;
+    CriticalSection writerLock;
+    AudioThumbnail* liveThumbnail = nullptr; // Thumbnail of the take being recorded (can be null in headless mode)
+
+    // Routed input for the current take
+    AudioBuffer<float> trackBuffer; // One channel per track, filled from the device inputs every block
+    array<int, maxTracks> trackInputs{};
+    int numTakeTracks = 0;
+
+    // Analysis of the captured tracks, off the audio thread
+    LoudnessMeter loudnessMeter;
+    SpectrogramAnalyser spectrogram;
+    OnsetDetector onsetDetector; // Marker index of onsets and level changes
+    AnalysisThread analysisThread; // Declared after the stages so it stops before they are deleted
+    var lastTakeAnalysis;
+
+    InputMonitor monitor; // Inputs back out of the outputs in the same callback
+    SilenceGate gate; // Leaves the silent parts of gated takes out of the file
+
+    //just state variables
+    atomic<bool> isRecording{ false };
+    double sampleRate = 44100.0; // Of the device
+    double takeSampleRate = 44100.0; // Of the take's files, the device's when it started
+    int deviceBlockSize = 512;
+    bool newTake = false; // Set with the writer lock held, the audio thread resets the counters below
+
+    // Audio thread only (under the writer lock), everyone else gets them through publishedState
+    float currentLevel = 0.0f;
+    int64_t nextSampleNum = 0;
+    int droppedBlocks = 0; // Blocks the writer could not take
+    array<float, maxTracks> trackPeaks{};
+    mutable TripleBuffer<CaptureState> publishedState; // Reading swaps the reader's slot, so it isn't const
+    int latencyCompensation = 0; // Samples dropped from the start of every take
+    int64 samplesToSkip = 0; // What is still left to drop of the current take (audio thread)
+
+    // What the take holds, counted by the memory governor
+    SharedResourcePointer<MemoryGovernor> memoryGovernor;
+    MemoryGovernor::Account writerMemory{ MemoryGovernor::writerBuffers };
+    MemoryGovernor::Account preRollMemory{ MemoryGovernor::preRoll };
+    MemoryGovernor::Account analysisMemory{ MemoryGovernor::analysis };
+
+    // Device restarts during a take
+    TakeRateConverter rateConverter; // Only active while the device runs at another rate than the take
+    InterruptionLog interruptions;
+
+    // Secondary interfaces, owned by whoever opened them
+    atomic<DeviceAggregator*> aggregator{ nullptr };
+    DeviceAggregator* aggregated = nullptr; // The one pulled in this block (audio thread), nullptr = none
+    int firstAggregated = maxTracks; // Inputs from here on are the aggregated devices' (audio thread)
+
+    // Other destinations of the take, each with its own writer thread
+    OwnedArray<TakeMirror> mirrors; // Only changed between takes, the audio thread goes through it while writing
+    AudioBuffer<float> mirrorBuffer; // Tracks with a mirror's gain applied
+
+    CaptureTap tap; // Shared memory copy of the live tracks (only open when the take asks for it)
+
+    // Rolling takes
+    SegmentRoller segmentRoller{ *this };
+    AudioFormat* takeFormat = nullptr;
+    CaptureKernels::Kernel takeKernel = nullptr; // Converts WAV takes, nullptr = the format's own writer
+    int writerBufferSize = 32768;
+    int64 segmentLength = 0; // Samples per part, 0 = not rolling
+    int64 segmentPosition = 0; // Samples in the current part (audio thread)
+    vector<int64> segmentLengths; // Of the finished parts, reserved so the audio thread never grows it
+    array<const float*, maxTracks> chunkPointers{};
+    atomic<Segment*> preparedSegment{ nullptr }; // Opened by the roller, taken by the audio thread
+    AbstractFifo finishedFifo{ maxFinishedSegments }; // Full parts handed back to the roller to be closed
+    array<Segment*, maxFinishedSegments> finishedSegments{};
+    CriticalSection segmentLock; // Between the roller and the message thread, never the audio thread
+    Array<File> takeBaseFiles; // Names the parts are made from
+    Array<Array<File>> segmentFiles; // Files of every part opened so far
+    int nextSegment = 1;
+
+    // Finishing stopped takes
+    atomic<bool> finalizing{ false };
+    WaitableEvent finalizedEvent{ true };
+
+    CaptureSettings takeSettings;
+    Array<File> takeFiles;
+    String lastError;
+
+    ThreadPool finalizer{ ThreadPoolOptions{}.withThreadName("Take Finalizer").withNumberOfThreads(1) }; // Last, it's stopped first
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(CaptureEngine)
+};
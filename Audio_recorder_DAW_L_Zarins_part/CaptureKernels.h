@@ -0,0 +1,159 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <cstring>
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Capture Kernels - float tracks straight into interleaved file samples
+// JUCE's writers convert in two passes (float to 32 bit ints per channel, then
+// ints to the file's format while interleaving) with the format and channel
+// count looked up at run time. These do it in one pass, and the common setups
+// (1/2/8/16/32 channels x int16/int24/float32) get their own copy of the loop
+// with both known at compile time. Each track is scaled, clipped and rounded
+// in small tiles (plain loops without branches, so they vectorise), then the
+// tile is interleaved with a fixed stride. A kernel is picked once per take.
+// WAV byte order (little endian).
+//==============================================================================
+namespace CaptureKernels
+{
+    static constexpr int tileSize = 64; // Frames converted at a time, 32 tracks of it stay in L1
+
+    // Scale and clip to full scale 32 bit ints first (the largest value is the top of the file's range),
+    // then round half up to the file's bits. Written with min/max and shifts, so there's no branch per
+    // sample and compilers turn the loop into SIMD. NaN ends up at the bottom.
+    template <int Bits>
+    void convertToInts(const float* source, int32* dest, int num) noexcept
+    {
+        constexpr int shift = 32 - Bits;
+        constexpr float top = (float) (0x7fffffff >> shift << shift);
+
+        for (int i = 0; i < num; ++i)
+        {
+            auto value = (int32) jmax(-2147483648.0f, jmin(source[i] * 2147483648.0f, top));
+            dest[i] = (value >> shift) + ((value >> (shift - 1)) & 1);
+        }
+    }
+
+    // Sample formats - convert() fills a tile of one track, store() puts one sample in the file
+    struct Int16
+    {
+        static constexpr int bytes = 2;
+
+        static void convert(const float* source, int32* dest, int num) noexcept { convertToInts<16>(source, dest, num); }
+
+        static void store(int32 sample, uint8* dest) noexcept
+        {
+            auto value = ByteOrder::swapIfBigEndian((uint16) (int16) sample);
+            memcpy(dest, &value, sizeof(value));
+        }
+    };
+
+    struct Int24
+    {
+        static constexpr int bytes = 3;
+
+        static void convert(const float* source, int32* dest, int num) noexcept { convertToInts<24>(source, dest, num); }
+
+        static void store(int32 sample, uint8* dest) noexcept
+        {
+            dest[0] = (uint8) sample;
+            dest[1] = (uint8) (sample >> 8);
+            dest[2] = (uint8) (sample >> 16);
+        }
+    };
+
+    struct Float32
+    {
+        static constexpr int bytes = 4;
+
+        static void convert(const float* source, int32* dest, int num) noexcept
+        {
+            memcpy(dest, source, sizeof(float) * (size_t) num); // Written as they are, not clipped (same as JUCE)
+        }
+
+        static void store(int32 sample, uint8* dest) noexcept
+        {
+            auto value = ByteOrder::swapIfBigEndian((uint32) sample);
+            memcpy(dest, &value, sizeof(value));
+        }
+    };
+
+    // Writes numSamples frames of every channel interleaved into dest
+    using Kernel = void (*)(const float* const* channels, int numChannels, uint8* dest, int numSamples);
+
+    // Channel count known at compile time, so the interleave loop is unrolled and has no run time stride
+    template <int NumChannels, typename Format>
+    void interleave(const float* const* channels, int, uint8* dest, int numSamples)
+    {
+        constexpr int frameBytes = NumChannels * Format::bytes;
+        alignas(32) int32 tile[NumChannels][tileSize];
+
+        for (int start = 0; start < numSamples; start += tileSize)
+        {
+            int num = jmin(tileSize, numSamples - start);
+
+            for (int channel = 0; channel < NumChannels; ++channel)
+                Format::convert(channels[channel] + start, tile[channel], num);
+
+            uint8* frame = dest + (size_t) start * frameBytes;
+            for (int i = 0; i < num; ++i, frame += frameBytes)
+                for (int channel = 0; channel < NumChannels; ++channel)
+                    Format::store(tile[channel][i], frame + channel * Format::bytes);
+        }
+    }
+
+    // Any other channel count - same conversion, one channel at a time with the stride worked out at run time
+    template <typename Format>
+    void interleaveAny(const float* const* channels, int numChannels, uint8* dest, int numSamples)
+    {
+        const int frameBytes = numChannels * Format::bytes;
+        alignas(32) int32 tile[tileSize];
+
+        for (int start = 0; start < numSamples; start += tileSize)
+        {
+            int num = jmin(tileSize, numSamples - start);
+
+            for (int channel = 0; channel < numChannels; ++channel)
+            {
+                Format::convert(channels[channel] + start, tile, num);
+
+                uint8* sample = dest + (size_t) start * (size_t) frameBytes + (size_t) (channel * Format::bytes);
+                for (int i = 0; i < num; ++i, sample += frameBytes)
+                    Format::store(tile[i], sample);
+            }
+        }
+    }
+
+    inline bool isSpecialised(int numChannels)
+    {
+        return numChannels == 1 || numChannels == 2 || numChannels == 8 || numChannels == 16 || numChannels == 32;
+    }
+
+    template <typename Format>
+    Kernel findFor(int numChannels)
+    {
+        switch (numChannels)
+        {
+            case 1:  return interleave<1, Format>;
+            case 2:  return interleave<2, Format>;
+            case 8:  return interleave<8, Format>;
+            case 16: return interleave<16, Format>;
+            case 32: return interleave<32, Format>;
+            default: return interleaveAny<Format>;
+        }
+    }
+
+    // The kernel for a file, or nullptr if it's a format these don't write (8 bit is left to JUCE)
+    inline Kernel find(int numChannels, int bitsPerSample)
+    {
+        switch (bitsPerSample)
+        {
+            case 16: return findFor<Int16>(numChannels);
+            case 24: return findFor<Int24>(numChannels);
+            case 32: return findFor<Float32>(numChannels);
+            default: return nullptr;
+        }
+    }
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+#include <cstring>
+#include <new>
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Capture Tap - the live tracks of a take in shared memory for other programs
+// A memory mapped file (in /dev/shm on Linux, so it never touches a disk)
+// with a small header and one ring of float samples per track. The audio
+// thread copies each block in and moves the write index on, that's all -
+// nobody is ever waited for, and readers only map it read only, so a slow
+// reader just finds its samples overwritten (it counts that as an overrun
+// and jumps ahead). The layout is plain and fixed, so a reader doesn't need
+// JUCE or this code:
+//
+//   0    char[8]  magic "ARECTAP"     8    uint32 version (2)
+//   12   uint32   headerBytes (4096)  16   uint32 numChannels
+//   20   uint32   capacity (frames, power of two)
+//   24   double   sampleRate          32   uint32 sampleFormat (1 = float32)
+//   36   uint32   state (0 = idle, 1 = recording, 2 = closed, open it again)
+//   64   uint64   writeIndex - frames ever written, frame n is at n & (capacity - 1)
+//   72   uint64   writeIndexBegin - what writeIndex will be once the block being written is in
+//   128  uint64   takeStart - writeIndex where the current take started
+//   136  uint32   takeCounter - goes up by one every take
+//   144  uint64   overruns - blocks the recorder could not publish
+//   headerBytes + channel * capacity * 4 - the ring of each channel
+//
+// writeIndex is stored after the samples (release), so everything below it
+// is there once it's read (acquire). writeIndexBegin is stored before the
+// samples, like a seqlock: a reader that finds it more than a ring past the
+// start of what it just read knows those samples were being overwritten.
+//==============================================================================
+struct CaptureTapHeader
+{
+    static constexpr uint32 currentVersion = 2;
+    static constexpr uint32 headerSize = 4096;
+    static constexpr uint32 float32 = 1;
+    enum State : uint32 { idle = 0, recording = 1, closed = 2 };
+
+    char magic[8];
+    uint32 version;
+    uint32 headerBytes;
+    uint32 numChannels;
+    uint32 capacity;
+    double sampleRate;
+    uint32 sampleFormat;
+    atomic<uint32> state;
+    alignas(64) atomic<uint64> writeIndex; // Only the audio thread changes these two, on their own cache line
+    atomic<uint64> writeIndexBegin;
+    alignas(64) atomic<uint64> takeStart;
+    atomic<uint32> takeCounter;
+    atomic<uint64> overruns;
+
+    static bool isValid(const void* data, size_t size)
+    {
+        auto* header = static_cast<const CaptureTapHeader*>(data);
+        return size >= headerSize && memcmp(header->magic, "ARECTAP", 8) == 0 && header->version == currentVersion
+            && header->sampleFormat == float32 && isPowerOfTwo(header->capacity)
+            && size >= header->headerBytes + (size_t) header->numChannels * header->capacity * sizeof(float);
+    }
+};
+
+static_assert(atomic<uint64>::is_always_lock_free, "The tap's atomics have to work across processes");
+static_assert(offsetof(CaptureTapHeader, writeIndex) == 64 && offsetof(CaptureTapHeader, writeIndexBegin) == 72
+    && offsetof(CaptureTapHeader, takeStart) == 128
+    && offsetof(CaptureTapHeader, overruns) == 144, "The header layout is shared with other programs");
+
+// Where a tap with this name lives
+inline File getCaptureTapFile(const String& name)
+{
+    File sharedMemory("/dev/shm");
+    File folder = sharedMemory.isDirectory() ? sharedMemory : File::getSpecialLocation(File::tempDirectory);
+    return folder.getChildFile(File::createLegalFileName(name) + ".tap");
+}
+
+//==============================================================================
+// Capture Tap - the writing side, owned by the CaptureEngine
+//==============================================================================
+class CaptureTap
+{
+public:
+    ~CaptureTap() { close(); }
+
+    // Message thread, before a take - keeps the mapping if it already fits, otherwise makes a new one
+    bool open(const String& name, int numChannels, double sampleRate, String& error)
+    {
+        uint32 capacity = (uint32) nextPowerOfTwo(jmax(65536, roundToInt(sampleRate * ringSeconds)));
+
+        if (header == nullptr || name != tapName || (int) header->numChannels != numChannels
+            || header->capacity != capacity || header->sampleRate != sampleRate)
+        {
+            close();
+
+            File file = getCaptureTapFile(name);
+            size_t size = CaptureTapHeader::headerSize + (size_t) numChannels * capacity * sizeof(float);
+            if (!createFile(file, size))
+            {
+                error = "Could not create the tap " + file.getFullPathName();
+                return false;
+            }
+
+            mapping = make_unique<MemoryMappedFile>(file, MemoryMappedFile::readWrite, false);
+            if (mapping->getData() == nullptr || mapping->getSize() < size)
+            {
+                mapping.reset();
+                error = "Could not map the tap " + file.getFullPathName();
+                return false;
+            }
+
+            // Every page gets touched here, so the audio thread never has to fault one in
+            memset(mapping->getData(), 0, size);
+
+            header = new (mapping->getData()) CaptureTapHeader();
+            memcpy(header->magic, "ARECTAP", 8);
+            header->version = CaptureTapHeader::currentVersion;
+            header->headerBytes = CaptureTapHeader::headerSize;
+            header->numChannels = (uint32) numChannels;
+            header->capacity = capacity;
+            header->sampleRate = sampleRate;
+            header->sampleFormat = CaptureTapHeader::float32;
+            samples = reinterpret_cast<float*>(static_cast<char*>(mapping->getData()) + CaptureTapHeader::headerSize);
+            tapName = name;
+            tapFile = file;
+        }
+
+        header->takeStart.store(header->writeIndex.load());
+        header->takeCounter.fetch_add(1);
+        header->state.store(CaptureTapHeader::recording, memory_order_release);
+        return true;
+    }
+
+    // Message thread, after a take - readers see it stopped, the mapping stays for the next take
+    void stop()
+    {
+        if (header != nullptr)
+            header->state.store(CaptureTapHeader::idle, memory_order_release);
+    }
+
+    // Message thread - readers that still have it mapped are told to open it again, then it's deleted
+    void close()
+    {
+        if (header != nullptr)
+            header->state.store(CaptureTapHeader::closed, memory_order_release);
+
+        header = nullptr;
+        samples = nullptr;
+        mapping.reset();
+
+        if (tapFile != File())
+            tapFile.deleteFile(); // Readers keep their mapping of it until they let go
+        tapFile = File();
+        tapName = {};
+    }
+
+    bool isOpen() const { return header != nullptr; }
+    String getName() const { return tapName; }
+    File getFile() const { return tapFile; }
+
+    // Audio thread - copies the block into the rings and publishes it, never waits
+    void write(const AudioBuffer<float>& tracks, int numChannels, int numSamples)
+    {
+        if (header == nullptr)
+            return;
+
+        uint32 capacity = header->capacity;
+        if ((uint32) numSamples > capacity || numChannels != (int) header->numChannels)
+        {
+            header->overruns.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+
+        // Announced before any sample of it changes, readers check their pieces against this
+        uint64 index = header->writeIndex.load(memory_order_relaxed);
+        header->writeIndexBegin.store(index + (uint64) numSamples, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        int position = (int) (index & (capacity - 1));
+        int first = jmin(numSamples, (int) capacity - position);
+
+        for (int ch = 0; ch < numChannels; ++ch)
+        {
+            float* ring = samples + (size_t) ch * capacity;
+            FloatVectorOperations::copy(ring + position, tracks.getReadPointer(ch), first);
+            if (first < numSamples)
+                FloatVectorOperations::copy(ring, tracks.getReadPointer(ch, first), numSamples - first);
+        }
+
+        header->writeIndex.store(index + (uint64) numSamples, memory_order_release);
+    }
+
+private:
+    static constexpr double ringSeconds = 4.0; // How far behind a reader can be before it loses samples
+
+    // Sparse file of the right size (the pages are filled in when it is mapped and cleared)
+    static bool createFile(const File& file, size_t size)
+    {
+        file.deleteFile(); // A reader of an old one keeps its own copy
+        FileOutputStream stream(file);
+        if (!stream.openedOk() || !stream.setPosition((int64) size - 1))
+            return false;
+
+        stream.writeByte(0);
+        stream.flush();
+        return !stream.getStatus().failed();
+    }
+
+    unique_ptr<MemoryMappedFile> mapping;
+    CaptureTapHeader* header = nullptr;
+    float* samples = nullptr;
+    String tapName;
+    File tapFile;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(CaptureTap)
+};
+
+//==============================================================================
+// Capture Tap Reader - the reading side, for other programs (or --read-tap)
+// Maps the tap read only and hands out the new samples in place, as up to two
+// pieces per call (where the ring wraps around). Each piece is checked against
+// the write index again after it was used - if the recorder got a whole ring
+// ahead in the meantime, some of it was already newer samples, so it counts
+// as an overrun and reading stops there (the next read jumps ahead).
+//==============================================================================
+class CaptureTapReader
+{
+public:
+    bool open(const String& name)
+    {
+        close();
+        mapping = make_unique<MemoryMappedFile>(getCaptureTapFile(name), MemoryMappedFile::readOnly, false);
+        if (mapping->getData() == nullptr || !CaptureTapHeader::isValid(mapping->getData(), mapping->getSize()))
+        {
+            mapping.reset();
+            return false;
+        }
+
+        header = static_cast<const CaptureTapHeader*>(mapping->getData());
+        samples = reinterpret_cast<const float*>(static_cast<const char*>(mapping->getData()) + header->headerBytes);
+        readIndex = header->writeIndex.load(memory_order_acquire); // Starts from now
+        return true;
+    }
+
+    void close()
+    {
+        header = nullptr;
+        samples = nullptr;
+        mapping.reset();
+    }
+
+    bool isOpen() const { return header != nullptr; }
+    bool isClosedByRecorder() const { return header != nullptr && header->state.load(memory_order_acquire) == CaptureTapHeader::closed; }
+    bool isRecording() const { return header != nullptr && header->state.load(memory_order_acquire) == CaptureTapHeader::recording; }
+    int getNumChannels() const { return header != nullptr ? (int) header->numChannels : 0; }
+    double getSampleRate() const { return header != nullptr ? header->sampleRate : 0.0; }
+    uint32 getTakeCounter() const { return header != nullptr ? header->takeCounter.load() : 0; }
+    uint64 getTakeStart() const { return header != nullptr ? header->takeStart.load() : 0; }
+    uint64 getPublisherOverruns() const { return header != nullptr ? header->overruns.load() : 0; }
+
+    int64 getOverruns() const { return overruns; } // Times this reader fell a whole ring behind
+    int64 getLostFrames() const { return lostFrames; }
+    uint64 getReadIndex() const { return readIndex; }
+
+    // Calls use(channelPointers, numFrames, firstFrame) for the new samples, returns the frames used.
+    // The pointers point into the ring itself and are only valid inside the call.
+    template <typename Callback>
+    int read(int maxFrames, Callback&& use)
+    {
+        if (header == nullptr)
+            return 0;
+
+        uint32 capacity = header->capacity;
+        uint64 writeIndex = header->writeIndex.load(memory_order_acquire);
+
+        if (writeIndex - readIndex > capacity) // Too slow, the oldest samples are gone
+        {
+            ++overruns;
+            uint64 resume = writeIndex - capacity / 2; // Half a ring behind, so it's not straight back in the same place
+            lostFrames += (int64) (resume - readIndex);
+            readIndex = resume;
+        }
+
+        int available = (int) jmin((uint64) maxFrames, writeIndex - readIndex);
+        int done = 0;
+
+        while (done < available)
+        {
+            int position = (int) ((readIndex + (uint64) done) & (capacity - 1));
+            int num = jmin(available - done, (int) capacity - position);
+
+            for (int ch = 0; ch < (int) header->numChannels && ch < maxChannels; ++ch)
+                channelPointers[(size_t) ch] = samples + (size_t) ch * capacity + position;
+
+            use(channelPointers.data(), num, readIndex + (uint64) done);
+
+            // The recorder may have lapped the piece while it was being used - including a block it's
+            // in the middle of writing, which only writeIndexBegin knows about yet
+            atomic_thread_fence(memory_order_acquire);
+            if (header->writeIndexBegin.load(memory_order_relaxed) - (readIndex + (uint64) done) > capacity)
+            {
+                ++overruns;
+                break;
+            }
+
+            done += num;
+        }
+
+        readIndex += (uint64) done;
+        return done;
+    }
+
+private:
+    static constexpr int maxChannels = 64;
+
+    unique_ptr<MemoryMappedFile> mapping;
+    const CaptureTapHeader* header = nullptr;
+    const float* samples = nullptr;
+    array<const float*, maxChannels> channelPointers{};
+    uint64 readIndex = 0;
+    int64 overruns = 0;
+    int64 lostFrames = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(CaptureTapReader)
+};
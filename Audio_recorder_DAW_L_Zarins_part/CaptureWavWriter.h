@@ -0,0 +1,145 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "CaptureKernels.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Capture WAV Writer - the WAV writer takes are recorded with
+// It says it takes floating point data, so the ThreadedWriter hands it the
+// float tracks untouched and one capture kernel turns them into the file's
+// samples. The header has room kept for a ds64 chunk (as a JUNK chunk), so a
+// file that grows past 4 GB is turned into RF64 when it is closed, the same
+// as JUCE's own WAV writer does. Files read back with the normal WAV reader.
+//==============================================================================
+class CaptureWavWriter : public AudioFormatWriter
+{
+public:
+    // 16 and 24 bit are PCM, 32 bit is float
+    CaptureWavWriter(OutputStream* stream, double rate, int channels, int bits, CaptureKernels::Kernel kernelToUse)
+        : AudioFormatWriter(stream, "WAV file", rate, (unsigned int) channels, (unsigned int) bits),
+        kernel(kernelToUse), frameBytes(channels * bits / 8)
+    {
+        jassert(kernel != nullptr && (bits == 16 || bits == 24 || bits == 32));
+
+        usesFloatingPointData = true; // The kernel does the conversion, not AudioFormatWriter
+        interleaved.allocate((size_t) (frameBytes * blockSize), false);
+        channelPointers.allocate((size_t) channels, true);
+        silence.allocate((size_t) blockSize, true);
+
+        headerPosition = output->getPosition();
+        writeHeader();
+    }
+
+    ~CaptureWavWriter() override
+    {
+        if (output != nullptr)
+        {
+            if ((dataBytes & 1) != 0)
+                output->writeByte(0); // Chunks are padded to an even size
+
+            writeHeader(); // The base class deletes the stream
+        }
+    }
+
+    // The pointers are floats (usesFloatingPointData), missing channels are written as silence
+    bool write(const int** samplesToWrite, int numSamples) override
+    {
+        auto** channels = reinterpret_cast<const float**>(samplesToWrite);
+
+        for (int done = 0; done < numSamples;)
+        {
+            int num = jmin(blockSize, numSamples - done);
+
+            for (int channel = 0; channel < (int) numChannels; ++channel)
+                channelPointers[channel] = channels[channel] != nullptr ? channels[channel] + done : silence.get();
+
+            kernel(channelPointers.get(), (int) numChannels, interleaved.get(), num);
+
+            size_t bytes = (size_t) (num * frameBytes);
+            if (!output->write(interleaved.get(), bytes))
+                return false;
+
+            dataBytes += (uint64) bytes;
+            done += num;
+        }
+
+        return true;
+    }
+
+    // Makes the header match what is written so far (the file is readable as it is)
+    bool flush() override
+    {
+        int64 position = output->getPosition();
+        writeHeader();
+
+        if (!output->setPosition(position))
+            return false;
+
+        output->flush();
+        return true;
+    }
+
+private:
+    static constexpr int blockSize = 4096; // Frames interleaved at a time
+    static constexpr int ds64Size = 28; // RIFF size, data size, sample count and an empty table
+
+    // Written at the start and again at the end, when the sizes are known
+    void writeHeader()
+    {
+        bool isFloat = bitsPerSample == 32;
+        bool extensible = numChannels > 2 || bitsPerSample > 16; // What anything past 16 bit stereo should be
+        int fmtSize = extensible ? 40 : 16;
+        uint64 riffSize = 4 + (8 + ds64Size) + (8 + (uint64) fmtSize) + 8 + dataBytes + (dataBytes & 1);
+        bool rf64 = riffSize > 0xffffffffull;
+
+        output->setPosition(headerPosition);
+
+        output->write(rf64 ? "RF64" : "RIFF", 4);
+        output->writeInt(rf64 ? -1 : (int) (uint32) riffSize);
+        output->write("WAVE", 4);
+
+        // ds64 once it's needed, until then the same bytes as a chunk everyone skips
+        output->write(rf64 ? "ds64" : "JUNK", 4);
+        output->writeInt(ds64Size);
+        output->writeInt64(rf64 ? (int64) riffSize : 0);
+        output->writeInt64(rf64 ? (int64) dataBytes : 0);
+        output->writeInt64(rf64 ? (int64) (dataBytes / (uint64) frameBytes) : 0);
+        output->writeInt(0);
+
+        output->write("fmt ", 4);
+        output->writeInt(fmtSize);
+        output->writeShort((short) (extensible ? 0xfffe : (isFloat ? 3 : 1)));
+        output->writeShort((short) numChannels);
+        output->writeInt((int) sampleRate);
+        output->writeInt((int) sampleRate * frameBytes);
+        output->writeShort((short) frameBytes);
+        output->writeShort((short) bitsPerSample);
+
+        if (extensible)
+        {
+            output->writeShort(22);
+            output->writeShort((short) bitsPerSample); // Valid bits
+            output->writeInt(numChannels == 1 ? 4 : (numChannels == 2 ? 3 : 0)); // Centre, left + right, or no speaker positions
+
+            // KSDATAFORMAT_SUBTYPE_PCM / _IEEE_FLOAT
+            const uint8 subFormat[16] = { (uint8) (isFloat ? 3 : 1), 0, 0, 0, 0, 0, 0x10, 0, 0x80, 0, 0, 0xaa, 0, 0x38, 0x9b, 0x71 };
+            output->write(subFormat, sizeof(subFormat));
+        }
+
+        output->write("data", 4);
+        output->writeInt(rf64 ? -1 : (int) (uint32) dataBytes);
+    }
+
+    CaptureKernels::Kernel kernel;
+    int frameBytes;
+    int64 headerPosition = 0;
+    uint64 dataBytes = 0;
+
+    HeapBlock<uint8> interleaved;
+    HeapBlock<const float*> channelPointers;
+    HeapBlock<float> silence;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(CaptureWavWriter)
+};
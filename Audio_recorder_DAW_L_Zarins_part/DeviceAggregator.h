@@ -0,0 +1,526 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <array>
+#include <atomic>
+#include <vector>
+#include "MemoryGovernor.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Adaptive Resampler - windowed sinc interpolation at a ratio that can change
+// with every sample. 64 taps (32 zero crossings each side) from a Kaiser
+// windowed table of 512 phases, the coefficients in between are interpolated.
+// The cutoff comes from the nominal ratio, so a 96 kHz interface going into
+// a 48 kHz take is filtered properly, and the tiny drift corrections never
+// need a new table.
+//==============================================================================
+class AdaptiveResampler
+{
+public:
+    static constexpr int halfTaps = 32;
+    static constexpr int numTaps = 2 * halfTaps;
+
+    // ratio = input samples per output sample
+    void prepare(double nominalRatio)
+    {
+        double cutoff = passband * jmin(1.0, 1.0 / nominalRatio); // Of the input's Nyquist frequency
+        table.assign((size_t) (numPhases + 1) * numTaps, 0.0f);
+
+        for (int phase = 0; phase <= numPhases; ++phase)
+        {
+            float* row = table.data() + (size_t) phase * numTaps;
+            double fraction = (double) phase / numPhases, sum = 0.0;
+
+            for (int tap = 0; tap < numTaps; ++tap)
+            {
+                double t = (tap - halfTaps + 1) - fraction; // Distance of this tap from the output position
+                double x = MathConstants<double>::pi * cutoff * t;
+                double sinc = abs(x) < 1.0e-9 ? 1.0 : sin(x) / x;
+                double window = abs(t) >= halfTaps ? 0.0
+                    : besselI0(kaiserBeta * sqrt(1.0 - (t / halfTaps) * (t / halfTaps))) / besselI0(kaiserBeta);
+
+                row[tap] = (float) (cutoff * sinc * window);
+                sum += row[tap];
+            }
+
+            for (int tap = 0; tap < numTaps; ++tap) // Exactly unity gain at DC for every phase
+                row[tap] = (float) (row[tap] / sum);
+        }
+    }
+
+    // Coefficients for an output position this far (0 to 1) after an input sample, the same for every channel
+    void getCoefficients(double fraction, float* coefficients) const
+    {
+        double position = fraction * numPhases;
+        int phase = jmin((int) position, numPhases - 1);
+        float amount = (float) (position - phase);
+        const float* row = table.data() + (size_t) phase * numTaps;
+
+        for (int tap = 0; tap < numTaps; ++tap)
+            coefficients[tap] = row[tap] + amount * (row[tap + numTaps] - row[tap]);
+    }
+
+    // input points at the first of the numTaps samples around the output position
+    static float apply(const float* input, const float* coefficients)
+    {
+        float sum = 0.0f;
+        for (int tap = 0; tap < numTaps; ++tap)
+            sum += input[tap] * coefficients[tap];
+        return sum;
+    }
+
+private:
+    static constexpr int numPhases = 512;
+    static constexpr double passband = 0.92;
+    static constexpr double kaiserBeta = 8.0; // About 80 dB down in the stopband
+
+    static double besselI0(double x)
+    {
+        double sum = 1.0, term = 1.0;
+        for (int k = 1; k < 40; ++k)
+        {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+    vector<float> table; // numPhases + 1 rows of numTaps
+};
+
+//==============================================================================
+// Drift Tracker - how fast a secondary device's clock runs against the primary
+// Once per primary block it looks at how many samples wait in the secondary's
+// ring. If the secondary runs fast the ring fills up, so the resampler has to
+// read it a little faster - a PI loop moves the ratio until the fill level
+// stays on its target. The fill level is smoothed first (it jumps by whole
+// device blocks), and the loop is slow (seconds), so the ratio never wobbles
+// audibly. Once it has settled, the correction is the drift between the two
+// clocks, and the fixed fill level keeps every track sample aligned for hours.
+// The fill it's given should already count what the device has recorded since
+// its last callback, otherwise the two block sizes beat against each other
+// slowly enough for the loop to follow them.
+//==============================================================================
+class DriftTracker
+{
+public:
+    void reset(double newNominalRatio, double newTargetFill, double newInputRate)
+    {
+        nominalRatio = newNominalRatio;
+        targetFill = newTargetFill;
+        smoothedFill = newTargetFill;
+        integral = 0.0;
+        correction = 0.0;
+
+        // Critically damped loop with the time constant below, in the secondary's samples
+        proportional = 1.0 / (newInputRate * loopSeconds);
+        integralGain = 1.0 / (4.0 * loopSeconds * loopSeconds * newInputRate);
+    }
+
+    // Returns the input samples to step per output sample for the next block
+    double update(double fill, double seconds)
+    {
+        smoothedFill += (1.0 - exp(-seconds / smoothingSeconds)) * (fill - smoothedFill);
+        double error = smoothedFill - targetFill;
+
+        // The integral can't wind up past the largest correction, a stuck device doesn't leave a long hangover
+        integral = jlimit(-maxCorrection / integralGain, maxCorrection / integralGain, integral + error * seconds);
+        correction = jlimit(-maxCorrection, maxCorrection, proportional * error + integralGain * integral);
+        return nominalRatio * (1.0 + correction);
+    }
+
+    // The secondary's clock against the primary's, in parts per million (positive = secondary is fast)
+    double getDriftPpm() const { return correction * 1.0e6; }
+    double getFillError() const { return smoothedFill - targetFill; }
+    double getTargetFill() const { return targetFill; }
+
+private:
+    static constexpr double loopSeconds = 8.0;
+    static constexpr double smoothingSeconds = 0.5;
+    static constexpr double maxCorrection = 0.002; // 2000 ppm, far more than any two crystals disagree
+
+    double nominalRatio = 1.0, targetFill = 0.0, smoothedFill = 0.0;
+    double integral = 0.0, correction = 0.0;
+    double proportional = 0.0, integralGain = 0.0;
+};
+
+//==============================================================================
+// Device Aggregator - inputs of more interfaces next to the primary device's
+// Every secondary device runs its own callback, which only copies its inputs
+// into a ring. The primary device's audio thread pulls every ring through a
+// drift tracker and an adaptive resampler, so the secondary inputs come out
+// at the primary's rate and clock, one block at a time, and are routed into
+// tracks like any other input - they are numbered after the primary's.
+// Devices are added and removed on the message thread between takes, the
+// audio thread only ever tries the lock (a missed try is a silent block).
+//==============================================================================
+class DeviceAggregator
+{
+public:
+    ~DeviceAggregator() { removeAllDevices(); }
+
+    // Message thread - opens the device with all its inputs and starts it. It runs at the primary's rate if
+    // it can, otherwise at its own and the resampler converts
+    bool addDevice(unique_ptr<AudioIODevice> device, String& error)
+    {
+        if (device == nullptr)
+        {
+            error = "No such device";
+            return false;
+        }
+
+        BigInteger inputs;
+        inputs.setRange(0, device->getInputChannelNames().size(), true);
+
+        Array<double> rates = device->getAvailableSampleRates();
+        double rate = rates.contains(primaryRate) ? primaryRate : (rates.isEmpty() ? 0.0 : rates.getLast());
+
+        error = device->open(inputs, {}, rate, device->getDefaultBufferSize());
+        if (error.isNotEmpty())
+            return false;
+
+        int numChannels = device->getActiveInputChannels().countNumberOfSetBits();
+        if (numChannels <= 0 || getNumInputs() + numChannels > maxInputs)
+        {
+            error = device->getName() + (numChannels <= 0 ? " has no inputs" : " has more inputs than can be recorded");
+            return false;
+        }
+
+        auto secondary = make_unique<Secondary>(move(device), numChannels);
+        secondary->prepare(primaryRate, blockSize);
+
+        {
+            const ScopedLock sl(lock);
+            secondaries.push_back(move(secondary));
+            updateInputs();
+        }
+
+        secondaries.back()->start();
+        return true;
+    }
+
+    void removeAllDevices()
+    {
+        vector<unique_ptr<Secondary>> removed;
+        {
+            const ScopedLock sl(lock);
+            removed.swap(secondaries);
+            updateInputs();
+        }
+        removed.clear(); // Stops and closes them outside the lock
+    }
+
+    // Where the aggregated inputs start, the number of inputs the primary device has open
+    void setFirstInput(int input) { firstInput = input; }
+    int getFirstInput() const { return firstInput; }
+    int getNumInputs() const { return numInputs; }
+    int getNumDevices() const { return (int) secondaries.size(); }
+    bool isEmpty() const { return numInputs == 0; }
+
+    StringArray getDeviceNames() const
+    {
+        StringArray names;
+        for (auto& secondary : secondaries)
+            names.add(secondary->device->getName());
+        return names;
+    }
+
+    // Names like "Interface 2: Input 1", in input order
+    StringArray getInputNames() const
+    {
+        StringArray names;
+        for (auto& secondary : secondaries)
+            for (auto& name : secondary->device->getInputChannelNames())
+                if (names.size() < numInputs)
+                    names.add(secondary->device->getName() + ": " + name);
+        return names;
+    }
+
+    // Before the primary starts (prepareToPlay) - every secondary starts again from its target fill
+    void prepare(double newPrimaryRate, int newBlockSize)
+    {
+        const ScopedLock sl(lock);
+        primaryRate = newPrimaryRate;
+        blockSize = newBlockSize;
+        maxBlockSize = jmax(newBlockSize, minBlockSize);
+
+        for (auto& secondary : secondaries)
+            secondary->prepare(primaryRate, blockSize);
+        updateInputs();
+    }
+
+    // Primary audio thread, once per block - the next numSamples of every aggregated input.
+    // Returns false if there are none this block (the devices are just being changed, or the block is too big)
+    bool pull(int numSamples)
+    {
+        const ScopedTryLock sl(lock);
+        if (!sl.isLocked() || numSamples > pulled.getNumSamples())
+            return false;
+
+        int channel = 0;
+        for (auto& secondary : secondaries)
+        {
+            secondary->pull(pulled, channel, numSamples, primaryRate);
+            channel += secondary->numChannels;
+        }
+        return true;
+    }
+
+    // After a pull that returned true - input is counted from the first aggregated input
+    const float* getInput(int input) const { return pulled.getReadPointer(input); }
+
+    // Message thread - every device with its drift and how its ring did
+    var getReport() const
+    {
+        Array<var> report;
+        int input = firstInput;
+
+        for (auto& secondary : secondaries)
+        {
+            auto* entry = new DynamicObject();
+            entry->setProperty("device", secondary->device->getName());
+            entry->setProperty("type", secondary->device->getTypeName());
+            entry->setProperty("sample_rate", secondary->device->getCurrentSampleRate());
+            entry->setProperty("first_input", input + 1);
+            entry->setProperty("channels", secondary->numChannels);
+            entry->setProperty("drift_ppm", secondary->driftPpm.load());
+            entry->setProperty("latency_samples", secondary->latency.load());
+            entry->setProperty("underruns", secondary->underruns.load());
+            entry->setProperty("overruns", secondary->overruns.load());
+            report.add(var(entry));
+
+            input += secondary->numChannels;
+        }
+
+        return report;
+    }
+
+private:
+    static constexpr int maxInputs = 64;
+    static constexpr int minBlockSize = 8192; // The pull buffer is never smaller, odd driver block sizes still fit
+
+    //==========================================================================
+    // One secondary device - its callback fills the ring, the primary's audio thread reads it
+    struct Secondary : public AudioIODeviceCallback
+    {
+        // The ring is made once here, the device starts writing into it straight away
+        Secondary(unique_ptr<AudioIODevice> deviceToUse, int channels)
+            : device(move(deviceToUse)), numChannels(channels),
+              capacity(nextPowerOfTwo(jmax(65536, 16 * device->getCurrentBufferSizeSamples())))
+        {
+            rings.assign((size_t) numChannels, vector<float>((size_t) (capacity + AdaptiveResampler::numTaps), 0.0f));
+        }
+
+        ~Secondary() override
+        {
+            device->stop();
+            device->close();
+        }
+
+        void start() { device->start(this); }
+
+        // Reading side only (the lock is held), the device goes on writing
+        void prepare(double primaryRate, int primaryBlockSize)
+        {
+            double inputRate = device->getCurrentSampleRate();
+            double ratio = inputRate / primaryRate;
+
+            // Far enough behind the writer for a whole device block, a whole primary block and the filter,
+            // plus room for late callbacks and for the loop to settle without running dry
+            targetFill = device->getCurrentBufferSizeSamples() + ratio * primaryBlockSize + AdaptiveResampler::numTaps + safetyMargin;
+
+            resampler.prepare(ratio);
+            tracker.reset(ratio, targetFill, inputRate);
+            locked = false;
+            readPosition = 0.0;
+            latency = roundToInt(targetFill / ratio);
+        }
+
+        void audioDeviceAboutToStart(AudioIODevice*) override {}
+        void audioDeviceStopped() override {}
+
+        // Secondary device thread - copies its inputs in and publishes them, never waits for anyone
+        void audioDeviceIOCallbackWithContext(const float* const* inputs, int numInputs,
+            float* const* outputs, int numOutputs, int numSamples, const AudioIODeviceCallbackContext&) override
+        {
+            for (int ch = 0; ch < numOutputs; ++ch)
+                if (outputs[ch] != nullptr)
+                    FloatVectorOperations::clear(outputs[ch], numSamples);
+
+            uint64 index = writeIndex.load(memory_order_relaxed);
+            uint64 mask = (uint64) capacity - 1;
+
+            for (int ch = 0; ch < numChannels; ++ch)
+            {
+                float* ring = rings[(size_t) ch].data();
+                const float* input = ch < numInputs ? inputs[ch] : nullptr;
+
+                for (int i = 0; i < numSamples; ++i)
+                {
+                    int position = (int) ((index + (uint64) i) & mask);
+                    float sample = input != nullptr ? input[i] : 0.0f;
+                    ring[position] = sample;
+                    if (position < AdaptiveResampler::numTaps) // Copy past the end, so a read never wraps
+                        ring[position + capacity] = sample;
+                }
+            }
+
+            // How long its blocks take in real time (smoothed, callbacks are never exactly on time)
+            double now = Time::getMillisecondCounterHiRes();
+            if (lastCallbackTime > 0.0)
+                callbackPeriod = callbackPeriod > 0.0 ? callbackPeriod + 0.05 * ((now - lastCallbackTime) - callbackPeriod)
+                                                      : now - lastCallbackTime;
+            lastCallbackTime = now;
+
+            // The new index, when it arrived and the block length go together, an odd sequence means they're being changed
+            uint32 sequence = published.load(memory_order_relaxed);
+            published.store(sequence + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            writeIndex.store(index + (uint64) numSamples, memory_order_relaxed);
+            writeTime.store(now, memory_order_relaxed);
+            writePeriod.store(callbackPeriod, memory_order_relaxed);
+            writeBlock.store(numSamples, memory_order_relaxed);
+            published.store(sequence + 2, memory_order_release);
+        }
+
+        // Primary audio thread - what the device has written, and where its clock is by now (written plus the
+        // part of a block it has recorded since its last callback). False if the callback was busy publishing
+        bool getWritePosition(double& written, double& estimated) const
+        {
+            for (int attempt = 0; attempt < 4; ++attempt)
+            {
+                uint32 sequence = published.load(memory_order_acquire);
+                if ((sequence & 1) != 0)
+                    continue;
+
+                uint64 index = writeIndex.load(memory_order_relaxed);
+                double time = writeTime.load(memory_order_relaxed), period = writePeriod.load(memory_order_relaxed);
+                int block = writeBlock.load(memory_order_relaxed);
+                atomic_thread_fence(memory_order_acquire);
+                if (published.load(memory_order_relaxed) != sequence)
+                    continue;
+
+                double elapsed = period > 0.0 ? (Time::getMillisecondCounterHiRes() - time) / period : 0.0;
+                written = (double) index;
+                estimated = written + block * jlimit(0.0, 1.0, elapsed);
+                return true;
+            }
+            return false;
+        }
+
+        // Primary audio thread - numSamples at the primary's rate into the channels from firstChannel on
+        void pull(AudioBuffer<float>& destination, int firstChannel, int numSamples, double primaryRate)
+        {
+            double written = 0.0, estimated = 0.0;
+            if (!getWritePosition(written, estimated))
+                estimated = written = (double) writeIndex.load(memory_order_acquire);
+
+            if (!locked) // Starts once the ring holds the target, until then it's silence
+            {
+                if (written < targetFill + AdaptiveResampler::halfTaps)
+                {
+                    clear(destination, firstChannel, 0, numSamples);
+                    return;
+                }
+
+                readPosition = written - targetFill;
+                locked = true;
+            }
+
+            if (written - readPosition > capacity - 2.0 * AdaptiveResampler::numTaps) // Nothing was read for a long time, the oldest samples are gone
+            {
+                ++overruns;
+                readPosition = written - targetFill;
+            }
+
+            double step = tracker.update(estimated - readPosition, numSamples / primaryRate);
+            driftPpm = (float) tracker.getDriftPpm();
+
+            // Every tap of the last output sample has to be in the ring already
+            if (readPosition + step * numSamples + AdaptiveResampler::halfTaps > written)
+            {
+                ++underruns;
+                clear(destination, firstChannel, 0, numSamples);
+                readPosition = jmax(0.0, written - targetFill); // Starts again a whole target behind
+                return;
+            }
+
+            uint64 mask = (uint64) capacity - 1;
+            for (int i = 0; i < numSamples; ++i)
+            {
+                double whole = floor(readPosition);
+                resampler.getCoefficients(readPosition - whole, coefficients.data());
+                int first = (int) (((uint64) whole - AdaptiveResampler::halfTaps + 1) & mask);
+
+                for (int ch = 0; ch < numChannels; ++ch)
+                    destination.getWritePointer(firstChannel + ch)[i] = AdaptiveResampler::apply(rings[(size_t) ch].data() + first, coefficients.data());
+
+                readPosition += step;
+            }
+        }
+
+        void clear(AudioBuffer<float>& destination, int firstChannel, int start, int numSamples)
+        {
+            for (int ch = 0; ch < numChannels; ++ch)
+                destination.clear(firstChannel + ch, start, numSamples);
+        }
+
+        static constexpr double safetyMargin = 512.0;
+
+        unique_ptr<AudioIODevice> device;
+        const int numChannels;
+        const int capacity;
+
+        vector<vector<float>> rings; // One per input, capacity samples plus a copy of the first numTaps
+        atomic<uint64> writeIndex{ 0 }; // Samples the device has written, ever
+        atomic<double> writeTime{ 0.0 }, writePeriod{ 0.0 }; // When they were written and how long a block takes, in milliseconds
+        atomic<int> writeBlock{ 0 };
+        atomic<uint32> published{ 0 }; // Odd while the two above are changing
+
+        // Secondary device thread only
+        double lastCallbackTime = 0.0, callbackPeriod = 0.0;
+
+        // Primary audio thread only
+        AdaptiveResampler resampler;
+        DriftTracker tracker;
+        array<float, AdaptiveResampler::numTaps> coefficients{};
+        double readPosition = 0.0; // In the secondary's samples, with the fraction
+        double targetFill = 0.0;
+        bool locked = false;
+
+        // For the report
+        atomic<float> driftPpm{ 0.0f };
+        atomic<int> latency{ 0 }; // Primary samples the secondary inputs are behind their device
+        atomic<int> underruns{ 0 }, overruns{ 0 };
+    };
+
+    // Lock held - the pull buffer has room for every input and the largest block
+    void updateInputs()
+    {
+        int total = 0;
+        for (auto& secondary : secondaries)
+            total += secondary->numChannels;
+
+        numInputs = total;
+        pulled.setSize(jmax(1, total), maxBlockSize, false, true, true);
+
+        size_t bytes = sizeof(float) * (size_t) (pulled.getNumChannels() * pulled.getNumSamples());
+        for (auto& secondary : secondaries)
+            bytes += sizeof(float) * (size_t) (secondary->numChannels * (secondary->capacity + AdaptiveResampler::numTaps));
+        memory.set(bytes);
+    }
+
+    CriticalSection lock;
+    vector<unique_ptr<Secondary>> secondaries;
+    MemoryGovernor::Account memory{ MemoryGovernor::aggregation }; // The rings and the pull buffer
+    AudioBuffer<float> pulled{ 1, minBlockSize }; // The aggregated inputs of the current block
+    atomic<int> numInputs{ 0 };
+    atomic<int> firstInput{ 0 };
+    double primaryRate = 48000.0;
+    int blockSize = 512; // The primary's usual block
+    int maxBlockSize = minBlockSize;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(DeviceAggregator)
+};
@@ -0,0 +1,920 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <iostream>
+#include "CaptureEngine.h"
+#include "SimulatedAudioDevice.h"
+#include "LatencyCalibration.h"
+#include "ArchiveQueue.h"
+#include "MemoryGovernor.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Headless Options - settings read from the command line
+// Example:
+//   AudioRecorder --headless --device=dummy --channels=2 --format=wav --bits=24 --duration=60
+//   AudioRecorder --headless --input-file=test.wav --output=out.wav
+//   AudioRecorder --headless --device="My Interface" --inputs=1-8,11,12 --mono-files
+//   AudioRecorder --headless --device="My Interface" --inputs=1-6 --layout=5.1 (loudness with the surround weights)
+//   AudioRecorder --headless --device="My Interface" --buffer-size=64 --monitor --monitor-gain=-6
+//   AudioRecorder --headless --device=loopback --loopback-latency=1234 --calibrate
+//   AudioRecorder --headless --device="My Interface" --duration=3600 --gate --gate-threshold=-50 --gate-hold=2000
+//   AudioRecorder --headless --input-file=test.wav --bits=24 --archive
+//   AudioRecorder --headless --device=dummy --speed=20 --duration=600 --rt-check
+//   AudioRecorder --headless --device="My Interface" --channels=32 --bits=24 --duration=36000 --segment-seconds=900
+//   AudioRecorder --headless --benchmark-writers --duration=30 --buffer-size=256
+//   AudioRecorder --headless --device=dummy --duration=600 --tap=AudioRecorder (read it with --read-tap, see TapConsumer.h)
+//   AudioRecorder --headless --device="My Interface" --thread-topology=topology.json
+//   AudioRecorder --headless --device="My Interface" --mirror=/mnt/backup --mirror=@-12 (a backup disk and a safety copy)
+//   AudioRecorder --headless --device="Interface A" --aggregate="Interface B" --inputs=1-8,9-16
+//   AudioRecorder --headless --device=dummy --aggregate=dummy --aggregate-ppm=150 --channels=4 --speed=20 --duration=3600
+//   AudioRecorder --headless --device=dummy --duration=60 --device-restart=20 --restart-sample-rate=96000 (the take goes on through it)
+//   AudioRecorder --headless --device="My Interface" --channels=32 --memory-budget=128M (memory of every subsystem in the metrics)
+//==============================================================================
+struct HeadlessOptions
+{
+    String deviceType; // Driver type, e.g. "Windows Audio" or "ASIO" (empty = default)
+    String deviceName; // Device name, "dummy" picks the simulated test tone device
+    String inputDeviceName; // Only needed for drivers with separate input devices
+    File inputFile; // WAV file played in through the simulated file device
+    File outputFile; // Where the take is saved (empty = Documents folder)
+    CaptureSettings capture;
+    double durationSeconds = 10.0; // How long to record (0 = the whole input file, only with --input-file)
+    double sampleRate = 0.0; // 0 = device default
+    int bufferSize = 0; // 0 = device default
+    double metricsInterval = 1.0; // Seconds between metrics lines
+    double speed = 1.0; // Speed of the simulated devices
+    bool monitor = false; // Play the recorded inputs back out of the outputs
+    float monitorGainDb = 0.0f; // Monitoring level of every track
+    bool archive = false; // Turn the finished take into FLAC (verified) before exiting
+    bool calibrate = false; // Measure the round trip (output 1 to input 1) before recording
+    int latencyCompensation = -1; // Samples to shift the take by (-1 = the last calibration of this device)
+    int loopbackLatency = 1000; // Round trip of the simulated loopback device
+    bool realtimeCheck = false; // Report allocations, locks and waits in the audio callback, any of them fails the run
+    bool benchmarkWriters = false; // Only time JUCE's WAV writer against the capture kernels, nothing is recorded
+    String readTap; // Don't record, follow another recorder's tap with this name instead (TapConsumer)
+    int readDelayMs = 0; // TapConsumer waits this long after every read
+    String threadTopology; // JSON or a file with it, see ThreadTopology.h (empty = the default file, if there is one)
+    StringArray aggregateDevices; // More interfaces whose inputs come after the device's ("dummy" = simulated)
+    double aggregatePpm = 0.0; // Clock error of the simulated aggregated devices, the n-th one is n times off
+    double restartAt = 0.0; // Seconds into the take the device is restarted, or lost if nothing changes (0 = never)
+    double restartSampleRate = 0.0; // What it comes back with (0 = as before)
+    int restartBufferSize = 0;
+    String memoryBudget; // Like "256M", see MemoryGovernor.h (empty = no budget, just counted)
+    String layout; // "5.1" = the 6 tracks are L, R, C, LFE, Ls, Rs (empty = just tracks)
+
+    static bool isRequested(const String& commandLine)
+    {
+        return ArgumentList("AudioRecorder", commandLine).containsOption("--headless");
+    }
+
+    static HeadlessOptions fromCommandLine(const String& commandLine)
+    {
+        ArgumentList args("AudioRecorder", commandLine);
+        HeadlessOptions options;
+
+        options.deviceType = args.getValueForOption("--device-type");
+        options.deviceName = args.getValueForOption("--device");
+        options.inputDeviceName = args.getValueForOption("--input-device");
+
+        if (args.containsOption("--input-file"))
+            options.inputFile = args.getFileForOption("--input-file");
+
+        if (args.containsOption("--output"))
+            options.outputFile = File::getCurrentWorkingDirectory().getChildFile(args.getValueForOption("--output"));
+
+        if (args.containsOption("--channels"))
+            options.capture.numChannels = jlimit(1, 64, args.getValueForOption("--channels").getIntValue());
+
+        if (args.containsOption("--inputs"))
+            options.capture.inputRouting = CaptureSettings::parseRouting(args.getValueForOption("--inputs"));
+
+        options.capture.monoFilePerChannel = args.containsOption("--mono-files");
+
+        options.layout = args.getValueForOption("--layout");
+        options.capture.fiveOneLayout = options.layout == "5.1";
+
+        if (args.containsOption("--bits"))
+            options.capture.bitsPerSample = args.getValueForOption("--bits").getIntValue();
+
+        if (args.containsOption("--format"))
+            options.capture.formatName = args.getValueForOption("--format").toLowerCase();
+
+        if (args.containsOption("--duration"))
+            options.durationSeconds = args.getValueForOption("--duration").getDoubleValue();
+        else if (options.inputFile != File())
+            options.durationSeconds = 0.0; // Record the whole file
+        else if (args.containsOption("--read-tap"))
+            options.durationSeconds = 0.0; // Follow the tap until the recorder closes it
+
+        if (args.containsOption("--sample-rate"))
+            options.sampleRate = args.getValueForOption("--sample-rate").getDoubleValue();
+
+        if (args.containsOption("--buffer-size"))
+            options.bufferSize = args.getValueForOption("--buffer-size").getIntValue();
+
+        if (args.containsOption("--metrics-interval"))
+            options.metricsInterval = jmax(0.05, args.getValueForOption("--metrics-interval").getDoubleValue());
+
+        if (args.containsOption("--speed"))
+            options.speed = jmax(0.01, args.getValueForOption("--speed").getDoubleValue());
+
+        // Rolling takes, a new file every so many seconds and/or megabytes
+        if (args.containsOption("--segment-seconds"))
+            options.capture.segmentSeconds = jmax(0.0, args.getValueForOption("--segment-seconds").getDoubleValue());
+        if (args.containsOption("--segment-size"))
+            options.capture.segmentMegabytes = jmax(0, args.getValueForOption("--segment-size").getIntValue());
+
+        // Silence gate, times in milliseconds
+        GateSettings& gate = options.capture.gate;
+        gate.enabled = args.containsOption("--gate");
+        if (args.containsOption("--gate-threshold"))
+            gate.thresholdDb = args.getValueForOption("--gate-threshold").getFloatValue();
+        if (args.containsOption("--gate-attack"))
+            gate.attackMs = jmax(0.0f, args.getValueForOption("--gate-attack").getFloatValue());
+        if (args.containsOption("--gate-hold"))
+            gate.holdMs = jmax(0.0f, args.getValueForOption("--gate-hold").getFloatValue());
+        if (args.containsOption("--gate-release"))
+            gate.releaseMs = jmax(0.0f, args.getValueForOption("--gate-release").getFloatValue());
+        if (args.containsOption("--gate-pre-roll"))
+            gate.preRollMs = jlimit(0.0f, 10000.0f, args.getValueForOption("--gate-pre-roll").getFloatValue());
+
+        options.archive = args.containsOption("--archive");
+        options.realtimeCheck = args.containsOption("--rt-check");
+        options.benchmarkWriters = args.containsOption("--benchmark-writers");
+
+        // Shared memory tap - publish the take (--tap, optionally with a name), or read one
+        if (args.containsOption("--tap"))
+            options.capture.tapName = args.getValueForOption("--tap").isNotEmpty() ? args.getValueForOption("--tap") : String("AudioRecorder");
+        options.readTap = args.getValueForOption("--read-tap");
+        if (args.containsOption("--read-delay"))
+            options.readDelayMs = jmax(0, args.getValueForOption("--read-delay").getIntValue());
+        options.calibrate = args.containsOption("--calibrate");
+        if (args.containsOption("--latency-compensation"))
+            options.latencyCompensation = jmax(0, args.getValueForOption("--latency-compensation").getIntValue());
+        if (args.containsOption("--loopback-latency"))
+            options.loopbackLatency = jmax(0, args.getValueForOption("--loopback-latency").getIntValue());
+
+        options.threadTopology = args.getValueForOption("--thread-topology");
+
+        options.memoryBudget = args.getValueForOption("--memory-budget");
+
+        // A device restart in the middle of the take, to see it survive one
+        if (args.containsOption("--device-restart"))
+            options.restartAt = jmax(0.0, args.getValueForOption("--device-restart").getDoubleValue());
+        if (args.containsOption("--restart-sample-rate"))
+            options.restartSampleRate = args.getValueForOption("--restart-sample-rate").getDoubleValue();
+        if (args.containsOption("--restart-buffer-size"))
+            options.restartBufferSize = args.getValueForOption("--restart-buffer-size").getIntValue();
+
+        // Every --aggregate is one more interface, drift corrected against the device
+        for (auto& arg : args.arguments)
+            if (arg.isLongOption("--aggregate"))
+                options.aggregateDevices.add(arg.getLongOptionValue());
+        if (args.containsOption("--aggregate-ppm"))
+            options.aggregatePpm = args.getValueForOption("--aggregate-ppm").getDoubleValue();
+
+        // Every --mirror is one more destination, "folder", "folder@gainDb" or just "@gainDb"
+        for (auto& arg : args.arguments)
+            if (arg.isLongOption("--mirror"))
+                options.capture.mirrors.add(DestinationSettings::parse(arg.getLongOptionValue()));
+
+        options.monitor = args.containsOption("--monitor");
+        if (args.containsOption("--monitor-gain"))
+            options.monitorGainDb = args.getValueForOption("--monitor-gain").getFloatValue();
+
+        return options;
+    }
+};
+
+//==============================================================================
+// Headless Recorder - records from the command line without any window
+// Uses the same CaptureEngine as the UI, just driven by its own thread that
+// prints status and metrics to stdout instead of painting them.
+//==============================================================================
+class HeadlessRecorder : private Thread
+{
+public:
+    explicit HeadlessRecorder(const HeadlessOptions& headlessOptions)
+        : Thread("Headless Recorder"), options(headlessOptions)
+    {
+    }
+
+    ~HeadlessRecorder() override
+    {
+        stopThread(5000);
+        deviceManager.removeAudioCallback(&player);
+        player.setSource(nullptr);
+        engine.stopTake();
+        deviceManager.closeAudioDevice();
+    }
+
+    // Opens the device and starts recording, returns false if something failed
+    bool start()
+    {
+        String error;
+
+        if (options.realtimeCheck)
+        {
+            if (RealtimeChecker::isAvailable())
+                RealtimeChecker::setEnabled(true);
+            else
+                error = "This build has no realtime checker (build with AUDIO_RECORDER_RT_CHECKS=1)";
+        }
+
+        // Failing to get a priority or CPUs doesn't stop the take, it's in the report at the end
+        if (error.isEmpty())
+        {
+            if (options.threadTopology.isNotEmpty())
+                ThreadTopology::configure(options.threadTopology, error);
+            else if (ThreadTopology::getDefaultFile().existsAsFile())
+                ThreadTopology::configure(ThreadTopology::getDefaultFile().getFullPathName(), error);
+        }
+
+        // Nothing would be recorded - 0 only means "all of it" for an input file
+        if (error.isEmpty() && options.durationSeconds <= 0.0 && options.inputFile == File())
+            error = "--duration has to be more than 0 seconds without --input-file";
+
+        if (error.isEmpty() && options.layout.isNotEmpty() && !(options.capture.fiveOneLayout && options.capture.getNumTracks() == 6))
+            error = "--layout=5.1 is the only layout, and it needs exactly 6 tracks (not " + options.layout
+                + " with " + String(options.capture.getNumTracks()) + ")";
+
+        // Only WAV takes get archived, anything else is already what it's going to be
+        if (error.isEmpty() && options.archive && options.capture.formatName != "wav")
+            error = "--archive only works with --format=wav, this take is " + options.capture.formatName;
+
+        if (error.isEmpty() && options.memoryBudget.isNotEmpty())
+        {
+            size_t budget = 0;
+            if (MemoryGovernor::parseSize(options.memoryBudget, budget))
+                memoryGovernor->setBudget(budget);
+            else
+                error = "The memory budget has to be a size like 512M or 2G, not " + options.memoryBudget;
+        }
+
+        if (error.isEmpty())
+            error = openDevice();
+
+        if (error.isEmpty())
+            error = setUpLatencyCompensation();
+
+        if (error.isEmpty())
+        {
+            InputMonitor& monitor = engine.getMonitor();
+            monitor.setTrackInputs(options.capture.getTrackInputs());
+            for (int track = 0; track < options.capture.getNumTracks(); ++track)
+                monitor.setTrackGain(track, Decibels::decibelsToGain(options.monitorGainDb));
+            monitor.setEnabled(options.monitor);
+
+            player.setSource(&engine);
+            deviceManager.addAudioCallback(&player); // Calls prepareToPlay with the device sample rate
+
+            File file = options.outputFile;
+            if (file == File())
+            {
+                file = File::getSpecialLocation(File::userDocumentsDirectory)
+                    .getChildFile("Recording_" + Time::getCurrentTime().formatted("%Y%m%d_%H%M%S") + "." + options.capture.formatName);
+            }
+
+            if (!engine.startTake(file, options.capture, nullptr))
+                error = engine.getLastError();
+            else if (options.capture.tapName.isNotEmpty() && !engine.isTapOpen())
+            {
+                error = "The tap could not be opened: " + engine.getLastError(); // --tap was asked for, so the run fails
+                engine.stopTake();
+            }
+        }
+
+        if (error.isNotEmpty())
+        {
+            printLine("status=error message=\"" + error + "\"");
+            return false;
+        }
+
+        auto* device = deviceManager.getCurrentAudioDevice();
+        printLine("status=started device=\"" + device->getName() + "\""
+            + " sample_rate=" + String(device->getCurrentSampleRate())
+            + " buffer_size=" + String(device->getCurrentBufferSizeSamples())
+            + " tracks=" + String(options.capture.getNumTracks())
+            + " files=" + String(engine.getTakeFiles().size())
+            + " format=" + options.capture.formatName
+            + " bits=" + String(options.capture.bitsPerSample)
+            + " latency_compensation=" + String(engine.getLatencyCompensation())
+            + " monitor=" + String(options.monitor ? "on" : "off")
+            + " monitor_latency_samples=" + String(InputMonitor::getRoundTripLatency(*device))
+            + " monitor_latency_ms=" + String(InputMonitor::getRoundTripLatency(*device) * 1000.0 / device->getCurrentSampleRate(), 2)
+            + " mirrors=" + String(engine.getNumMirrors())
+            + " aggregated_inputs=" + String(aggregator.getNumInputs())
+            + " take_sample_rate=" + String(engine.getTakeSampleRate())
+            + " tap=" + (engine.isTapOpen() ? "\"" + engine.getTapFile().getFullPathName() + "\"" : String(options.capture.tapName.isEmpty() ? "off" : "failed"))
+            + " file=\"" + engine.getTakeFile().getFullPathName() + "\"");
+
+        reconnector.rememberDevice(); // A lost device is opened again when it comes back, the take goes on
+        startThread();
+        return true;
+    }
+
+    // Returns true if the take finished without errors
+    bool wasSuccessful() const { return successful; }
+
+    static void printLine(const String& line)
+    {
+        cout << line << endl;
+    }
+
+    // Writes the same noise through JUCE's WAV writer and through the take writer with its kernel, for every
+    // setup the kernels are specialised for. The data goes into a stream that drops it, so only the conversion
+    // is timed, not the disk. durationSeconds of audio per setup, best of three runs.
+    static void runWriterBenchmark(const HeadlessOptions& options)
+    {
+        struct DiscardingStream : public OutputStream
+        {
+            void flush() override {}
+            bool setPosition(int64 newPosition) override { position = newPosition; return true; }
+            int64 getPosition() override { return position; }
+            bool write(const void*, size_t numBytes) override { position += (int64) numBytes; return true; }
+            int64 position = 0;
+        };
+
+        double rate = options.sampleRate > 0.0 ? options.sampleRate : 48000.0;
+        int blockSize = options.bufferSize > 0 ? options.bufferSize : 512;
+        int numBlocks = jmax(1, (int) (jmax(1.0, options.durationSeconds) * rate / blockSize));
+        WavAudioFormat wav;
+        Random random;
+
+        auto timeWriter = [&](AudioFormatWriter* writer, const AudioBuffer<float>& block)
+        {
+            unique_ptr<AudioFormatWriter> owned(writer);
+            int64 start = Time::getHighResolutionTicks();
+            for (int i = 0; i < numBlocks; ++i)
+                owned->writeFromAudioSampleBuffer(block, 0, blockSize);
+            return Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - start) * 1000.0;
+        };
+
+        for (int bits : { 16, 24, 32 })
+        {
+            for (int channels : { 1, 2, 8, 16, 32 })
+            {
+                AudioBuffer<float> block(channels, blockSize);
+                for (int channel = 0; channel < channels; ++channel)
+                    for (int i = 0; i < blockSize; ++i)
+                        block.setSample(channel, i, random.nextFloat() - 0.5f);
+
+                double genericMs = 0.0, kernelMs = 0.0;
+                for (int run = 0; run < 3; ++run)
+                {
+                    double generic = timeWriter(wav.createWriterFor(new DiscardingStream(), rate, (unsigned int) channels, bits, {}, 0), block);
+                    double kernel = timeWriter(new CaptureWavWriter(new DiscardingStream(), rate, channels, bits, CaptureKernels::find(channels, bits)), block);
+                    genericMs = run == 0 ? generic : jmin(genericMs, generic);
+                    kernelMs = run == 0 ? kernel : jmin(kernelMs, kernel);
+                }
+
+                printLine("benchmark channels=" + String(channels) + " bits=" + String(bits)
+                    + " generic_ms=" + String(genericMs, 2) + " kernel_ms=" + String(kernelMs, 2)
+                    + " speedup=" + String(genericMs / jmax(0.001, kernelMs), 2)
+                    + " megasamples_per_second=" + String((double) numBlocks * blockSize * channels / jmax(0.001, kernelMs) / 1000.0, 1));
+            }
+        }
+    }
+
+private:
+    String openDevice()
+    {
+        SimulatedDeviceOptions simulatedOptions;
+        simulatedOptions.inputFile = options.inputFile;
+        simulatedOptions.numInputChannels = jmax(2, getNumInputsNeeded());
+        simulatedOptions.speed = options.speed;
+        simulatedOptions.loopbackLatency = options.loopbackLatency;
+
+        // Aggregated simulated devices have two inputs each, and clicks every second to check they stay aligned
+        bool aggregating = !options.aggregateDevices.isEmpty();
+        if (aggregating)
+        {
+            simulatedOptions.numInputChannels = 2;
+            simulatedOptions.markSeconds = true;
+        }
+
+        AudioDeviceManager::AudioDeviceSetup setup;
+        String typeName = options.deviceType;
+        setup.outputDeviceName = options.deviceName;
+
+        if (options.inputFile != File())
+        {
+            // Play the file in at its own sample rate
+            AudioFormatManager formatManager;
+            formatManager.registerBasicFormats();
+            unique_ptr<AudioFormatReader> reader(formatManager.createReaderFor(options.inputFile));
+
+            if (reader == nullptr)
+                return "Can't read input file " + options.inputFile.getFullPathName();
+
+            typeName = "Simulated";
+            setup.outputDeviceName = "Simulated File";
+            setup.sampleRate = reader->sampleRate;
+            simulatedOptions.numInputChannels = jmax(simulatedOptions.numInputChannels, (int) reader->numChannels);
+            fileLengthInSamples = reader->lengthInSamples;
+        }
+        else if (options.deviceName.equalsIgnoreCase("loopback"))
+        {
+            typeName = "Simulated";
+            setup.outputDeviceName = "Simulated Loopback";
+        }
+        else if (options.deviceName.equalsIgnoreCase("dummy") || (options.deviceName.isEmpty() && options.deviceType.isEmpty()))
+        {
+            typeName = "Simulated";
+            setup.outputDeviceName = "Simulated Sine";
+        }
+
+        deviceManager.getAvailableDeviceTypes(); // Creates the real driver types first, adding ours before would hide them
+        deviceManager.addAudioDeviceType(make_unique<SimulatedAudioDeviceType>(simulatedOptions));
+
+        if (typeName.isEmpty())
+            typeName = deviceManager.getAvailableDeviceTypes().getFirst()->getTypeName(); // Default driver of this system
+
+        deviceManager.setCurrentAudioDeviceType(typeName, true);
+
+        if (deviceManager.getCurrentDeviceTypeObject() == nullptr
+            || deviceManager.getCurrentDeviceTypeObject()->getTypeName() != typeName)
+            return "Unknown device type: " + typeName;
+
+        auto* type = deviceManager.getCurrentDeviceTypeObject();
+        type->scanForDevices();
+
+        if (setup.outputDeviceName.isEmpty())
+            setup.outputDeviceName = type->getDeviceNames(false)[type->getDefaultDeviceIndex(false)];
+
+        if (options.inputDeviceName.isNotEmpty())
+            setup.inputDeviceName = options.inputDeviceName;
+        else if (type->hasSeparateInputsAndOutputs())
+            setup.inputDeviceName = type->getDeviceNames(true)[type->getDefaultDeviceIndex(true)];
+        else
+            setup.inputDeviceName = setup.outputDeviceName;
+
+        if (options.sampleRate > 0.0)
+            setup.sampleRate = options.sampleRate;
+        if (options.bufferSize > 0)
+            setup.bufferSize = options.bufferSize;
+
+        setup.useDefaultInputChannels = false;
+        setup.inputChannels.clear();
+        setup.inputChannels.setRange(0, aggregating ? CaptureEngine::maxTracks : getNumInputsNeeded(), true); // All of them, the aggregated ones come after
+        setup.useDefaultOutputChannels = false;
+        setup.outputChannels.clear();
+        setup.outputChannels.setRange(0, 2, true);
+
+        String error = deviceManager.setAudioDeviceSetup(setup, true);
+        if (error.isNotEmpty())
+            return error;
+
+        auto* device = deviceManager.getCurrentAudioDevice();
+        if (device == nullptr)
+            return "No audio device could be opened";
+
+        int availableInputs = device->getActiveInputChannels().countNumberOfSetBits();
+        if (availableInputs <= 0)
+            return "Device has no input channels";
+
+        if (aggregating)
+        {
+            String aggregateError = openAggregatedDevices(simulatedOptions, availableInputs);
+            if (aggregateError.isNotEmpty())
+                return aggregateError;
+
+            availableInputs += aggregator.getNumInputs();
+        }
+
+        if (availableInputs < getNumInputsNeeded())
+        {
+            if (options.capture.inputRouting.isEmpty())
+            {
+                printLine("status=warning message=\"device only has " + String(availableInputs) + " input channels\"");
+                options.capture.numChannels = availableInputs;
+            }
+            else
+            {
+                return "Routing uses input " + String(getNumInputsNeeded()) + " but the device only has " + String(availableInputs);
+            }
+        }
+
+        return {};
+    }
+
+    // Opens every --aggregate device next to the primary one, their inputs are numbered after its firstInput ones
+    String openAggregatedDevices(SimulatedDeviceOptions simulatedOptions, int firstInput)
+    {
+        auto* primary = deviceManager.getCurrentAudioDevice();
+        aggregator.prepare(primary->getCurrentSampleRate(), primary->getCurrentBufferSizeSamples());
+        aggregator.setFirstInput(firstInput);
+
+        for (int index = 0; index < options.aggregateDevices.size(); ++index)
+        {
+            const String& name = options.aggregateDevices[index];
+            unique_ptr<AudioIODevice> device;
+
+            if (name.equalsIgnoreCase("dummy"))
+            {
+                simulatedOptions.clockPpm = options.aggregatePpm * (index + 1);
+                device = make_unique<SimulatedAudioDevice>("Simulated Sine", simulatedOptions);
+            }
+            else if (auto* type = deviceManager.getCurrentDeviceTypeObject())
+            {
+                device.reset(type->createDevice(type->hasSeparateInputsAndOutputs() ? String() : name, name));
+            }
+
+            String error;
+            if (!aggregator.addDevice(move(device), error))
+                return "Could not aggregate " + name + ": " + error;
+        }
+
+        engine.setAggregator(&aggregator);
+        return {};
+    }
+
+    // Runs the calibration if asked, otherwise uses the last one of this device (or the one from the command line)
+    String setUpLatencyCompensation()
+    {
+        auto* device = deviceManager.getCurrentAudioDevice();
+        int compensation = LatencySettings::load(device->getName(), device->getCurrentSampleRate(), device->getCurrentBufferSizeSamples());
+
+        if (options.calibrate)
+        {
+            LatencyCalibrator calibrator;
+            deviceManager.addAudioCallback(&calibrator);
+
+            // Sweep plus the longest round trip is 1.25 seconds, give it plenty more
+            for (int waited = 0; !calibrator.isFinished() && waited < (int) (5000 / options.speed); waited += 10)
+                Thread::sleep(10);
+
+            deviceManager.removeAudioCallback(&calibrator);
+
+            auto result = calibrator.analyse();
+            printLine("calibration round_trip_samples=" + String(result.roundTripSamples)
+                + " round_trip_ms=" + String(result.roundTripSamples * 1000.0 / jmax(1.0, result.sampleRate), 2)
+                + " reported_samples=" + String(result.reportedSamples)
+                + " confidence=" + String(result.confidence, 1)
+                + " succeeded=" + String(result.succeeded ? 1 : 0));
+
+            if (!result.succeeded)
+                return "Calibration failed: " + result.error;
+
+            LatencySettings::save(device->getName(), result, device->getCurrentBufferSizeSamples());
+            compensation = result.roundTripSamples;
+        }
+
+        if (options.latencyCompensation >= 0)
+            compensation = options.latencyCompensation;
+
+        engine.setLatencyCompensation(jmax(0, compensation));
+        return {};
+    }
+
+    // Number of device inputs that have to be open for the routing
+    int getNumInputsNeeded() const
+    {
+        int numInputs = 0;
+        for (int track = 0; track < options.capture.getNumTracks(); ++track)
+            numInputs = jmax(numInputs, options.capture.getInputForTrack(track) + 1);
+        return numInputs;
+    }
+
+    void run() override
+    {
+        ThreadTopology::applyToCurrentThread(ThreadTopology::ui); // Does what the message thread does in the UI
+        double sampleRate = engine.getTakeSampleRate();
+        int64 samplesToRecord = (int64) (options.durationSeconds * sampleRate);
+
+        if (samplesToRecord <= 0)
+            samplesToRecord = fileLengthInSamples;
+
+        double nextMetricsTime = options.metricsInterval;
+        bool restarted = options.restartAt <= 0.0;
+
+        while (!threadShouldExit() && engine.getState().nextSampleNum < samplesToRecord)
+        {
+            wait(10);
+
+            CaptureState state = engine.getState();
+            if (!restarted && state.playheadPosition >= options.restartAt)
+            {
+                restarted = true;
+                MessageManager::callAsync([this] { restartDevice(); });
+            }
+
+            if (state.playheadPosition >= nextMetricsTime)
+            {
+                printMetrics(state);
+                nextMetricsTime += options.metricsInterval;
+            }
+        }
+
+        engine.stopTake();
+        successful = engine.getDroppedBlocks() == 0 && engine.getDestinationReport()[0]["status"].toString() != "failed";
+
+        printLine("status=finished file=\"" + engine.getTakeFile().getFullPathName() + "\""
+            + " samples=" + String(engine.getTakeLength())
+            + " seconds=" + String(engine.getTakeLength() / sampleRate, 3)
+            + " dropped_blocks=" + String(engine.getDroppedBlocks()));
+
+        if (options.realtimeCheck)
+            successful = printRealtimeViolations() && successful;
+
+        if (ThreadTopology::isConfigured())
+            for (auto& line : ThreadTopology::getReport())
+                printLine("threads " + line);
+
+        printLine("memory " + memoryGovernor->getSummary());
+
+        // Every time the device went away or restarted, the take went on straight after it
+        var interruptions = engine.getLastTakeAnalysis()["interruptions"];
+        for (int index = 0; index < interruptions.size(); ++index)
+        {
+            var interruption = interruptions[index];
+            printLine("interruption sample=" + interruption["sample"].toString()
+                + " gap_seconds=" + String((double) interruption["gap_seconds"], 3)
+                + " sample_rate=" + interruption["sample_rate"].toString()
+                + " buffer_size=" + interruption["buffer_size"].toString()
+                + " resampled=" + String((bool) interruption["resampled"] ? 1 : 0));
+        }
+
+        // A failed mirror is reported but doesn't fail the run (a failed primary file does, above)
+        if (engine.getNumMirrors() > 0)
+        {
+            var destinations = engine.getDestinationReport();
+            for (int index = 0; index < destinations.size(); ++index)
+            {
+                var destination = destinations[index];
+                printLine("destination index=" + String(index)
+                    + " file=\"" + destination["file"].toString() + "\""
+                    + " gain_db=" + destination["gain_db"].toString()
+                    + " status=" + destination["status"].toString()
+                    + " dropped_blocks=" + destination["dropped_blocks"].toString()
+                    + " bytes_written=" + destination["bytes_written"].toString()
+                    + (destination.hasProperty("message") ? " message=\"" + destination["message"].toString() + "\"" : String()));
+            }
+        }
+
+        if (!aggregator.isEmpty())
+        {
+            var devices = engine.getLastTakeAnalysis()["aggregation"];
+            for (int index = 0; index < devices.size(); ++index)
+            {
+                var device = devices[index];
+                printLine("aggregate device=\"" + device["device"].toString() + "\""
+                    + " sample_rate=" + device["sample_rate"].toString()
+                    + " first_input=" + device["first_input"].toString()
+                    + " channels=" + device["channels"].toString()
+                    + " drift_ppm=" + String((double) device["drift_ppm"], 2)
+                    + " latency_samples=" + device["latency_samples"].toString()
+                    + " underruns=" + device["underruns"].toString()
+                    + " overruns=" + device["overruns"].toString());
+            }
+
+            printAlignment();
+        }
+
+        if (engine.getSegmentLength() > 0)
+        {
+            var index = engine.getLastTakeAnalysis()["segments"];
+            printLine("segments parts=" + String(index["parts"].size())
+                + " segment_samples=" + index["segment_samples"].toString()
+                + " total_samples=" + index["total_samples"].toString()
+                + " files=" + String(engine.getTakeFiles().size()));
+        }
+
+        if (options.capture.gate.enabled)
+        {
+            var gate = engine.getLastTakeAnalysis()["gate"];
+            int64 takeSamples = jmax((int64) 1, (int64) gate["take_samples"]);
+            printLine("gate regions=" + String(gate["regions"].size())
+                + " take_samples=" + gate["take_samples"].toString()
+                + " written_samples=" + gate["written_samples"].toString()
+                + " written_percent=" + String(100.0 * (double) gate["written_samples"] / (double) takeSamples, 1));
+        }
+
+        if (options.archive) // Only WAV takes get this far with --archive
+            archiveTake();
+
+        // Loudness of the whole take, the same numbers that go into the take's .take.json
+        var loudness = engine.getLastTakeAnalysis()["loudness"];
+        printLine("loudness integrated_lufs=" + loudness["integrated_lufs"].toString()
+            + " loudness_range_lu=" + loudness["loudness_range_lu"].toString()
+            + " true_peak_dbtp=" + loudness["true_peak_dbtp"].toString()
+            + " max_momentary_lufs=" + loudness["max_momentary_lufs"].toString()
+            + " max_short_term_lufs=" + loudness["max_short_term_lufs"].toString());
+
+        // Marker index, built while recording
+        var markers = engine.getLastTakeAnalysis()["markers"];
+        printLine("markers onsets=" + String(markers["onsets"].size())
+            + " level_changes=" + String(markers["level_changes"].size()));
+
+        if (!threadShouldExit())
+        {
+            bool result = successful;
+            MessageManager::callAsync([result]
+            {
+                JUCEApplicationBase::getInstance()->setApplicationReturnValue(result ? 0 : 1);
+                JUCEApplicationBase::quit();
+            });
+        }
+    }
+
+    // One line per place in the code that broke the rules, then its stack, returns true if there were none
+    static bool printRealtimeViolations()
+    {
+        auto violations = RealtimeChecker::getViolations();
+        printLine("realtime violations=" + String(RealtimeChecker::getNumViolations()) + " places=" + String((int) violations.size()));
+
+        for (auto& violation : violations)
+        {
+            printLine("realtime_violation what=" + violation.what + " count=" + String(violation.count));
+            for (auto& frame : StringArray::fromLines(violation.stackTrace.trimEnd()))
+                printLine("    " + frame);
+        }
+
+        return violations.empty();
+    }
+
+    // Archives every file of the take and waits until that is done
+    void archiveTake()
+    {
+        ArchiveQueue archiveQueue;
+        archiveQueue.onTakeArchived = [](const ArchiveQueue::Result& result)
+        {
+            printLine("archive source=\"" + result.source.getFileName() + "\""
+                + " file=\"" + result.archive.getFullPathName() + "\""
+                + " succeeded=" + String(result.succeeded ? 1 : 0)
+                + " chunks=" + String(result.numChunks)
+                + " source_bytes=" + String(result.sourceBytes)
+                + " archive_bytes=" + String(result.archiveBytes)
+                + (result.succeeded ? String() : " message=\"" + result.message + "\""));
+
+            if (result.succeeded)
+                result.source.deleteFile();
+        };
+
+        for (auto& takeFile : engine.getTakeFiles())
+            archiveQueue.addTake(takeFile);
+
+        while (archiveQueue.getNumPending() > 0 && !threadShouldExit())
+            wait(50);
+    }
+
+    // Everything but the loudness comes from one published state, so the numbers are from the same block
+    void printMetrics(const CaptureState& state)
+    {
+        float level = state.currentLevel;
+        const LoudnessMeter& meter = engine.getLoudnessMeter();
+
+        printLine("metrics time=" + String(state.playheadPosition, 2)
+            + " samples=" + String(state.nextSampleNum)
+            + " level=" + String(level, 4)
+            + " level_db=" + String(Decibels::gainToDecibels(level), 1)
+            + " dropped_blocks=" + String(state.droppedBlocks)
+            + (engine.getNumMirrors() > 0 ? " destinations=" + getDestinationStatusText() : String())
+            + (!aggregator.isEmpty() ? " drift_ppm=" + getDriftText() : String())
+            + (engine.getNumInterruptions() > 0 ? " interruptions=" + String(engine.getNumInterruptions()) : String())
+            + (options.realtimeCheck ? " rt_violations=" + String(RealtimeChecker::getNumViolations()) : String())
+            + (options.capture.gate.enabled ? " gate=" + String(engine.getGate().isOpen() ? "open" : "closed") : String())
+            + " peaks=" + getTrackPeaksText(state)
+            + " lufs_m=" + String(meter.getMomentaryLoudness(), 1)
+            + " lufs_s=" + String(meter.getShortTermLoudness(), 1)
+            + " lufs_i=" + String(meter.getIntegratedLoudnessLive(), 1)
+            + " true_peak_dbtp=" + String(meter.getTruePeakDecibels(), 1)
+            + " analysis_overruns=" + String(engine.getAnalysisOverruns())
+            + " memory_mb=" + String(memoryGovernor->getTotalUsage() / (1024.0 * 1024.0), 1)
+            + (memoryGovernor->getBudget() > 0 ? " memory_pressure=" + String((int) memoryGovernor->getPressure()) : String())
+            + " cpu=" + String(deviceManager.getCpuUsage() * 100.0, 1));
+    }
+
+    // Message thread - with a new rate or buffer size the device restarts, otherwise it's closed as if it was
+    // unplugged and the reconnector has to bring it back
+    void restartDevice()
+    {
+        auto setup = deviceManager.getAudioDeviceSetup();
+        if (options.restartSampleRate <= 0.0 && options.restartBufferSize <= 0)
+        {
+            printLine("status=device_lost");
+            deviceManager.closeAudioDevice();
+            return;
+        }
+
+        if (options.restartSampleRate > 0.0)
+            setup.sampleRate = options.restartSampleRate;
+        if (options.restartBufferSize > 0)
+            setup.bufferSize = options.restartBufferSize;
+
+        String error = deviceManager.setAudioDeviceSetup(setup, true);
+        printLine(error.isEmpty() ? "status=device_restarted sample_rate=" + String(setup.sampleRate) + " buffer_size=" + String(setup.bufferSize)
+                                  : "status=warning message=\"" + error + "\"");
+    }
+
+    // Measured drift of every aggregated device, like "99.8,-20.1"
+    String getDriftText() const
+    {
+        StringArray drifts;
+        var devices = aggregator.getReport();
+        for (int index = 0; index < devices.size(); ++index)
+            drifts.add(String((double) devices[index]["drift_ppm"], 1));
+        return drifts.joinIntoString(",");
+    }
+
+    // Simulated devices click once a second (see SimulatedAudioDevice.h), this finds the clicks on the first
+    // track of the device and the first aggregated one and prints how far apart they are. Once the drift
+    // tracker has settled the offset is the aggregated inputs' fixed latency, and it shouldn't move
+    void printAlignment()
+    {
+        int primaryTrack = -1, aggregatedTrack = -1;
+        for (int track = 0; track < options.capture.getNumTracks(); ++track)
+        {
+            bool fromAggregate = options.capture.getInputForTrack(track) >= aggregator.getFirstInput();
+            if (fromAggregate && aggregatedTrack < 0)
+                aggregatedTrack = track;
+            if (!fromAggregate && primaryTrack < 0)
+                primaryTrack = track;
+        }
+
+        // Only one plain WAV file has every track on the same timeline
+        if (primaryTrack < 0 || aggregatedTrack < 0 || engine.getTakeFiles().size() != 1
+            || options.capture.formatName != "wav" || options.capture.gate.enabled)
+            return;
+
+        unique_ptr<AudioFormatReader> reader(WavAudioFormat().createReaderFor(engine.getTakeFile().createInputStream().release(), true));
+        if (reader == nullptr)
+            return;
+
+        // The device's click is near the start of every second, the aggregated one a little later
+        int second = (int) reader->sampleRate;
+        int before = second / 4, after = second / 2;
+        double settleSeconds = jmin(120.0, (double) reader->lengthInSamples / reader->sampleRate / 2.0);
+        AudioBuffer<float> buffer((int) reader->numChannels, before + after);
+        Array<double> offsets;
+
+        for (int64 click = second; click + after <= reader->lengthInSamples && !threadShouldExit(); click += second)
+        {
+            if ((double) click / reader->sampleRate < settleSeconds)
+                continue;
+
+            reader->read(&buffer, 0, buffer.getNumSamples(), click - before, true, true);
+            double primaryClick = findClick(buffer.getReadPointer(primaryTrack), 0, buffer.getNumSamples());
+            double aggregatedClick = findClick(buffer.getReadPointer(aggregatedTrack), before, buffer.getNumSamples());
+            offsets.add(aggregatedClick - primaryClick);
+        }
+
+        if (offsets.isEmpty())
+            return;
+
+        auto range = Range<double>::findMinAndMax(offsets.getRawDataPointer(), offsets.size());
+        printLine("alignment clicks=" + String(offsets.size())
+            + " from_seconds=" + String(settleSeconds, 0)
+            + " first_offset_samples=" + String(offsets.getFirst(), 2)
+            + " last_offset_samples=" + String(offsets.getLast(), 2)
+            + " spread_samples=" + String(range.getLength(), 2));
+    }
+
+    // Position of the sharpest peak from start on, with the fraction between samples (the sine under it is smooth)
+    static double findClick(const float* data, int start, int end)
+    {
+        auto sharpness = [data](int i) { return data[i] - 0.5f * (data[i - 1] + data[i + 1]); };
+
+        int best = jmax(2, start);
+        for (int i = best + 1; i < end - 2; ++i)
+            if (sharpness(i) > sharpness(best))
+                best = i;
+
+        float left = sharpness(best - 1), centre = sharpness(best), right = sharpness(best + 1);
+        float curvature = left - 2.0f * centre + right;
+        return best + (curvature < 0.0f ? 0.5 * (left - right) / curvature : 0.0);
+    }
+
+    // Status of the primary file and every mirror, like "ok,ok,failed"
+    String getDestinationStatusText() const
+    {
+        StringArray statuses;
+        var destinations = engine.getDestinationReport();
+        for (int index = 0; index < destinations.size(); ++index)
+            statuses.add(destinations[index]["status"].toString());
+        return statuses.joinIntoString(",");
+    }
+
+    // Peak of every track in dB, like "-6.1,-12.0"
+    static String getTrackPeaksText(const CaptureState& state)
+    {
+        StringArray peaks;
+        for (int track = 0; track < state.numTracks; ++track)
+            peaks.add(String(Decibels::gainToDecibels(state.trackPeaks[(size_t) track]), 1));
+        return peaks.joinIntoString(",");
+    }
+
+    HeadlessOptions options;
+    SharedResourcePointer<MemoryGovernor> memoryGovernor; // First, everything after it keeps its accounts in it
+    DeviceAggregator aggregator; // Before the device manager, it's stopped after the device that pulls from it
+    AudioDeviceManager deviceManager;
+    AudioSourcePlayer player;
+    CaptureEngine engine;
+    DeviceReconnector reconnector{ deviceManager, [this] { return engine.getIsRecording(); } };
+    int64 fileLengthInSamples = 0;
+    bool successful = false;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(HeadlessRecorder)
+};
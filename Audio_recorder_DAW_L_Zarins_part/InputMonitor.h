@@ -0,0 +1,157 @@
+#pragma once
+
+#include <JuceHeader.h>
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Input Monitor - plays the armed inputs straight back out of the outputs
+// Runs inside the audio callback on the same block that came in, so the only
+// latency is the device's own. Everything the callback touches is made in
+// prepare() and the settings are atomics, so there is nothing to lock and
+// nothing to allocate - the cost is a few SIMD adds per track.
+// With one track it goes to every output, otherwise track t goes to output
+// t % numOutputs (so a stereo take comes back as left and right).
+//==============================================================================
+class InputMonitor
+{
+public:
+    static constexpr int maxTracks = 64;
+    static constexpr int maxOutputs = 8;
+
+    InputMonitor()
+    {
+        mixBuffer.setSize(maxOutputs, 512);
+
+        for (int track = 0; track < maxTracks; ++track)
+        {
+            trackInputs[(size_t) track] = track;
+            trackGains[(size_t) track] = 1.0f;
+            trackMutes[(size_t) track] = false;
+            currentGains[(size_t) track] = 0.0f;
+        }
+    }
+
+    // Message thread - before the device starts, blocks bigger than this are done in pieces
+    void prepare(int maxBlockSize)
+    {
+        if (maxBlockSize > mixBuffer.getNumSamples())
+            mixBuffer.setSize(maxOutputs, maxBlockSize);
+    }
+
+    // Message thread settings, picked up by the next block
+    void setEnabled(bool shouldBeEnabled) { enabled = shouldBeEnabled; }
+    bool isEnabled() const { return enabled; }
+
+    // Device input of every armed track (0 based), the same order as the take's tracks
+    void setTrackInputs(const Array<int>& inputs)
+    {
+        int num = jmin(inputs.size(), maxTracks);
+        for (int track = 0; track < num; ++track)
+            trackInputs[(size_t) track] = inputs[track];
+
+        numTracks = num;
+    }
+
+    int getNumTracks() const { return numTracks; }
+
+    void setTrackGain(int track, float gain)
+    {
+        if (isPositiveAndBelow(track, maxTracks))
+            trackGains[(size_t) track] = jmax(0.0f, gain);
+    }
+
+    void setTrackMuted(int track, bool shouldBeMuted)
+    {
+        if (isPositiveAndBelow(track, maxTracks))
+            trackMutes[(size_t) track] = shouldBeMuted;
+    }
+
+    float getTrackGain(int track) const { return isPositiveAndBelow(track, maxTracks) ? trackGains[(size_t) track].load() : 0.0f; }
+    bool isTrackMuted(int track) const { return isPositiveAndBelow(track, maxTracks) && trackMutes[(size_t) track].load(); }
+
+    // How many of the buffer's channels are real device outputs
+    void setNumOutputs(int newNumOutputs) { numOutputs = jlimit(1, maxOutputs, newNumOutputs); }
+
+    // Input to output latency of monitoring through this device, in samples
+    // Some drivers leave their buffers out of what they report, one block each way is the least it can be
+    static int getRoundTripLatency(AudioIODevice& device)
+    {
+        int reported = device.getInputLatencyInSamples() + device.getOutputLatencyInSamples();
+        return jmax(reported, 2 * device.getCurrentBufferSizeSamples());
+    }
+
+    // Audio thread - replaces the outputs in the buffer with the monitored inputs (or silence when monitoring is off)
+    // The buffer holds the inputs and the outputs in the same channels (like AudioSourcePlayer gives it),
+    // so every piece is mixed completely before any of it is written back
+    void process(AudioBuffer<float>& buffer, int startSample, int numSamples)
+    {
+        if (!enabled)
+        {
+            currentGains.fill(0.0f); // Fades in again when it is switched back on
+            buffer.clear(startSample, numSamples);
+            return;
+        }
+
+        int tracks = numTracks;
+        int outputs = jmin((int) numOutputs, buffer.getNumChannels(), mixBuffer.getNumChannels());
+        int samplesDone = 0;
+
+        if (outputs <= 0)
+            return;
+
+        while (samplesDone < numSamples)
+        {
+            int num = jmin(numSamples - samplesDone, mixBuffer.getNumSamples());
+            int position = startSample + samplesDone;
+
+            for (int out = 0; out < outputs; ++out)
+                FloatVectorOperations::clear(mixBuffer.getWritePointer(out), num);
+
+            for (int track = 0; track < tracks; ++track)
+            {
+                float startGain = currentGains[(size_t) track];
+                float endGain = trackMutes[(size_t) track] ? 0.0f : trackGains[(size_t) track].load();
+                currentGains[(size_t) track] = endGain;
+
+                int input = trackInputs[(size_t) track];
+                if ((startGain == 0.0f && endGain == 0.0f) || !isPositiveAndBelow(input, buffer.getNumChannels()))
+                    continue;
+
+                // A gain change is ramped over the piece so it doesn't click, otherwise this is one SIMD add
+                const float* source = buffer.getReadPointer(input, position);
+                if (tracks == 1)
+                {
+                    for (int out = 0; out < outputs; ++out)
+                        mixBuffer.addFromWithRamp(out, 0, source, num, startGain, endGain);
+                }
+                else
+                {
+                    mixBuffer.addFromWithRamp(track % outputs, 0, source, num, startGain, endGain);
+                }
+            }
+
+            for (int out = 0; out < outputs; ++out)
+                FloatVectorOperations::copy(buffer.getWritePointer(out, position), mixBuffer.getReadPointer(out), num);
+
+            samplesDone += num;
+        }
+
+        // Channels past the outputs only held inputs
+        for (int ch = outputs; ch < buffer.getNumChannels(); ++ch)
+            buffer.clear(ch, startSample, numSamples);
+    }
+
+private:
+    atomic<bool> enabled{ false };
+    atomic<int> numTracks{ 0 };
+    atomic<int> numOutputs{ 2 };
+    array<atomic<int>, maxTracks> trackInputs;
+    array<atomic<float>, maxTracks> trackGains;
+    array<atomic<bool>, maxTracks> trackMutes;
+
+    array<float, maxTracks> currentGains{}; // Audio thread only, gains of the last block for ramping
+    AudioBuffer<float> mixBuffer; // Outputs being mixed, one piece at a time
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(InputMonitor)
+};
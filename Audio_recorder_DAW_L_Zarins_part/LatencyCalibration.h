@@ -0,0 +1,234 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "Spectrogram.h"
+#include "RealtimeChecker.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Latency Calibrator - measures the real round trip of the sound card
+// Plays a short sweep out of one output and records one input at the same
+// time (with a cable or the interface's own loopback between them). The
+// recording is cross-correlated with the sweep, and the position of the peak
+// is how many samples later the sweep came back in. Drivers often report
+// their latency wrong, this number is what actually happens.
+//==============================================================================
+class LatencyCalibrator : public AudioIODeviceCallback
+{
+public:
+    struct Result
+    {
+        bool succeeded = false;
+        int roundTripSamples = 0; // Measured, what recordings get shifted by
+        int reportedSamples = 0; // What the driver says (input + output latency)
+        double sampleRate = 0.0;
+        float confidence = 0.0f; // Correlation peak against the average, below minConfidence the result is thrown away
+        String error;
+    };
+
+    static constexpr float minConfidence = 8.0f;
+
+    // Channels are 0 based and count only the channels the device has open
+    LatencyCalibrator(int inputChannelToUse = 0, int outputChannelToUse = 0)
+        : inputChannel(inputChannelToUse), outputChannel(outputChannelToUse)
+    {
+    }
+
+    // Before the first block (when the callback is added to the device) - makes the sweep and the recording buffer
+    void audioDeviceAboutToStart(AudioIODevice* device) override
+    {
+        sampleRate = device->getCurrentSampleRate();
+        reportedLatency = device->getInputLatencyInSamples() + device->getOutputLatencyInSamples();
+
+        // Log sweep from 100 Hz to almost Nyquist, faded in and out so it doesn't click
+        int sweepLength = (int) (sampleRate * sweepSeconds);
+        sweep.setSize(1, sweepLength);
+        float* data = sweep.getWritePointer(0);
+        double startFrequency = 100.0, endFrequency = sampleRate * 0.45;
+        double rate = log(endFrequency / startFrequency);
+
+        for (int i = 0; i < sweepLength; ++i)
+        {
+            double t = i / sampleRate;
+            double phase = MathConstants<double>::twoPi * startFrequency * sweepSeconds / rate * (exp(t / sweepSeconds * rate) - 1.0);
+            float fade = jmin(1.0f, jmin(i, sweepLength - 1 - i) / (float) (sampleRate * 0.005));
+            data[i] = 0.5f * fade * (float) sin(phase);
+        }
+
+        recording.setSize(1, sweepLength + (int) (sampleRate * maxLatencySeconds));
+        recording.clear();
+        position = 0;
+        finished = false;
+    }
+
+    void audioDeviceStopped() override {}
+
+    void audioDeviceIOCallbackWithContext(const float* const* inputChannelData, int numInputChannels,
+        float* const* outputChannelData, int numOutputChannels, int numSamples,
+        const AudioIODeviceCallbackContext&) override
+    {
+        const RealtimeChecker::ScopedRealtime realtime;
+
+        for (int ch = 0; ch < numOutputChannels; ++ch)
+            if (outputChannelData[ch] != nullptr)
+                FloatVectorOperations::clear(outputChannelData[ch], numSamples);
+
+        if (finished)
+            return;
+
+        // Output and input of one block are the same moment in device time, so the
+        // recording starts at the same position as the sweep
+        int num = jmin(numSamples, recording.getNumSamples() - position);
+
+        if (isPositiveAndBelow(outputChannel, numOutputChannels) && outputChannelData[outputChannel] != nullptr && position < sweep.getNumSamples())
+            FloatVectorOperations::copy(outputChannelData[outputChannel], sweep.getReadPointer(0, position), jmin(num, sweep.getNumSamples() - position));
+
+        if (isPositiveAndBelow(inputChannel, numInputChannels) && inputChannelData[inputChannel] != nullptr)
+            FloatVectorOperations::copy(recording.getWritePointer(0, position), inputChannelData[inputChannel], num);
+
+        position += num;
+        if (position >= recording.getNumSamples())
+            finished = true;
+    }
+
+    bool isFinished() const { return finished; }
+
+    // Message thread, once isFinished() - cross-correlates the recording with the sweep
+    Result analyse() const
+    {
+        Result result;
+        result.sampleRate = sampleRate;
+        result.reportedSamples = reportedLatency;
+
+        int sweepLength = sweep.getNumSamples(), recordingLength = recording.getNumSamples();
+        if (!finished || sweepLength == 0)
+        {
+            result.error = "Calibration did not run";
+            return result;
+        }
+
+        // Correlation = IFFT(FFT(recording) * conj(FFT(sweep))), big enough that nothing wraps around
+        int order = jmax(1, (int) ceil(log2((double) (recordingLength + sweepLength))));
+        SimpleFFT fft(order);
+        int size = fft.getSize();
+
+        vector<complex<float>> recorded((size_t) size), reference((size_t) size);
+        for (int i = 0; i < recordingLength; ++i)
+            recorded[(size_t) i] = recording.getSample(0, i);
+        for (int i = 0; i < sweepLength; ++i)
+            reference[(size_t) i] = sweep.getSample(0, i);
+
+        fft.perform(recorded.data());
+        fft.perform(reference.data());
+
+        // Inverse transform with the forward one: ifft(x) = conj(fft(conj(x))) / size
+        for (int i = 0; i < size; ++i)
+            recorded[(size_t) i] = conj(recorded[(size_t) i] * conj(reference[(size_t) i]));
+
+        fft.perform(recorded.data());
+
+        int bestLag = 0;
+        float bestValue = 0.0f;
+        double sum = 0.0;
+        int numLags = recordingLength - sweepLength + 1;
+
+        for (int lag = 0; lag < numLags; ++lag)
+        {
+            float value = abs(recorded[(size_t) lag].real());
+            sum += value;
+
+            if (value > bestValue)
+            {
+                bestValue = value;
+                bestLag = lag;
+            }
+        }
+
+        result.confidence = (float) (bestValue / jmax(1.0e-12, sum / numLags));
+        result.roundTripSamples = bestLag;
+
+        if (bestValue <= 0.0f)
+            result.error = "Nothing came back in, check the loopback cable";
+        else if (result.confidence < minConfidence)
+            result.error = "The sweep could not be found clearly in the input (too much noise?)";
+        else
+            result.succeeded = true;
+
+        return result;
+    }
+
+private:
+    static constexpr double sweepSeconds = 0.25;
+    static constexpr double maxLatencySeconds = 1.0; // Longest round trip that can be measured
+
+    int inputChannel, outputChannel;
+    double sampleRate = 48000.0;
+    int reportedLatency = 0;
+
+    AudioBuffer<float> sweep; // Played out
+    AudioBuffer<float> recording; // What came back in
+    int position = 0;
+    atomic<bool> finished{ false };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(LatencyCalibrator)
+};
+
+//==============================================================================
+// Latency Settings - measured round trips, remembered per device
+// Saved in the user's application data folder as JSON, one entry per device
+// name. A measurement only counts for the sample rate and buffer size it was
+// made with, anything else changes the latency.
+//==============================================================================
+struct LatencySettings
+{
+    static File getFile()
+    {
+        return File::getSpecialLocation(File::userApplicationDataDirectory)
+            .getChildFile("AudioRecorder").getChildFile("latency.json");
+    }
+
+    static var toVar(const LatencyCalibrator::Result& result, int bufferSize)
+    {
+        auto* entry = new DynamicObject();
+        entry->setProperty("round_trip_samples", result.roundTripSamples);
+        entry->setProperty("reported_samples", result.reportedSamples);
+        entry->setProperty("sample_rate", result.sampleRate);
+        entry->setProperty("buffer_size", bufferSize);
+        entry->setProperty("confidence", result.confidence);
+        entry->setProperty("measured", Time::getCurrentTime().toISO8601(true));
+        return var(entry);
+    }
+
+    static bool save(const String& deviceName, const LatencyCalibrator::Result& result, int bufferSize)
+    {
+        if (deviceName.isEmpty())
+            return false;
+
+        File file = getFile();
+        var root = file.existsAsFile() ? JSON::parse(file) : var();
+        if (root.getDynamicObject() == nullptr)
+            root = var(new DynamicObject());
+
+        root.getDynamicObject()->setProperty(deviceName, toVar(result, bufferSize));
+        file.getParentDirectory().createDirectory();
+        return file.replaceWithText(JSON::toString(root));
+    }
+
+    // Round trip of the device in samples, or -1 if it was never measured with these settings
+    static int load(const String& deviceName, double sampleRate, int bufferSize)
+    {
+        File file = getFile();
+        if (deviceName.isEmpty())
+            return -1;
+
+        var entry = file.existsAsFile() ? JSON::parse(file)[Identifier(deviceName)] : var();
+
+        if (entry.getDynamicObject() == nullptr
+            || (double) entry["sample_rate"] != sampleRate
+            || (int) entry["buffer_size"] != bufferSize)
+            return -1;
+
+        return (int) entry["round_trip_samples"];
+    }
+};
@@ -0,0 +1,414 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "AnalysisThread.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Loudness Meter - EBU R128 / ITU-R BS.1770-4 loudness and true peak
+// Momentary (400 ms), short-term (3 s) and integrated loudness in LUFS, the
+// loudness range (LRA) in LU and the 4x oversampled true peak in dBTP.
+// Runs as an analysis stage, so none of this happens on the audio thread.
+//==============================================================================
+class LoudnessMeter : public AnalysisStage
+{
+public:
+    LoudnessMeter()
+    {
+        makeTruePeakFilter();
+        resetLiveValues();
+    }
+
+    String getName() const override { return "loudness"; }
+
+    // Before prepare() - the 6 channels are L, R, C, LFE, Ls, Rs. Tracks are just routed inputs,
+    // so six of them are six mics unless the take says otherwise (CaptureSettings::fiveOneLayout, --layout=5.1)
+    void setFiveOneLayout(bool isFiveOne) { fiveOneLayout = isFiveOne; }
+
+    void prepare(double newSampleRate, int newNumChannels) override
+    {
+        sampleRate = newSampleRate;
+        numChannels = newNumChannels;
+
+        makeKWeightingFilters();
+        filterStates.assign((size_t) numChannels * 2, BiquadState());
+
+        // A 5.1 layout gets the BS.1770 weights (LFE ignored, surrounds +1.5 dB), everything else counts every channel once
+        channelWeights.assign((size_t) numChannels, 1.0);
+        if (fiveOneLayout && numChannels == 6)
+        {
+            channelWeights[3] = 0.0;
+            channelWeights[4] = 1.41;
+            channelWeights[5] = 1.41;
+        }
+
+        subBlockLength = roundToInt(sampleRate / 10.0); // Gating blocks move in 100 ms steps
+        subBlockPosition = 0;
+        subBlockEnergy.assign((size_t) numChannels, 0.0);
+        recentSubBlocks.fill(0.0);
+        numSubBlocks = 0;
+
+        gatingHistogram.fill(0);
+        shortTermHistogram.fill(0);
+
+        filtered.setSize(1, AnalysisStage::maxChunkSize);
+        peakHistory.setSize(numChannels, tapsPerPhase - 1);
+        peakHistory.clear();
+        peakInput.setSize(1, tapsPerPhase - 1 + AnalysisStage::maxChunkSize);
+        oversampled.setSize(1, oversampling * AnalysisStage::maxChunkSize);
+
+        maxMomentary = maxShortTerm = -numeric_limits<double>::infinity();
+        truePeak = samplePeak = 0.0f;
+        resetLiveValues();
+    }
+
+    void process(const AudioBuffer<float>& block, int numSamples) override
+    {
+        for (int ch = 0; ch < numChannels; ++ch)
+            measurePeaks(ch, block.getReadPointer(ch), numSamples);
+
+        int position = 0;
+        while (position < numSamples)
+        {
+            int num = jmin(numSamples - position, subBlockLength - subBlockPosition);
+
+            for (int ch = 0; ch < numChannels; ++ch)
+            {
+                float* data = filtered.getWritePointer(0);
+                applyKWeighting(ch, block.getReadPointer(ch, position), data, num);
+
+                FloatVectorOperations::multiply(data, data, num); // Squares (SIMD)
+                double sum = 0.0;
+                for (int i = 0; i < num; ++i)
+                    sum += data[i];
+
+                subBlockEnergy[(size_t) ch] += sum;
+            }
+
+            subBlockPosition += num;
+            position += num;
+
+            if (subBlockPosition == subBlockLength)
+                finishSubBlock();
+        }
+    }
+
+    var getResults() override
+    {
+        auto* results = new DynamicObject();
+        results->setProperty("integrated_lufs", toJson(getIntegratedLoudness()));
+        results->setProperty("loudness_range_lu", toJson(getLoudnessRange()));
+        results->setProperty("true_peak_dbtp", toJson(Decibels::gainToDecibels(truePeak, -1000.0f)));
+        results->setProperty("sample_peak_dbfs", toJson(Decibels::gainToDecibels(samplePeak, -1000.0f)));
+        results->setProperty("max_momentary_lufs", toJson(maxMomentary));
+        results->setProperty("max_short_term_lufs", toJson(maxShortTerm));
+        return var(results);
+    }
+
+    // Live values for meters, safe to read from any thread (-inf = not measured yet)
+    float getMomentaryLoudness() const { return momentaryLive; }
+    float getShortTermLoudness() const { return shortTermLive; }
+    float getIntegratedLoudnessLive() const { return integratedLive; }
+    float getTruePeakDecibels() const { return truePeakLive; }
+
+private:
+    struct BiquadState
+    {
+        double x1 = 0.0, x2 = 0.0, y1 = 0.0, y2 = 0.0;
+    };
+
+    struct BiquadCoefficients
+    {
+        double b0 = 1.0, b1 = 0.0, b2 = 0.0, a1 = 0.0, a2 = 0.0;
+    };
+
+    static constexpr int oversampling = 4;
+    static constexpr int tapsPerPhase = 12; // 48 tap interpolation filter like the BS.1770 example
+    static constexpr double absoluteGate = -70.0; // LUFS
+    static constexpr double histogramMinimum = -70.0; // LUFS, first histogram bin
+    static constexpr double histogramStep = 0.1; // LU per histogram bin
+    static constexpr int histogramBins = 800; // -70 to +10 LUFS
+
+    static var toJson(double value)
+    {
+        return isfinite(value) && value > -999.0 ? var(round(value * 100.0) / 100.0) : var(); // JSON has no -inf, null means silence
+    }
+
+    static double energyToLufs(double energy)
+    {
+        return energy > 0.0 ? -0.691 + 10.0 * log10(energy) : -numeric_limits<double>::infinity();
+    }
+
+    static double lufsToEnergy(double lufs)
+    {
+        return pow(10.0, (lufs + 0.691) / 10.0);
+    }
+
+    static double binCentre(int bin)
+    {
+        return histogramMinimum + (bin + 0.5) * histogramStep;
+    }
+
+    static int binForLoudness(double lufs)
+    {
+        return jlimit(0, histogramBins - 1, (int) ((lufs - histogramMinimum) / histogramStep));
+    }
+
+    void resetLiveValues()
+    {
+        momentaryLive = shortTermLive = integratedLive = truePeakLive = -numeric_limits<float>::infinity();
+    }
+
+    // The two K-weighting filters from BS.1770, worked out for any sample rate
+    void makeKWeightingFilters()
+    {
+        double K = tan(MathConstants<double>::pi * 1681.974450955533 / sampleRate);
+        double Q = 0.7071752369554196;
+        double Vh = pow(10.0, 3.999843853973347 / 20.0);
+        double Vb = pow(Vh, 0.4996667741545416);
+        double a0 = 1.0 + K / Q + K * K;
+
+        shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+        shelf.b1 = 2.0 * (K * K - Vh) / a0;
+        shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+        shelf.a1 = 2.0 * (K * K - 1.0) / a0;
+        shelf.a2 = (1.0 - K / Q + K * K) / a0;
+
+        K = tan(MathConstants<double>::pi * 38.13547087602444 / sampleRate);
+        Q = 0.5003270373238773;
+        a0 = 1.0 + K / Q + K * K;
+
+        highPass.b0 = 1.0;
+        highPass.b1 = -2.0;
+        highPass.b2 = 1.0;
+        highPass.a1 = 2.0 * (K * K - 1.0) / a0;
+        highPass.a2 = (1.0 - K / Q + K * K) / a0;
+    }
+
+    static double runBiquad(const BiquadCoefficients& c, BiquadState& s, double x)
+    {
+        double y = c.b0 * x + c.b1 * s.x1 + c.b2 * s.x2 - c.a1 * s.y1 - c.a2 * s.y2;
+        s.x2 = s.x1;
+        s.x1 = x;
+        s.y2 = s.y1;
+        s.y1 = y;
+        return y;
+    }
+
+    void applyKWeighting(int channel, const float* input, float* output, int numSamples)
+    {
+        BiquadState& shelfState = filterStates[(size_t) channel * 2];
+        BiquadState& highPassState = filterStates[(size_t) channel * 2 + 1];
+
+        for (int i = 0; i < numSamples; ++i)
+            output[i] = (float) runBiquad(highPass, highPassState, runBiquad(shelf, shelfState, input[i]));
+    }
+
+    // Closes one 100 ms step, updates momentary / short-term and the gating histograms
+    void finishSubBlock()
+    {
+        double weighted = 0.0;
+        for (int ch = 0; ch < numChannels; ++ch)
+        {
+            weighted += channelWeights[(size_t) ch] * subBlockEnergy[(size_t) ch] / subBlockLength;
+            subBlockEnergy[(size_t) ch] = 0.0;
+        }
+
+        recentSubBlocks[(size_t) (numSubBlocks % recentSubBlocks.size())] = weighted;
+        ++numSubBlocks;
+        subBlockPosition = 0;
+
+        if (numSubBlocks >= 4)
+        {
+            double momentary = energyToLufs(averageOfLastSubBlocks(4)); // 400 ms block, 75 % overlap
+            momentaryLive = (float) momentary;
+            maxMomentary = jmax(maxMomentary, momentary);
+
+            if (momentary > absoluteGate)
+                ++gatingHistogram[(size_t) binForLoudness(momentary)];
+
+            integratedLive = (float) getIntegratedLoudness();
+        }
+
+        if (numSubBlocks >= (int) recentSubBlocks.size())
+        {
+            double shortTerm = energyToLufs(averageOfLastSubBlocks((int) recentSubBlocks.size())); // 3 s
+            shortTermLive = (float) shortTerm;
+            maxShortTerm = jmax(maxShortTerm, shortTerm);
+
+            if (shortTerm > absoluteGate)
+                ++shortTermHistogram[(size_t) binForLoudness(shortTerm)];
+        }
+    }
+
+    double averageOfLastSubBlocks(int count) const
+    {
+        double sum = 0.0;
+        for (int i = 1; i <= count; ++i)
+            sum += recentSubBlocks[(size_t) ((numSubBlocks - i) % recentSubBlocks.size())];
+        return sum / count;
+    }
+
+    // Mean energy of all histogram bins at or above the threshold
+    template <size_t size>
+    static double gatedMeanEnergy(const array<int64, size>& histogram, double threshold, int64& count)
+    {
+        double sum = 0.0;
+        count = 0;
+        for (int bin = 0; bin < (int) size; ++bin)
+        {
+            if (histogram[(size_t) bin] > 0 && binCentre(bin) >= threshold)
+            {
+                sum += histogram[(size_t) bin] * lufsToEnergy(binCentre(bin));
+                count += histogram[(size_t) bin];
+            }
+        }
+        return count > 0 ? sum / count : 0.0;
+    }
+
+    // Integrated loudness - absolute gate at -70 LUFS, then relative gate 10 LU below that
+    double getIntegratedLoudness() const
+    {
+        int64 count = 0;
+        double relativeGate = energyToLufs(gatedMeanEnergy(gatingHistogram, absoluteGate, count)) - 10.0;
+        if (count == 0)
+            return -numeric_limits<double>::infinity();
+
+        return energyToLufs(gatedMeanEnergy(gatingHistogram, relativeGate, count));
+    }
+
+    // Loudness range - spread between the 10th and 95th percentile of the gated short-term values (EBU Tech 3342)
+    double getLoudnessRange() const
+    {
+        int64 count = 0;
+        double relativeGate = energyToLufs(gatedMeanEnergy(shortTermHistogram, absoluteGate, count)) - 20.0;
+        if (count == 0)
+            return 0.0;
+
+        gatedMeanEnergy(shortTermHistogram, relativeGate, count);
+        if (count == 0)
+            return 0.0;
+
+        int firstBin = binForLoudness(relativeGate);
+        int64 low = (int64) (count * 0.10), high = (int64) (count * 0.95);
+        int64 seen = 0;
+        double lowLoudness = 0.0, highLoudness = 0.0;
+        bool foundLow = false;
+
+        for (int bin = firstBin; bin < histogramBins; ++bin)
+        {
+            if (binCentre(bin) < relativeGate)
+                continue;
+
+            seen += shortTermHistogram[(size_t) bin];
+
+            if (!foundLow && seen > low)
+            {
+                lowLoudness = binCentre(bin);
+                foundLow = true;
+            }
+
+            if (seen > high || seen == count)
+            {
+                highLoudness = binCentre(bin);
+                break;
+            }
+        }
+
+        return highLoudness - lowLoudness;
+    }
+
+    // Windowed sinc interpolation filter, split into the 4 polyphase branches
+    void makeTruePeakFilter()
+    {
+        const int numTaps = oversampling * tapsPerPhase;
+        const double centre = (numTaps - 1) / 2.0;
+
+        for (int n = 0; n < numTaps; ++n)
+        {
+            double x = (n - centre) / oversampling;
+            double sinc = x == 0.0 ? 1.0 : sin(MathConstants<double>::pi * x) / (MathConstants<double>::pi * x);
+            double window = 0.42 - 0.5 * cos(MathConstants<double>::twoPi * (n + 0.5) / numTaps)
+                + 0.08 * cos(2.0 * MathConstants<double>::twoPi * (n + 0.5) / numTaps); // Blackman
+
+            int phase = n % oversampling;
+            int tap = n / oversampling;
+            phaseTaps[(size_t) phase][(size_t) (tapsPerPhase - 1 - tap)] = (float) (sinc * window); // Reversed so each output is a plain dot product
+        }
+
+        // Every branch should pass DC at unity gain
+        for (auto& taps : phaseTaps)
+        {
+            float sum = 0.0f;
+            for (float tap : taps)
+                sum += tap;
+            for (float& tap : taps)
+                tap /= sum;
+        }
+    }
+
+    void measurePeaks(int channel, const float* input, int numSamples)
+    {
+        // Sample peak
+        auto range = FloatVectorOperations::findMinAndMax(input, numSamples);
+        samplePeak = jmax(samplePeak, -range.getStart(), range.getEnd());
+
+        // Last samples of the previous block followed by this block, so the filter runs over one contiguous array
+        float* extended = peakInput.getWritePointer(0);
+        const int historyLength = tapsPerPhase - 1;
+        FloatVectorOperations::copy(extended, peakHistory.getReadPointer(channel), historyLength);
+        FloatVectorOperations::copy(extended + historyLength, input, numSamples);
+        FloatVectorOperations::copy(peakHistory.getWritePointer(channel), extended + numSamples, historyLength);
+
+        // Fixed length dot products, the compiler turns these into SIMD
+        float* out = oversampled.getWritePointer(0);
+        for (int i = 0; i < numSamples; ++i)
+        {
+            const float* window = extended + i;
+            for (int phase = 0; phase < oversampling; ++phase)
+            {
+                const float* taps = phaseTaps[(size_t) phase].data();
+                float sum = 0.0f;
+                for (int t = 0; t < tapsPerPhase; ++t)
+                    sum += taps[t] * window[t];
+                out[i * oversampling + phase] = sum;
+            }
+        }
+
+        auto oversampledRange = FloatVectorOperations::findMinAndMax(out, numSamples * oversampling);
+        truePeak = jmax(truePeak, samplePeak, jmax(-oversampledRange.getStart(), oversampledRange.getEnd()));
+        truePeakLive = Decibels::gainToDecibels(truePeak, -numeric_limits<float>::infinity());
+    }
+
+    double sampleRate = 48000.0;
+    int numChannels = 0;
+    bool fiveOneLayout = false; // Only when asked for, see setFiveOneLayout()
+
+    // K-weighting
+    BiquadCoefficients shelf, highPass;
+    vector<BiquadState> filterStates; // Two per channel
+    vector<double> channelWeights;
+    AudioBuffer<float> filtered;
+
+    // Gating blocks
+    int subBlockLength = 4800;
+    int subBlockPosition = 0;
+    vector<double> subBlockEnergy; // Sum of squares of the current 100 ms per channel
+    array<double, 30> recentSubBlocks{}; // Last 3 seconds of 100 ms energies
+    int64 numSubBlocks = 0;
+    array<int64, histogramBins> gatingHistogram{}; // 400 ms blocks, for integrated loudness
+    array<int64, histogramBins> shortTermHistogram{}; // 3 s blocks, for loudness range
+    double maxMomentary = 0.0, maxShortTerm = 0.0;
+
+    // True peak
+    array<array<float, tapsPerPhase>, oversampling> phaseTaps{};
+    AudioBuffer<float> peakHistory; // Last few input samples of every channel
+    AudioBuffer<float> peakInput;
+    AudioBuffer<float> oversampled;
+    float truePeak = 0.0f, samplePeak = 0.0f;
+
+    atomic<float> momentaryLive, shortTermLive, integratedLive, truePeakLive;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(LoudnessMeter)
+};
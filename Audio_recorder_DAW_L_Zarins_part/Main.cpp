@@ -1,4 +1,18 @@
 #include <JuceHeader.h>
+#include "CaptureEngine.h"
+#include "HeadlessRecorder.h"
+#include "TapConsumer.h"
+#include "Spectrogram.h"
+#include "WaveformTileCache.h"
+#include "Timeline.h"
+#include "LatencyCalibration.h"
+#include "ArchiveQueue.h"
+#include "AudioBlockCache.h"
+#include "AudioImporter.h"
+#include "SegmentedTake.h"
+#include "ThreadTopology.h"
+#include "MemoryGovernor.h"
+#include "RealtimeCheckerHooks.h" // Only this file, they replace malloc etc for the whole program
 using namespace std;
 using namespace juce;
 
@@ -32,12 +46,15 @@ public:
 
     void paint(Graphics& g) override; // Draws the level meter
     void resized() override; // Positions the buttons
-    void updateRecordingState(bool isRecording); // Enables/disables buttons based on state
+    void updateRecordingState(bool isRecording, bool isFinalizing); // Enables/disables buttons based on state
 
 private:
     AudioRecorderComponent& parentComponent; // Reference to main component to call its methods
     TextButton recordButton; // Red "Record" button
     TextButton stopButton; // Dark red "Stop" button
+    TextButton inputsButton; // Opens the input routing menu
+    TextButton monitorButton; // Direct monitoring of the armed inputs on/off
+    TextButton importButton; // Adds existing audio files as tracks
 };
 
 // Left Side Track Controls - creation for each recording track
@@ -55,6 +72,16 @@ public:
         // Add a solo button and make it visible
         addAndMakeVisible(soloButton);
         soloButton.setButtonText("solo");
+
+        // Switches the display between waveform and spectrogram
+        addAndMakeVisible(spectrogramButton);
+        spectrogramButton.setButtonText("spec");
+        spectrogramButton.setClickingTogglesState(true);
+        spectrogramButton.onClick = [this]
+        {
+            if (onSpectrogramToggled != nullptr)
+                onSpectrogramToggled(spectrogramButton.getToggleState());
+        };
     }
 
     void paint(Graphics& g) override
@@ -68,11 +95,16 @@ public:
         muteButton.setBounds(area.removeFromTop(30)); // Top 30 pixels for mute button
         area.removeFromTop(5); // 5 pixel spacing
         soloButton.setBounds(area.removeFromTop(30)); // Next 30 pixels for solo button
+        area.removeFromTop(5); // 5 pixel spacing
+        spectrogramButton.setBounds(area.removeFromTop(30)); // Last 30 pixels for spectrogram button
     }
 
+    function<void(bool)> onSpectrogramToggled; // Called with the new state of the spec button
+
 private:
     TextButton muteButton; // Mute button (not functional)
     TextButton soloButton; // Solo button (not functional)
+    TextButton spectrogramButton; // Toggles the spectrogram view
 };
 
 // Recording Display Area - shows waveform during and after recording
@@ -82,13 +114,39 @@ public:
     RecordingDisplayPanel(AudioRecorderComponent& owner, int index); // Takes parent and track index
 
     void paint(Graphics& g) override; // Draws waveform and delete button
-    void mouseDown(const MouseEvent& event) override; // Handles clicking the X button
+    void mouseDown(const MouseEvent& event) override; // Handles clicking the X button, or puts the marker cursor where it was clicked
+    bool keyPressed(const KeyPress& key) override; // Right/left arrow jump to the next/previous marker
+    void mouseWheelMove(const MouseEvent& event, const MouseWheelDetails& wheel) override; // Ctrl zooms, shift scrolls the timeline
     void setRecordingIndex(int newIndex) { recordingIndex = newIndex; } // Updates which recording this displays
     int getRecordingIndex() const { return recordingIndex; } // Returns current recording index
 
+    void releaseFile() { sampleReader.reset(); readerFile = File(); } // Stops reading the take's file (it is being replaced)
+    void setShowSpectrogram(bool shouldShow) { showSpectrogram = shouldShow; repaint(); } // Spectrogram instead of waveform
+    void pullSpectrogram(SpectrogramAnalyser& analyser) { spectrogram.pullColumns(analyser); } // Takes the new columns while recording
+    int64 getCacheId() const { return cacheId; } // Key of this display's tiles in the waveform tile cache
+
 private:
+    void drawWaveformTiles(Graphics& g, AudioThumbnail& thumbnail, Rectangle<int> area, double displayLength, int64 liveSamples); // Draws from cached tiles (liveSamples = -1 when not recording)
+    bool drawSamples(Graphics& g, Rectangle<int> area, double displayLength); // Draws real samples when zoomed in close, false if it can't
+    bool readVisibleSamples(int64 firstSample, int64 lastSample); // Reads the visible part of the file
+    bool recordingThis(const CaptureState& state) const; // True while this display's recording is being recorded
+    void drawMarkers(Graphics& g, Rectangle<int> area); // Onsets, level changes and the marker cursor
+    void moveMarkerCursor(int64 position); // Puts the cursor on a sample and scrolls it into view
+
+    static constexpr double sampleLevelThreshold = 256.0; // Below this many samples per pixel the file is read directly
+
     AudioRecorderComponent& parentComponent; // Reference to main component to access recordings
     int recordingIndex; // Which recording in the array this panel displays
+    SpectrogramTiles spectrogram; // Cached spectrogram images of this recording
+    bool showSpectrogram = false;
+    const int64 cacheId; // Never reused, unlike the recording index
+    int64 markerCursor = -1; // Sample the marker navigation starts from (-1 = the start of the take)
+
+    // Samples of the visible range, for zoom levels finer than the thumbnail
+    unique_ptr<AudioFormatReader> sampleReader;
+    File readerFile;
+    AudioBuffer<float> visibleSamples;
+    int64 visibleStart = -1, visibleLength = 0;
 };
 
 // Bottom Controls Panel - the applications footer
@@ -122,6 +180,8 @@ public:
         // Make both sub-components visible
         addAndMakeVisible(controls.get());
         addAndMakeVisible(display.get());
+
+        controls->onSpectrogramToggled = [this](bool on) { display->setShowSpectrogram(on); };
         setSize(1100, 120);
     }
 
@@ -215,7 +275,8 @@ private:
 // Brain of the application that handles all audio recording logic
 //==============================================================================
 class AudioRecorderComponent : public AudioAppComponent, //main audio recording component
-    public Timer // Inherits timer functionality for regular updates
+    public Timer, // Inherits timer functionality for regular updates
+    private ScrollBar::Listener // Horizontal scrolling of the timeline
 {
 public:
     AudioRecorderComponent()
@@ -224,8 +285,6 @@ public:
     {
         setSize(1200, 800);
 
-        formatManager.registerBasicFormats(); // registers the formats
-
         // Add all main panels to the window
         addAndMakeVisible(menuBar);
         addAndMakeVisible(editingTools);
@@ -236,58 +295,73 @@ public:
         viewport.setViewedComponent(recordingsContainer.get(), false); // Set container as scrollable content
         viewport.setScrollBarsShown(true, false); // Show vertical scrollbar, hide horizontal
 
-        setAudioChannels(2, 2); //2input chanels and 2 output chanels as it is stereo not mono
+        // Timeline shared by all tracks - ruler, zoom buttons and its own horizontal scrollbar
+        addAndMakeVisible(timeRuler);
+        addAndMakeVisible(horizontalScrollBar);
+        horizontalScrollBar.setAutoHide(false);
+        horizontalScrollBar.addListener(this);
+
+        addAndMakeVisible(zoomOutButton);
+        addAndMakeVisible(zoomInButton);
+        addAndMakeVisible(zoomFitButton);
+        zoomOutButton.onClick = [this] { timeline.zoomAround(0.5, timeline.getViewStart() + timeline.getVisibleLength() / 2); };
+        zoomInButton.onClick = [this] { timeline.zoomAround(2.0, timeline.getViewStart() + timeline.getVisibleLength() / 2); };
+        zoomFitButton.onClick = [this] { timeline.zoomToFit(); };
+
+        timeline.onChange = [this] { timelineChanged(); };
+
+        captureEngine.setAggregator(&aggregator); // Before the device starts, so it gets prepared with it
+        setAudioChannels(CaptureEngine::maxTracks, 2); // Opens all inputs of the interface (up to 64) so any of them can be routed to a track, 2 outputs
+        captureEngine.getMonitor().setTrackInputs(recordSettings.getTrackInputs());
+
+        // Finished takes become FLAC in the background, but never while recording or when the CPU is busy
+        archiveQueue.shouldYield = [this] { return captureEngine.getIsRecording() || deviceManager.getCpuUsage() > 0.5; };
+        archiveQueue.onTakeArchived = [this](const ArchiveQueue::Result& result) { takeArchived(result); };
+
+        // The caches give memory back when the budget is tight (their normal limits are the most they get)
+        memoryGovernor->addCache(MemoryGovernor::blockCache, [this] { return blockCache->getMemoryUsed(); },
+            [this](size_t bytes) { blockCache->setMemoryBudget(bytes); }, 8 * 1024 * 1024, 256 * 1024 * 1024);
+        memoryGovernor->addCache(MemoryGovernor::waveformTiles, [this] { return waveformTiles.getMemoryUsed(); },
+            [this](size_t bytes) { waveformTiles.setMemoryBudget(bytes); }, 4 * 1024 * 1024, 64 * 1024 * 1024);
         startTimer(40); //updates my user interface
     }
 
     ~AudioRecorderComponent() override //used in video, to override parents function to mine so it would work
     {
+        memoryGovernor->removeCache(MemoryGovernor::blockCache);
+        memoryGovernor->removeCache(MemoryGovernor::waveformTiles);
+
+        if (calibrator != nullptr)
+            deviceManager.removeAudioCallback(calibrator.get());
+
         shutdownAudio();
+        captureEngine.setAggregator(nullptr);
+        aggregator.removeAllDevices();
+
+        importer.cancelAll(); // Stops filling the thumbnails of imports before they're deleted
+        for (auto* thumbnail : recordingThumbnails) // Before the thumbnail cache they load with goes away
+            delete thumbnail;
     }
 
     void prepareToPlay(int samplesPerBlockExpected, double sampleRate) override //shows that it is virtual function because of the override said in another video explainingit why it uses that word
     {
-        this->sampleRate = sampleRate;
+        if (auto* device = deviceManager.getCurrentAudioDevice())
+        {
+            captureEngine.getMonitor().setNumOutputs(device->getActiveOutputChannels().countNumberOfSetBits());
+            aggregator.setFirstInput(device->getActiveInputChannels().countNumberOfSetBits()); // Other interfaces come after these
+        }
+
+        captureEngine.prepareToPlay(samplesPerBlockExpected, sampleRate);
     }
 
     void getNextAudioBlock(const AudioSourceChannelInfo& bufferToFill) override //it has like audio data from Juce itself and it stores the audio i make
     {
-        if (isRecording)
-        {
-            const ScopedLock sl(writerLock); //it is used to lock a thread so i can write only one not multiple
-
-            if (activeWriter.load() != nullptr)
-            {
-                activeWriter.load()->write(bufferToFill.buffer->getArrayOfReadPointers(), //writes audio buffer to file
-                    bufferToFill.numSamples);
-
-                // Add audio data to the thumbnail for waveform visualization
-                if (currentRecordingIndex >= 0 && currentRecordingIndex < recordingThumbnails.size())
-                {
-                    recordingThumbnails[currentRecordingIndex]->addBlock(nextSampleNum, *bufferToFill.buffer,
-                        bufferToFill.startSample, bufferToFill.numSamples);
-                }
-                nextSampleNum += bufferToFill.numSamples;
-                playheadPosition = nextSampleNum / sampleRate; //calculates time
-            }
-
-            auto* channelData = bufferToFill.buffer->getReadPointer(0, bufferToFill.startSample); // calculates audio lever for meter display at the exact moment
-            float sum = 0.0f;
-
-            for (int i = 0; i < bufferToFill.numSamples; ++i)
-            {
-                sum += abs(channelData[i]);
-            }
-
-            currentLevel = sum / bufferToFill.numSamples;
-        }
-
-        bufferToFill.clearActiveBufferRegion(); //clears output buffer
+        captureEngine.getNextAudioBlock(bufferToFill); // Recording, thumbnail and level meter all happen in the engine
     }
     //=================================================================================
     // Klaudijas part - END 
     //=================================================================================
-    void releaseResources() override {} // Called when audio stops - nothing to cleanup
+    void releaseResources() override { captureEngine.releaseResources(); } // Called when audio stops - a take waits for the device to come back
 
     void paint(Graphics& g) override
     {
@@ -303,15 +377,46 @@ public:
         area.removeFromTop(10); // Small white space (10px)
         bottomControls.setBounds(area.removeFromBottom(80)); // Bottom controls (footer - 80px height)
         area.removeFromBottom(10); // Small white space before footer (10px)
+
+        // Ruler and scrollbar line up with the waveform area of the tracks (after the 100px controls and the 4px border)
+        auto rulerRow = area.removeFromTop(24);
+        auto zoomButtons = rulerRow.removeFromLeft(100);
+        zoomOutButton.setBounds(zoomButtons.removeFromLeft(30).reduced(2));
+        zoomInButton.setBounds(zoomButtons.removeFromLeft(30).reduced(2));
+        zoomFitButton.setBounds(zoomButtons.reduced(2));
+        timeRuler.setBounds(rulerRow.getX() + 4, rulerRow.getY(), timelineWidth, rulerRow.getHeight());
+
+        auto scrollRow = area.removeFromBottom(16);
+        horizontalScrollBar.setBounds(scrollRow.getX() + 104, scrollRow.getY(), timelineWidth, scrollRow.getHeight());
+
         viewport.setBounds(area); // Viewport area (remaining space - full width)
+        timeline.setViewWidth(timelineWidth);
     }
 
     void timerCallback() override
     {
-        editingTools.updateRecordingState(isRecording); // Called every 40ms by the timer - used for updating UI
+        ThreadTopology::applyToCurrentThread(ThreadTopology::ui);
+        reportThreadTopology();
+        reportFailedDestinations();
+
+        editingTools.updateRecordingState(captureEngine.getIsRecording(), captureEngine.isFinalizing()); // Called every 40ms by the timer - used for updating UI
 
-        // Repaint all recording displays
         auto& tracks = recordingsContainer->getTracks();
+
+        // New spectrogram columns go into the track that is recording
+        if (captureEngine.getIsRecording() && currentRecordingIndex >= 0 && currentRecordingIndex < tracks.size())
+            tracks[currentRecordingIndex]->getDisplay()->pullSpectrogram(captureEngine.getSpectrogram());
+
+        updateTimeline();
+        updateThumbnailMemory();
+
+        for (auto& violation : RealtimeChecker::takeNewViolations()) // Debug builds only, new places as they are found
+            DBG("Realtime violation in the audio callback: " << violation.what << "\n" << violation.stackTrace);
+
+        if (calibrator != nullptr && (calibrator->isFinished() || Time::getMillisecondCounter() - calibrationStartTime > 5000))
+            finishLatencyCalibration();
+
+        // Repaint all recording displays
         for (int i = 0; i < tracks.size(); i++)
         {
             tracks[i]->getDisplay()->repaint(); // Force redraw of each waveform
@@ -338,114 +443,140 @@ public:
             return; // Exit function - don't start recording
         }
 
-        if (!isRecording)
+        if (!captureEngine.getIsRecording() && calibrator == nullptr) // Not while the latency is being measured
         {
             // Create filename with timestamp
             auto parentDir = File::getSpecialLocation(File::userDocumentsDirectory); //puts the recording in the wanted folder
             File newRecording = parentDir.getChildFile("Recording_" +
                 Time::getCurrentTime().formatted("%Y%m%d_%H%M%S") + ".wav"); // generating name for the recording day and time
 
-            if (newRecording.exists())
-                newRecording.deleteFile();
+            // Create new thumbnail for this recording
+            // (coarser peaks when the memory budget is tight, see MemoryGovernor.h)
+            int peakResolution = memoryGovernor->getPeakResolution(2048);
+            AudioThumbnail* newThumbnail = new AudioThumbnail(peakResolution, captureEngine.getFormatManager(), thumbnailCache);
+            newThumbnail->reset(recordSettings.getNumTracks(), captureEngine.getTakeSampleRate()); // resets thumbnail for new recording
 
-            unique_ptr<FileOutputStream> fileStream(newRecording.createOutputStream());
+            // Shift the take by the measured round trip of this device, if it was calibrated
+            if (auto* device = deviceManager.getCurrentAudioDevice())
+                captureEngine.setLatencyCompensation(jmax(0, LatencySettings::load(device->getName(),
+                    device->getCurrentSampleRate(), device->getCurrentBufferSizeSamples())));
 
-            if (fileStream != nullptr)
+            if (!captureEngine.startTake(newRecording, recordSettings, newThumbnail))
             {
-                WavAudioFormat wavFormat; //as i used wav files to save recordings and over all those files then here is the handling
-
-                unique_ptr<AudioFormatWriter> writer; //wav writere with sterio input 16 bits and no metadata and quality parameter is 0 as it isnt needed for wav files
-                writer.reset(wavFormat.createWriterFor(fileStream.get(),
-                    sampleRate,
-                    2,
-                    16,
-                    {},
-                    0));
-
-                if (writer != nullptr)
-                {
-                    fileStream.release();
-
-                    // Create new thumbnail for this recording
-                    AudioThumbnailCache* newCache = new AudioThumbnailCache(5);
-                    AudioThumbnail* newThumbnail = new AudioThumbnail(2048, formatManager, *newCache);
-                    newThumbnail->reset(2, sampleRate); // resets thumbnail for new recording
-
-                    // Add to separate vectors
-                    recordingCaches.push_back(newCache);
-                    recordingThumbnails.push_back(newThumbnail);
-                    recordingFiles.push_back(newRecording);
-
-                    currentRecordingIndex = recordingThumbnails.size() - 1; // Index of new recording
-
-                    // Create new track with controls and display
-                    RecordingTrack* newTrack = new RecordingTrack(*this, currentRecordingIndex);
-                    recordingsContainer->addRecordingTrack(newTrack); // Add to scrollable container
-
-                    // Reset counters for new recording
-                    nextSampleNum = 0;
-                    playheadPosition = 0.0;
+                DBG("Recording failed: " + captureEngine.getLastError());
+                delete newThumbnail;
+                return;
+            }
 
-                    backgroundThread.startThread(); // Start background thread for file writing
+            // Add to separate vectors
+            recordingThumbnails.push_back(newThumbnail);
+            recordingPeakResolutions.push_back(peakResolution);
+            recordingSampleRates.push_back(captureEngine.getTakeSampleRate());
+            recordingFiles.push_back(captureEngine.getTakeFile()); // First part of a rolling take
+            recordingChannelFiles.push_back(captureEngine.getTakeFiles());
+            recordingAnalysis.push_back(var()); // Filled in when the take stops
+            reportedDestinationFailures = 0;
+            reconnector.rememberDevice(); // If it's unplugged during the take, it's opened again when it comes back
+
+            if (recordSettings.tapName.isNotEmpty() && !captureEngine.isTapOpen()) // Recording anyway, just not shared
+            {
+                AlertWindow::showAsync(MessageBoxOptions()
+                    .withTitle("Tap")
+                    .withMessage(captureEngine.getLastError() + "\nThe take is recorded, other programs don't get it.")
+                    .withButton("OK"),
+                    nullptr);
+            }
 
-                    threadedWriter.reset(new AudioFormatWriter::ThreadedWriter(writer.release(), // create threa writet to not block the audio thread
-                        backgroundThread,
-                        32768)); // Buffer size
+            currentRecordingIndex = recordingThumbnails.size() - 1; // Index of new recording
 
-                    const ScopedLock sl(writerLock);
-                    activeWriter = threadedWriter.get(); //for thread saftey
+            // Create new track with controls and display
+            RecordingTrack* newTrack = new RecordingTrack(*this, currentRecordingIndex);
+            recordingsContainer->addRecordingTrack(newTrack); // Add to scrollable container
 
-                    isRecording = true;
-                    DBG("Recording started!"); //this is when i had problems about my code debug putput
-                }
-            }
+            DBG("Recording started!"); //this is when i had problems about my code debug putput
         }
     }
 
     void stopRecording() // here i stop recording
     {
-        if (isRecording)
+        if (captureEngine.getIsRecording())
         {
-            isRecording = false;
             DBG("Recording stopped!");
 
+            // The files get finished (flushed, headers, fsync, analysis) on the engine's finalizer thread,
+            // the track shows "Finalizing..." until takeFinalized() gets called back here
+            finalizingIndex = currentRecordingIndex;
+            Component::SafePointer<AudioRecorderComponent> safeThis(this);
+            captureEngine.stopTakeAsync([safeThis](const CaptureEngine::FinishedTake& take)
             {
-                const ScopedLock sl(writerLock);
-                activeWriter = nullptr; //signal to audi thread to stop writing
-            }
+                if (safeThis != nullptr)
+                    safeThis->takeFinalized(take);
+            });
+            repaint();
+        }
+    }
 
-            threadedWriter.reset(); //close file and clear the buffer
+    // Message thread - the stopped take is complete on disk
+    void takeFinalized(const CaptureEngine::FinishedTake& take)
+    {
+        int index = finalizingIndex;
+        finalizingIndex = -1;
 
-            // This is help from AI as I had problems with saving or something
-            // Wait a moment for file to be fully written
-            Thread::sleep(100); // Sleep 100ms to ensure file is complete
+        // Keep the loudness results with the recording (they are also saved in its .take.json),
+        // and every file of it - a rolling take only knows all of its parts now
+        if (index >= 0 && index < recordingAnalysis.size())
+        {
+            recordingAnalysis[index] = take.analysis;
+            recordingChannelFiles[index] = take.files;
+        }
 
-            // Load the recording for display
-            if (currentRecordingIndex >= 0 && currentRecordingIndex < recordingFiles.size())
+        // Load the recording for display (a take split into mono files keeps its live thumbnail,
+        // and so does a gated take - its file has the silence left out, the thumbnail still has the real timing)
+        if (index >= 0 && getRecordingFile(index) != File())
+        {
+            File lastFile = recordingFiles[index];
+            if (lastFile.exists()) // Check if file was created successfully
             {
-                File lastFile = recordingFiles[currentRecordingIndex];
-                if (lastFile.exists()) // Check if file was created successfully
-                {
-                    // Load complete file into thumbnail for full waveform display
-                    recordingThumbnails[currentRecordingIndex]->setSource(new FileInputSource(lastFile));
-                    DBG("Recording saved: " + lastFile.getFullPathName());
-                }
+                // Load complete file into thumbnail for full waveform display (decoded through the block cache,
+                // so zooming in on it later doesn't decode it again, and a rolling take is read as one)
+                if (auto reader = createReaderFor(lastFile))
+                    recordingThumbnails[index]->setReader(reader.release(), lastFile.hashCode64());
+
+                auto& tracks = recordingsContainer->getTracks();
+                if (index < tracks.size())
+                    waveformTiles.invalidateTrack(tracks[index]->getDisplay()->getCacheId()); // Audio now comes from the file
+                DBG("Recording saved: " + lastFile.getFullPathName());
             }
+        }
 
-            // Show save dialog
-            showSaveDialog();
+        // Uncompressed takes get archived to FLAC once the queue gets to them
+        if (archiveTakes && captureEngine.getTakeSettings().formatName == "wav")
+            for (auto& takeFile : take.files)
+                archiveQueue.addTake(takeFile);
+
+        // Last spectrogram columns of the take, and a new sample reader (one opened while
+        // it was finalizing still has the length from before)
+        auto& tracks = recordingsContainer->getTracks();
+        if (index >= 0 && index < tracks.size())
+        {
+            tracks[index]->getDisplay()->pullSpectrogram(captureEngine.getSpectrogram());
+            tracks[index]->getDisplay()->releaseFile();
         }
+
+        // Show save dialog
+        showSaveDialog(index);
+        repaint();
     }
     //=================================================================================
     // Klaudijas part - END
     //=================================================================================
 
-    void showSaveDialog()
+    void showSaveDialog(int index)
     {
         String fileName = "unknown";
-        if (currentRecordingIndex >= 0 && currentRecordingIndex < recordingFiles.size())
+        if (index >= 0 && index < recordingFiles.size())
         {
-            fileName = recordingFiles[currentRecordingIndex].getFileName();
+            fileName = recordingFiles[index].getFileName();
         }
 
         // Show popup with filename
@@ -458,31 +589,83 @@ public:
         );
     }
 
+    // Message thread - the FLAC of a take is verified and in place, everything now points at it instead of the WAV
+    void takeArchived(const ArchiveQueue::Result& result)
+    {
+        if (!result.succeeded)
+        {
+            DBG("Archiving " + result.source.getFileName() + " failed: " + result.message);
+            return;
+        }
+
+        auto& tracks = recordingsContainer->getTracks();
+        bool stillUsed = false;
+        for (int i = 0; i < (int) recordingChannelFiles.size(); ++i)
+        {
+            int fileIndex = recordingChannelFiles[i].indexOf(result.source);
+            if (fileIndex < 0)
+                continue;
+
+            stillUsed = true;
+            recordingChannelFiles[i].set(fileIndex, result.archive);
+            if (recordingFiles[i] == result.source)
+                recordingFiles[i] = result.archive;
+            if (i < tracks.size())
+                tracks[i]->getDisplay()->releaseFile();
+        }
+
+        // The recording was deleted while its archive was being finished
+        if (!stillUsed)
+        {
+            result.archive.deleteFile();
+            TakeSidecar::getFileFor(result.archive).deleteFile();
+        }
+
+        blockCache->invalidate(result.source);
+        if (!result.source.deleteFile())
+            DBG("Could not delete " + result.source.getFileName() + " (still in use), the FLAC is next to it");
+        DBG("Archived " + result.source.getFileName() + " " + String(result.sourceBytes) + " -> " + String(result.archiveBytes) + " bytes");
+    }
+
+    // The track the running take goes into
+    bool isRecordingTrack(int index) const { return captureEngine.getIsRecording() && index == currentRecordingIndex; }
+
     void deleteRecording(int index)
     {
         // Check if valid index
         if (index < 0) return;
         auto& tracks = recordingsContainer->getTracks();
         if (index >= tracks.size()) return;
+        if (index == finalizingIndex) return; // Its files are still being finished
+        if (isRecordingTrack(index)) return; // The engine still writes to its thumbnail and files
+        bool imported = index < recordingFiles.size() && importer.isImported(recordingFiles[index]);
 
         // Show confirmation dialog
         AlertWindow::showAsync(
             MessageBoxOptions()
-            .withTitle("Delete Recording")
-            .withMessage("Are you sure you want to delete this recording?")
+            .withTitle(imported ? "Remove Track" : "Delete Recording")
+            .withMessage(imported ? "Remove this track? The file stays where it is." : "Are you sure you want to delete this recording?")
             .withButton("Yes")
             .withButton("No"),
-            [this, index](int result) // Lambda function called when user clicks button
+            [this, index, imported](int result) // Lambda function called when user clicks button
             {
-                if (result == 1) // Yes button = 1
+                // Checked again, a take may have started while the dialog was open
+                if (result == 1 && index != finalizingIndex && !isRecordingTrack(index)) // Yes button = 1
                 {
                     auto& tracks = recordingsContainer->getTracks();
+                    if (imported)
+                        importer.cancel(recordingFiles[index]); // Its thumbnail is still being filled
+                    if (index < finalizingIndex)
+                        --finalizingIndex; // It moves up with the rest
+                    if (captureEngine.getIsRecording() && index < currentRecordingIndex)
+                        --currentRecordingIndex; // So does the take being recorded
 
                     // Manually go through arrays
                     // Delete the visual track component
                     if (index < tracks.size())
                     {
                         RecordingTrack* trackToDelete = tracks[index];
+                        waveformTiles.removeTrack(trackToDelete->getDisplay()->getCacheId()); // Free its cached images
                         recordingsContainer->removeRecordingTrack(trackToDelete); // Remove from container
                         delete trackToDelete; // Delete the object
                     }
@@ -492,25 +675,36 @@ public:
                     {
                         delete recordingThumbnails[index];
                         recordingThumbnails.erase(recordingThumbnails.begin() + index);
+                        recordingPeakResolutions.erase(recordingPeakResolutions.begin() + index);
+                        recordingSampleRates.erase(recordingSampleRates.begin() + index);
                     }
 
-                    // Delete the cache
-                    if (index < recordingCaches.size())
+                    // Delete the actual files from documents folder (an imported file isn't ours, it's only forgotten)
+                    if (index < recordingFiles.size() && imported)
                     {
-                        delete recordingCaches[index];
-                        recordingCaches.erase(recordingCaches.begin() + index);
+                        blockCache->invalidate(recordingFiles[index]); // Closes it
+                        recordingFiles.erase(recordingFiles.begin() + index);
+                        recordingChannelFiles.erase(recordingChannelFiles.begin() + index);
+                        recordingAnalysis.erase(recordingAnalysis.begin() + index);
                     }
-
-                    // Delete the actual file from documents folder
-                    if (index < recordingFiles.size())
+                    else if (index < recordingFiles.size())
                     {
-                        File fileToDelete = recordingFiles[index]; // Get the file reference
-                        if (fileToDelete.exists()) // Check if file exists on disk
+                        TakeSidecar::getFileFor(recordingChannelFiles[index].getFirst()).deleteFile(); // Saved next to the first file
+
+                        for (auto& fileToDelete : recordingChannelFiles[index]) // One file, or one per channel
                         {
-                            fileToDelete.deleteFile(); // Delete the physical file
-                            DBG("File deleted: " + fileToDelete.getFullPathName());
+                            archiveQueue.cancel(fileToDelete); // Not worth archiving any more
+                            blockCache->invalidate(fileToDelete); // Closes it too, so it can be deleted
+
+                            if (fileToDelete.exists()) // Check if file exists on disk
+                            {
+                                fileToDelete.deleteFile(); // Delete the physical file
+                                DBG("File deleted: " + fileToDelete.getFullPathName());
+                            }
                         }
                         recordingFiles.erase(recordingFiles.begin() + index); // Remove from vector
+                        recordingChannelFiles.erase(recordingChannelFiles.begin() + index);
+                        recordingAnalysis.erase(recordingAnalysis.begin() + index);
                     }
 
                     // Go through each remaining track and fix their index
@@ -526,9 +720,383 @@ public:
         );
     }
 
+    // Shows which device inputs get recorded, each ticked input becomes one track
+    void showInputRoutingMenu(Component& target)
+    {
+        StringArray inputNames;
+        BigInteger activeInputs;
+        if (auto* device = deviceManager.getCurrentAudioDevice())
+        {
+            inputNames = device->getInputChannelNames();
+            activeInputs = device->getActiveInputChannels();
+        }
+
+        // Inputs of aggregated interfaces are numbered after the device's
+        if (!aggregator.isEmpty())
+        {
+            inputNames.removeRange(aggregator.getFirstInput(), inputNames.size());
+            activeInputs.setRange(aggregator.getFirstInput(), aggregator.getNumInputs(), true);
+            inputNames.addArray(aggregator.getInputNames());
+        }
+
+        bool recording = captureEngine.getIsRecording(); // Routing is fixed for the length of a take, monitoring isn't
+
+        PopupMenu menu;
+        for (int input = 0; input < inputNames.size() && input < CaptureEngine::maxTracks; ++input)
+        {
+            bool routed = recordSettings.inputRouting.isEmpty() ? input < recordSettings.numChannels
+                                                                : recordSettings.inputRouting.contains(input);
+            menu.addItem(input + 1, inputNames[input], activeInputs[input] && !recording, routed);
+        }
+
+        menu.addSeparator();
+        menu.addItem(1004, "Measure latency (loop output 1 to input " + String(recordSettings.getInputForTrack(0) + 1) + ")...",
+            !recording && calibrator == nullptr);
+        menu.addSeparator();
+        menu.addItem(1001, "Stereo (inputs 1-2)", !recording);
+        menu.addItem(1002, "All inputs", !recording);
+        menu.addItem(1003, "One file per channel", !recording, recordSettings.monoFilePerChannel);
+        menu.addItem(1011, "5.1 layout (loudness of 6 tracks as L R C LFE Ls Rs)", !recording && recordSettings.getNumTracks() == 6,
+            recordSettings.fiveOneLayout);
+        menu.addItem(1006, "Archive finished takes to FLAC", !recording, archiveTakes);
+        menu.addItem(1007, "New file every 10 minutes", !recording, recordSettings.segmentSeconds > 0.0);
+        menu.addItem(1008, "Share live tracks with other programs (tap)", !recording, recordSettings.tapName.isNotEmpty());
+        menu.addItem(1009, "Backup copy in another folder...", !recording, findMirror(false) >= 0);
+        menu.addItem(1010, "Safety copy at -12 dB", !recording, findMirror(true) >= 0);
+        menu.addItem(1005, "Silence gate (only write when there is sound, "
+            + String(recordSettings.gate.thresholdDb, 0) + " dB)", !recording, recordSettings.gate.enabled);
+
+        // Other interfaces of the same type, recorded next to this one with their clock drift corrected
+        PopupMenu aggregateMenu;
+        StringArray otherDevices = getOtherInputDevices();
+        StringArray aggregatedDevices = aggregator.getDeviceNames();
+        for (int index = 0; index < otherDevices.size() && index < 99; ++index)
+            aggregateMenu.addItem(aggregateMenuId + 1 + index, otherDevices[index], !recording, aggregatedDevices.contains(otherDevices[index]));
+        aggregateMenu.addSeparator();
+        aggregateMenu.addItem(aggregateMenuId, "Only this interface", !recording && !aggregator.isEmpty(), aggregator.isEmpty());
+        menu.addSubMenu("Add inputs of another interface", aggregateMenu);
+
+        // Monitoring level of every armed track, can be changed while recording
+        InputMonitor& monitor = captureEngine.getMonitor();
+        PopupMenu monitoringMenu;
+        for (int track = 0; track < recordSettings.getNumTracks(); ++track)
+        {
+            PopupMenu trackMenu;
+            float gainDb = Decibels::gainToDecibels(monitor.getTrackGain(track));
+            trackMenu.addItem(monitorMenuId(track, 0), "Mute", true, monitor.isTrackMuted(track));
+            for (int step = 1; step < 5; ++step)
+                trackMenu.addItem(monitorMenuId(track, step), step == 1 ? String("0 dB") : String(-6 * (step - 1)) + " dB",
+                    true, approximatelyEqual(gainDb, -6.0f * (step - 1)));
+
+            int input = recordSettings.getInputForTrack(track);
+            monitoringMenu.addSubMenu("Track " + String(track + 1) + " (" + inputNames[input] + ")", trackMenu);
+        }
+        menu.addSubMenu("Monitoring", monitoringMenu);
+
+        menu.showMenuAsync(PopupMenu::Options().withTargetComponent(&target),
+            [this, numInputs = jmin(inputNames.size(), CaptureEngine::maxTracks)](int result)
+            {
+                if (result >= monitorMenuId(0, 0))
+                {
+                    int track = (result - monitorMenuId(0, 0)) / 8, step = (result - monitorMenuId(0, 0)) % 8;
+                    if (step == 0)
+                        captureEngine.getMonitor().setTrackMuted(track, !captureEngine.getMonitor().isTrackMuted(track));
+                    else
+                        captureEngine.getMonitor().setTrackGain(track, Decibels::decibelsToGain(-6.0f * (step - 1)));
+                    return;
+                }
+
+                if (result <= 0 || captureEngine.getIsRecording())
+                    return; // Menu dismissed, or routing can't change during a take
+
+                if (result == 1001)
+                {
+                    recordSettings.inputRouting.clear();
+                    recordSettings.numChannels = 2;
+                }
+                else if (result == 1002)
+                {
+                    recordSettings.inputRouting.clear();
+                    recordSettings.numChannels = jmax(1, numInputs);
+                }
+                else if (result == 1003)
+                {
+                    recordSettings.monoFilePerChannel = !recordSettings.monoFilePerChannel;
+                }
+                else if (result == 1011)
+                {
+                    recordSettings.fiveOneLayout = !recordSettings.fiveOneLayout;
+                }
+                else if (result == 1006)
+                {
+                    archiveTakes = !archiveTakes;
+                }
+                else if (result == 1007)
+                {
+                    recordSettings.segmentSeconds = recordSettings.segmentSeconds > 0.0 ? 0.0 : 600.0;
+                }
+                else if (result == 1008)
+                {
+                    recordSettings.tapName = recordSettings.tapName.isEmpty() ? String("AudioRecorder") : String();
+                }
+                else if (result == 1009)
+                {
+                    if (findMirror(false) >= 0)
+                        recordSettings.mirrors.remove(findMirror(false));
+                    else
+                        chooseBackupFolder();
+                }
+                else if (result == 1010)
+                {
+                    if (findMirror(true) >= 0)
+                        recordSettings.mirrors.remove(findMirror(true));
+                    else
+                        recordSettings.mirrors.add(DestinationSettings{ File(), safetyCopyGainDb });
+                }
+                else if (result == 1005)
+                {
+                    recordSettings.gate.enabled = !recordSettings.gate.enabled;
+                }
+                else if (result >= aggregateMenuId && result < aggregateMenuId + 100)
+                {
+                    if (result == aggregateMenuId)
+                        aggregator.removeAllDevices();
+                    else
+                        aggregateDevice(getOtherInputDevices()[result - aggregateMenuId - 1]);
+                }
+                else if (result == 1004)
+                {
+                    startLatencyCalibration();
+                }
+                else
+                {
+                    // Toggle one input, keeping the tracks in input order
+                    Array<int> routing;
+                    for (int track = 0; track < recordSettings.getNumTracks(); ++track)
+                        routing.add(recordSettings.getInputForTrack(track));
+
+                    int input = result - 1;
+                    if (routing.contains(input))
+                        routing.removeFirstMatchingValue(input);
+                    else
+                        routing.addUsingDefaultSort(input);
+
+                    if (!routing.isEmpty()) // At least one track has to be recorded
+                        recordSettings.inputRouting = routing;
+                }
+
+                captureEngine.getMonitor().setTrackInputs(recordSettings.getTrackInputs()); // Monitoring follows the armed inputs
+            });
+    }
+
+    // Plays a sweep out of output 1 and listens for it on the first armed input (needs a cable between them)
+    void startLatencyCalibration()
+    {
+        if (captureEngine.getIsRecording() || calibrator != nullptr)
+            return;
+
+        wasMonitoring = captureEngine.getMonitor().isEnabled();
+        captureEngine.getMonitor().setEnabled(false); // Monitoring would feed the sweep back into itself
+
+        calibrator = make_unique<LatencyCalibrator>(recordSettings.getInputForTrack(0), 0);
+        calibrationStartTime = Time::getMillisecondCounter();
+        deviceManager.addAudioCallback(calibrator.get());
+    }
+
+    void finishLatencyCalibration()
+    {
+        deviceManager.removeAudioCallback(calibrator.get());
+        auto result = calibrator->analyse();
+        calibrator.reset();
+        captureEngine.getMonitor().setEnabled(wasMonitoring);
+
+        String message;
+        auto* device = deviceManager.getCurrentAudioDevice();
+        if (result.succeeded && device != nullptr)
+        {
+            LatencySettings::save(device->getName(), result, device->getCurrentBufferSizeSamples());
+            message = "Round trip: " + String(result.roundTripSamples) + " samples ("
+                + String(result.roundTripSamples * 1000.0 / result.sampleRate, 2) + " ms)\n"
+                + "The driver reports " + String(result.reportedSamples) + " samples.\n"
+                + "New recordings on this device are shifted by the round trip.";
+        }
+        else
+        {
+            message = result.error.isNotEmpty() ? result.error : String("No audio device");
+        }
+
+        AlertWindow::showAsync(MessageBoxOptions()
+            .withTitle("Latency Calibration")
+            .withMessage(message)
+            .withButton("OK"),
+            nullptr);
+    }
+
+    // Peaks of every thumbnail, for the memory budget (a min and a max byte per channel per peak)
+    void updateThumbnailMemory()
+    {
+        size_t bytes = 0;
+        for (size_t i = 0; i < recordingThumbnails.size(); ++i)
+        {
+            auto* thumbnail = recordingThumbnails[i];
+            double numPeaks = thumbnail->getTotalLength() * recordingSampleRates[i] / recordingPeakResolutions[i];
+            bytes += (size_t) numPeaks * (size_t) thumbnail->getNumChannels() * 2;
+        }
+        thumbnailMemory.set(bytes);
+    }
+
+    // Once, a few seconds in (the audio thread has had its go by then) - only if something was refused
+    void reportThreadTopology()
+    {
+        if (topologyReportCountdown <= 0 || --topologyReportCountdown > 0)
+            return;
+
+        if (!ThreadTopology::isConfigured())
+            return;
+
+        StringArray report = ThreadTopology::getReport();
+        for (auto& line : report)
+            DBG("Thread topology: " << line);
+
+        if (ThreadTopology::hasFailures())
+        {
+            AlertWindow::showAsync(MessageBoxOptions()
+                .withTitle("Thread Topology")
+                .withMessage("Some thread priorities or CPUs could not be set, recording works but with less headroom.\n\n"
+                    + report.joinIntoString("\n"))
+                .withButton("OK"),
+                nullptr);
+        }
+    }
+
+    // The backup folder mirror or the safety copy (a mirror next to the take, turned down), -1 if there is none
+    int findMirror(bool safetyCopy) const
+    {
+        for (int index = 0; index < recordSettings.mirrors.size(); ++index)
+            if ((recordSettings.mirrors[index].folder == File()) == safetyCopy)
+                return index;
+        return -1;
+    }
+
+    void chooseBackupFolder()
+    {
+        mirrorChooser = make_unique<FileChooser>("Backup copy of every take in...",
+            File::getSpecialLocation(File::userDocumentsDirectory));
+
+        mirrorChooser->launchAsync(FileBrowserComponent::openMode | FileBrowserComponent::canSelectDirectories,
+            [this](const FileChooser& chooser)
+            {
+                File folder = chooser.getResult();
+                if (folder.isDirectory() && !captureEngine.getIsRecording())
+                    recordSettings.mirrors.add(DestinationSettings{ folder, 0.0f });
+            });
+    }
+
+    // Input devices of the current type, except the one that's open
+    StringArray getOtherInputDevices()
+    {
+        StringArray names;
+        auto* type = deviceManager.getCurrentDeviceTypeObject();
+        auto* device = deviceManager.getCurrentAudioDevice();
+        if (type == nullptr || device == nullptr)
+            return names;
+
+        for (auto& name : type->getDeviceNames(true))
+            if (name != device->getName())
+                names.add(name);
+        return names;
+    }
+
+    // Opens another interface next to the running one, its inputs are added after the ones there are
+    void aggregateDevice(const String& name)
+    {
+        if (aggregator.getDeviceNames().contains(name))
+            return;
+
+        auto* type = deviceManager.getCurrentDeviceTypeObject();
+        if (type == nullptr)
+            return;
+
+        String error;
+        unique_ptr<AudioIODevice> device(type->createDevice(type->hasSeparateInputsAndOutputs() ? String() : name, name));
+        if (!aggregator.addDevice(move(device), error))
+            AlertWindow::showAsync(
+                MessageBoxOptions()
+                .withTitle("Could not add " + name)
+                .withMessage(error)
+                .withButton("OK"),
+                nullptr
+            );
+    }
+
+    // Once per destination that fails during a take - the take goes on in the others
+    void reportFailedDestinations()
+    {
+        int failed = captureEngine.getNumFailedDestinations();
+        if (!captureEngine.getIsRecording() || failed <= reportedDestinationFailures)
+            return;
+
+        reportedDestinationFailures = failed;
+
+        StringArray lines;
+        var destinations = captureEngine.getDestinationReport();
+        for (int index = 0; index < destinations.size(); ++index)
+            if (destinations[index]["status"].toString() == "failed")
+                lines.add(destinations[index]["file"].toString() + "\n    " + destinations[index]["message"].toString());
+
+        AlertWindow::showAsync(MessageBoxOptions()
+            .withTitle("Recording Destination Failed")
+            .withMessage("Recording goes on, but these files are no longer written:\n\n" + lines.joinIntoString("\n"))
+            .withButton("OK"),
+            nullptr);
+    }
+
+    // Menu ids of the monitoring submenu, 8 per track after the routing items
+    static int monitorMenuId(int track, int step) { return 2000 + track * 8 + step; }
+    static constexpr int aggregateMenuId = 1100; // "Only this interface", the devices follow
+
+    void setMonitoring(bool shouldMonitor) { captureEngine.getMonitor().setEnabled(shouldMonitor); }
+    bool getIsMonitoring() { return captureEngine.getMonitor().isEnabled(); }
+    bool isWaitingForDevice() const { return captureEngine.isWaitingForDevice(); } // The take goes on once it's back
+
+    // Input to output latency the performer hears while monitoring, 0 without a device
+    double getMonitorLatencyMs()
+    {
+        auto* device = deviceManager.getCurrentAudioDevice();
+        if (device == nullptr || device->getCurrentSampleRate() <= 0.0)
+            return 0.0;
+
+        return InputMonitor::getRoundTripLatency(*device) * 1000.0 / device->getCurrentSampleRate();
+    }
+
+    WaveformTileCache& getWaveformTiles() { return waveformTiles; }
+    TimelineState& getTimeline() { return timeline; }
+
+    File getRecordingFile(int index) const
+    {
+        // Only takes without gaps and with all channels in one file can be read back directly
+        if (!isPositiveAndBelow(index, (int) recordingFiles.size()))
+            return {};
+
+        var parts = recordingAnalysis[index]["segments"]["parts"]; // A rolling take has one file per part
+        if (recordingChannelFiles[index].size() != (parts.isArray() ? parts.size() : 1) || recordingAnalysis[index].hasProperty("gate"))
+            return {};
+        return recordingFiles[index];
+    }
+
+    unique_ptr<AudioFormatReader> createReaderFor(const File& file)
+    {
+        // An imported WAV or AIFF is read in place, straight from the mapped file
+        if (auto mapped = importer.createMappedReader(file))
+            return mapped;
+
+        // Shares the decoded audio with the thumbnails, the first part of a rolling take reads the whole take
+        return SegmentedTake::createReader(file, [this](const File& part) { return blockCache->createReader(part); });
+    }
+
     // Getter methods - allow other components to access private data
-    bool getIsRecording() const { return isRecording; }
-    float getCurrentLevel() const { return currentLevel; }
+    bool getIsRecording() const { return captureEngine.getIsRecording(); }
+    CaptureState getCaptureState() const { return captureEngine.getState(); } // Message thread only, take one copy per paint
     AudioThumbnail* getThumbnail(int index)
     {
         // Bounds checking
@@ -537,13 +1105,115 @@ public:
         return recordingThumbnails[index];
     }
 
-    int64_t getNextSampleNum() const { return nextSampleNum; }
-    double getPlayheadPosition() const { return playheadPosition; }
-    double getSampleRate() const { return sampleRate; }
+    double getSampleRate(int index) const // Every take keeps its rate if the device changes, an import has the file's
+    {
+        return isPositiveAndBelow(index, (int) recordingSampleRates.size()) ? recordingSampleRates[(size_t) index] : captureEngine.getTakeSampleRate();
+    }
+
+    // Peaks of an imported file come in the background, 1 once they're all there (and for takes)
+    double getImportProgress(int index) const
+    {
+        return isPositiveAndBelow(index, (int) recordingFiles.size()) ? importer.getProgress(recordingFiles[(size_t) index]) : 1.0;
+    }
+
+    int getCurrentRecordingIndex() const { return currentRecordingIndex; } // Message thread only, the audio thread never sees it
+    bool isFinalizing(int index) const { return index >= 0 && index == finalizingIndex; } // Stopped, the files aren't finished yet
+
+    void chooseFilesToImport()
+    {
+        importChooser = make_unique<FileChooser>("Import audio files...",
+            File::getSpecialLocation(File::userMusicDirectory), importer.getWildcard());
+
+        importChooser->launchAsync(FileBrowserComponent::openMode | FileBrowserComponent::canSelectFiles | FileBrowserComponent::canSelectMultipleItems,
+            [this](const FileChooser& chooser)
+            {
+                for (auto& file : chooser.getResults())
+                    if (!importFile(file))
+                        break;
+            });
+    }
+
+    // Message thread - the file becomes a new track straight away, its waveform fills in as its peaks are made
+    bool importFile(const File& file)
+    {
+        if (captureEngine.getIsRecording())
+            return false;
+
+        if (recordingThumbnails.size() >= 6) // Same limit as recording
+        {
+            AlertWindow::showAsync(MessageBoxOptions()
+                .withTitle("Error")
+                .withMessage("Maximum 6 recordings allowed! " + file.getFileName() + " was not imported.")
+                .withButton("OK"),
+                nullptr);
+            return false;
+        }
+
+        int peakResolution = memoryGovernor->getPeakResolution(2048);
+        auto* thumbnail = new AudioThumbnail(peakResolution, captureEngine.getFormatManager(), thumbnailCache);
+
+        AudioImporter::Info info;
+        String error;
+        if (!importer.addFile(file, *thumbnail, peakResolution, info, error))
+        {
+            delete thumbnail;
+            AlertWindow::showAsync(MessageBoxOptions()
+                .withTitle("Import")
+                .withMessage(error)
+                .withButton("OK"),
+                nullptr);
+            return true; // The next file may still work
+        }
+
+        recordingThumbnails.push_back(thumbnail);
+        recordingPeakResolutions.push_back(peakResolution);
+        recordingSampleRates.push_back(info.sampleRate);
+        recordingFiles.push_back(file);
+        recordingChannelFiles.push_back(Array<File>{ file });
+        recordingAnalysis.push_back(var());
 
-    int getCurrentRecordingIndex() const { return currentRecordingIndex; }
+        recordingsContainer->addRecordingTrack(new RecordingTrack(*this, (int) recordingThumbnails.size() - 1));
+        DBG("Imported " + file.getFullPathName() + (info.mapped ? " (mapped)" : " (decoded through the block cache)"));
+        return true;
+    }
+    var getRecordingAnalysis(int index) const { return isPositiveAndBelow(index, (int) recordingAnalysis.size()) ? recordingAnalysis[index] : var(); }
+    const CaptureEngine& getCaptureEngine() const { return captureEngine; }
 
 private:
+    // Session length follows the longest take, and the view follows the playhead while recording
+    void updateTimeline()
+    {
+        double sessionLength = 0.0;
+        for (auto* thumbnail : recordingThumbnails)
+            sessionLength = jmax(sessionLength, thumbnail->getTotalLength());
+
+        CaptureState state = captureEngine.getState();
+        if (state.isRecording)
+            sessionLength = jmax(sessionLength, state.playheadPosition);
+
+        timeline.setSessionLength(sessionLength, captureEngine.getTakeSampleRate());
+
+        double playhead = state.playheadPosition;
+        if (state.isRecording && !timeline.isFittingSession() && playhead > timeline.getViewEnd())
+            timeline.setViewStart(playhead - timeline.getVisibleLength() * 0.1); // Page along with the recording
+    }
+
+    void timelineChanged()
+    {
+        horizontalScrollBar.setRangeLimits(0.0, jmax(timeline.getSessionLength(), timeline.getVisibleLength()), dontSendNotification);
+        horizontalScrollBar.setCurrentRange(timeline.getViewStart(), timeline.getVisibleLength(), dontSendNotification);
+        timeRuler.repaint();
+
+        for (auto* track : recordingsContainer->getTracks())
+            track->getDisplay()->repaint();
+    }
+
+    void scrollBarMoved(ScrollBar*, double newRangeStart) override
+    {
+        timeline.setViewStart(newRangeStart);
+    }
+
+    static constexpr int timelineWidth = 992; // Width of a track's waveform area
     // UI Components
     MenuBar menuBar;
     EditingToolsPanel editingTools;
@@ -551,31 +1221,54 @@ private:
     Viewport viewport;
     unique_ptr<RecordingsContainer> recordingsContainer;
 
+    // What everything holds in memory, and the budget the caches below are kept in
+    SharedResourcePointer<MemoryGovernor> memoryGovernor;
+    MemoryGovernor::Account thumbnailMemory{ MemoryGovernor::thumbnails };
+
+    // Decoded audio and thumbnail data of every recording, declared before the thumbnails that use them
+    SharedResourcePointer<AudioBlockCache> blockCache;
+    AudioThumbnailCache thumbnailCache{ 64 };
+
+    // Timeline (zoom and horizontal scroll of every track)
+    TimelineState timeline;
+    TimeRuler timeRuler{ timeline };
+    ScrollBar horizontalScrollBar{ false };
+    TextButton zoomOutButton{ "-" }, zoomInButton{ "+" }, zoomFitButton{ "Fit" };
+
     // Separate vectors instead of a proper struct
     vector<AudioThumbnail*> recordingThumbnails; // Waveform data for each recording
-    vector<AudioThumbnailCache*> recordingCaches; // Cache for thumbnail generation
+    vector<int> recordingPeakResolutions; // Samples per peak of each thumbnail
+    vector<double> recordingSampleRates; // Sample rate of each recording (an imported file keeps its own)
     vector<File> recordingFiles; // File paths for each recording
+    vector<Array<File>> recordingChannelFiles; // Every file of each recording (more than one with one file per channel)
+    vector<var> recordingAnalysis; // Loudness etc. of each recording once it has stopped
 
     // ==== Klaudijas part - START ====
     // Audio components
-    AudioFormatManager formatManager; //audio file format
-
-    TimeSliceThread backgroundThread{ "Audio Recorder Thread" }; //background thread for file
-    unique_ptr<AudioFormatWriter::ThreadedWriter> threadedWriter; //thread safe file writer
-
-    //thread saftey for writer to access 
-    atomic<AudioFormatWriter::ThreadedWriter*> activeWriter{ nullptr };
-    CriticalSection writerLock;
-
-    //just state variables
-    bool isRecording = false;
-    double sampleRate = 44100.0;
-    float currentLevel = 0.0f;
-    int64_t nextSampleNum = 0;
-    double playheadPosition = 0.0;
+    CaptureEngine captureEngine; // Writer, thumbnail feeding and level meter (shared with headless mode)
+    CaptureSettings recordSettings; // Format and input routing used for the next take
+    WaveformTileCache waveformTiles; // Rendered waveform images of all tracks
+    ArchiveQueue archiveQueue; // Turns finished takes into FLAC in the background (declared after the engine, it asks it)
+    DeviceAggregator aggregator; // Other interfaces recorded next to the open one
+    AudioImporter importer; // Existing files as tracks, read where they are
+    unique_ptr<FileChooser> importChooser;
+    DeviceReconnector reconnector{ deviceManager, [this] { return captureEngine.getIsRecording(); } };
+    bool archiveTakes = true;
     // ==== Klaudijas part - END ====
 
     int currentRecordingIndex = -1; // Index of currently recording track (-1 = not recording)
+    int finalizingIndex = -1; // Stopped take whose files are still being finished (-1 = none)
+
+    // Round trip measurement, only exists while it runs
+    unique_ptr<LatencyCalibrator> calibrator;
+    uint32 calibrationStartTime = 0;
+    int topologyReportCountdown = 75; // Timer ticks, 3 seconds
+
+    // Extra destinations of every take
+    static constexpr float safetyCopyGainDb = -12.0f;
+    unique_ptr<FileChooser> mirrorChooser;
+    int reportedDestinationFailures = 0;
+    bool wasMonitoring = false;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AudioRecorderComponent)
 };
@@ -598,6 +1291,23 @@ EditingToolsPanel::EditingToolsPanel(AudioRecorderComponent& owner)
     stopButton.setColour(TextButton::buttonColourId, Colours::darkred); // Dark red background
     stopButton.onClick = [this] { parentComponent.stopRecording(); }; // Lambda - calls stopRecording when clicked
     stopButton.setEnabled(false); // Start disabled (can't stop if not recording)
+
+    // Setup Inputs button
+    addAndMakeVisible(inputsButton);
+    inputsButton.setButtonText("Inputs");
+    inputsButton.onClick = [this] { parentComponent.showInputRoutingMenu(inputsButton); }; // Pick which inputs get recorded
+
+    // Setup Monitor button
+    addAndMakeVisible(monitorButton);
+    monitorButton.setButtonText("Monitor");
+    monitorButton.setClickingTogglesState(true);
+    monitorButton.setColour(TextButton::buttonOnColourId, Colours::orange);
+    monitorButton.onClick = [this] { parentComponent.setMonitoring(monitorButton.getToggleState()); }; // Hear the armed inputs
+
+    // Setup Import button
+    addAndMakeVisible(importButton);
+    importButton.setButtonText("Import");
+    importButton.onClick = [this] { parentComponent.chooseFilesToImport(); }; // WAV, AIFF, FLAC... as new tracks
 }
 
 void EditingToolsPanel::paint(Graphics& g)
@@ -615,15 +1325,46 @@ void EditingToolsPanel::paint(Graphics& g)
     g.setColour(Colours::black);
     g.fillRect(meterArea);
 
+    CaptureState state = parentComponent.getCaptureState(); // One copy, the meters all show the same block
+
+    // Per track peak meters between the buttons and the level meter, one thin bar per track
+    if (state.isRecording)
+    {
+        auto peaksArea = getLocalBounds().withTrimmedLeft(560).withTrimmedRight(400).reduced(5);
+        int numTracks = state.numTracks;
+        float barWidth = jmin(8.0f, (float) peaksArea.getWidth() / jmax(1, numTracks));
+
+        for (int track = 0; track < numTracks; ++track)
+        {
+            float peak = jlimit(0.0f, 1.0f, state.trackPeaks[(size_t) track]);
+            float barHeight = peak * peaksArea.getHeight();
+
+            g.setColour(peak >= 0.99f ? Colours::red : Colours::green); // Red when clipping
+            g.fillRect(peaksArea.getX() + track * barWidth, peaksArea.getBottom() - barHeight, barWidth - 1.0f, barHeight);
+        }
+    }
+
     // Level meter bar (green, shows current input level)
-    if (parentComponent.getIsRecording()) // Only show when recording
+    if (state.isRecording) // Only show when recording
     {
-        float level = parentComponent.getCurrentLevel(); // Get current audio level
+        float level = state.currentLevel; // Get current audio level
         int barWidth = (int)(level * meterArea.getWidth() * 10.0f); // Scale level to pixels (10x multiplier for visibility)
         barWidth = jmin(barWidth, meterArea.getWidth()); // Clamp to max width
 
         g.setColour(Colours::lime); // Bright green
         g.fillRect(meterArea.withWidth(barWidth)); // Draw bar from left
+
+        // R128 loudness readout on top of the bar
+        const LoudnessMeter& loudness = parentComponent.getCaptureEngine().getLoudnessMeter();
+        auto formatLoudness = [](float value) { return isfinite(value) ? String(value, 1) : String("-inf"); };
+
+        g.setColour(Colours::white);
+        g.setFont(11.0f);
+        g.drawText("M " + formatLoudness(loudness.getMomentaryLoudness())
+            + "  S " + formatLoudness(loudness.getShortTermLoudness())
+            + "  I " + formatLoudness(loudness.getIntegratedLoudnessLive()) + " LUFS"
+            + "  TP " + formatLoudness(loudness.getTruePeakDecibels()) + " dBTP",
+            meterArea.reduced(4, 0), Justification::centredRight);
     }
 }
 
@@ -635,12 +1376,27 @@ void EditingToolsPanel::resized()
     recordButton.setBounds(area.removeFromLeft(100));
     area.removeFromLeft(10);
     stopButton.setBounds(area.removeFromLeft(100));
+    area.removeFromLeft(10);
+    inputsButton.setBounds(area.removeFromLeft(100));
+    area.removeFromLeft(10);
+    monitorButton.setBounds(area.removeFromLeft(100));
+    area.removeFromLeft(10);
+    importButton.setBounds(area.removeFromLeft(100));
 }
 
-void EditingToolsPanel::updateRecordingState(bool isRecording)
+void EditingToolsPanel::updateRecordingState(bool isRecording, bool isFinalizing)
 {
-    recordButton.setEnabled(!isRecording); // Enable Record button only when NOT recording
+    recordButton.setEnabled(!isRecording && !isFinalizing); // Enable Record button only when NOT recording (and the last take is finished)
     stopButton.setEnabled(isRecording); // Enable Stop button only when recording
+    importButton.setEnabled(!isRecording); // Nothing is read from disk while a take is being written
+    String stopText = parentComponent.isWaitingForDevice() ? "Stop (no device)" : "Stop";
+    if (stopButton.getButtonText() != stopText)
+        stopButton.setButtonText(stopText);
+    // Show what the performer hears late by while monitoring
+    String monitorText = parentComponent.getIsMonitoring()
+        ? "Monitor " + String(parentComponent.getMonitorLatencyMs(), 1) + " ms" : String("Monitor");
+    if (monitorButton.getButtonText() != monitorText)
+        monitorButton.setButtonText(monitorText);
     repaint(); // Redraw to update level meter
 }
 
@@ -648,9 +1404,13 @@ void EditingToolsPanel::updateRecordingState(bool isRecording)
 // RecordingDisplayPanel implementation
 // Displays waveform, playhead, and delete button for one recording
 //==============================================================================
+static int64 nextCacheId = 1; // Unique id for every display created
+
 RecordingDisplayPanel::RecordingDisplayPanel(AudioRecorderComponent& owner, int index)
-    : parentComponent(owner), recordingIndex(index) // Store parent reference and index
+    : parentComponent(owner), recordingIndex(index), // Store parent reference and index
+    cacheId(nextCacheId++)
 {
+    setWantsKeyboardFocus(true); // For jumping between markers
 }
 
 void RecordingDisplayPanel::paint(Graphics& g)
@@ -665,37 +1425,81 @@ void RecordingDisplayPanel::paint(Graphics& g)
     if (thumbnail != nullptr) // Check if thumbnail exists
     {
         auto waveformArea = getLocalBounds().reduced(4); // Area inside border
+        CaptureState state = parentComponent.getCaptureState(); // One copy, so the length and the playhead are from the same block
+        bool live = recordingThis(state);
 
         // Check if we should draw waveform
         if (thumbnail->getTotalLength() > 0.0 || // Has recorded data
-            (parentComponent.getIsRecording() && parentComponent.getCurrentRecordingIndex() == recordingIndex)) // OR currently recording this track
+            live) // OR currently recording this track
         {
             double displayLength = thumbnail->getTotalLength(); // Get length in seconds
 
             // If currently recording THIS track, use live length
-            if (parentComponent.getIsRecording() &&
-                parentComponent.getCurrentRecordingIndex() == recordingIndex &&
-                parentComponent.getNextSampleNum() > 0)
+            if (live && state.nextSampleNum > 0)
             {
-                displayLength = parentComponent.getNextSampleNum() / parentComponent.getSampleRate(); // Calculate seconds from samples
+                displayLength = state.playheadPosition; // Seconds recorded so far
             }
 
-            if (displayLength > 0.0) // Only draw if theres something
+            const TimelineState& timeline = parentComponent.getTimeline();
+
+            if (showSpectrogram)
+            {
+                spectrogram.draw(g, waveformArea); // Only draws the cached tiles (always the latest seconds)
+            }
+            else if (displayLength > 0.0 && timeline.getSamplesPerPixel() < sampleLevelThreshold && !live
+                && drawSamples(g, waveformArea, displayLength)) // Zoomed in close - real samples from the file
             {
-                g.setColour(Colours::lightgreen); // Light green waveform
-                thumbnail->drawChannels(g, waveformArea, 0.0, displayLength, 1.0f); // Draw waveform
+            }
+            else if (displayLength > 0.0) // Only draw if theres something (also zoomed in on a take with no single file to read)
+            {
+                drawWaveformTiles(g, *thumbnail, waveformArea, displayLength, live ? state.nextSampleNum : -1); // Light green waveform from cached tiles
             }
         }
 
-        if (parentComponent.getIsRecording() && parentComponent.getCurrentRecordingIndex() == recordingIndex)
+        if (live)
         {
-            float playheadX = waveformArea.getRight() - 2; // Right edge (minus 2px for visibility)
+            float playheadX = jmin(parentComponent.getTimeline().timeToX(state.playheadPosition, waveformArea),
+                (float) waveformArea.getRight() - 2); // Where the recording is on the timeline
 
             g.setColour(Colours::red); // Red playhead line
             g.drawLine(playheadX, waveformArea.getY(),
                 playheadX, waveformArea.getBottom(),
                 2.0f); // Vertical line, 2 pixels thick
         }
+        else
+        {
+            drawMarkers(g, waveformArea);
+        }
+    }
+
+    if (parentComponent.isFinalizing(recordingIndex))
+    {
+        g.setColour(Colours::white);
+        g.setFont(12.0f);
+        g.drawText("Finalizing...", getLocalBounds().reduced(8, 6).removeFromBottom(16), Justification::bottomRight);
+    }
+
+    double importProgress = parentComponent.getImportProgress(recordingIndex);
+    if (importProgress < 1.0)
+    {
+        g.setColour(Colours::white);
+        g.setFont(12.0f);
+        g.drawText("Importing... " + String(roundToInt(importProgress * 100.0)) + "%",
+            getLocalBounds().reduced(8, 6).removeFromBottom(16), Justification::bottomRight);
+    }
+
+    // Loudness of the finished take in the top right corner
+    var loudness = parentComponent.getRecordingAnalysis(recordingIndex)["loudness"];
+    if (loudness.isObject())
+    {
+        auto formatValue = [](const var& value) { return value.isVoid() ? String("-inf") : String((double) value, 1); };
+
+        g.setColour(Colours::white);
+        g.setFont(12.0f);
+        g.drawText("I " + formatValue(loudness["integrated_lufs"]) + " LUFS   LRA "
+            + formatValue(loudness["loudness_range_lu"]) + " LU   TP "
+            + formatValue(loudness["true_peak_dbtp"]) + " dBTP",
+            getLocalBounds().reduced(8, 6).removeFromTop(16), Justification::topRight);
     }
 
     // Draw red X button in lower left 
@@ -708,6 +1512,211 @@ void RecordingDisplayPanel::paint(Graphics& g)
     g.drawText("X", xButton, Justification::centred); // Draw "X" centered
 }
 
+void RecordingDisplayPanel::drawWaveformTiles(Graphics& g, AudioThumbnail& thumbnail, Rectangle<int> area, double displayLength, int64 liveSamples)
+{
+    const TimelineState& timeline = parentComponent.getTimeline();
+    double sampleRate = parentComponent.getSampleRate(recordingIndex);
+    double samplesPerPixel = timeline.getSamplesPerPixel();
+
+    // Tiles come in power of two zoom levels, the nearest one gets stretched to fit
+    int zoomLevel = WaveformTileCache::getZoomLevelFor(samplesPerPixel);
+    double tileSamples = WaveformTileCache::tileWidth * WaveformTileCache::getSamplesPerPixel(zoomLevel);
+    float tileWidthOnScreen = (float) (tileSamples / samplesPerPixel);
+
+    // How much audio exists right now, tiles drawn before it grew get drawn again
+    int64 availableSamples = liveSamples >= 0 ? liveSamples : thumbnail.getNumSamplesFinished();
+
+    Graphics::ScopedSaveState state(g);
+    g.reduceClipRegion(area);
+
+    // Only the tiles inside the visible time range are asked for
+    auto& cache = parentComponent.getWaveformTiles();
+    double visibleEnd = jmin(displayLength, timeline.getViewEnd());
+    int64 firstTile = (int64) (timeline.getViewStart() * sampleRate / tileSamples);
+    int64 lastTile = (int64) (visibleEnd * sampleRate / tileSamples);
+
+    for (int64 tileIndex = firstTile; tileIndex <= lastTile; ++tileIndex)
+    {
+        Image tile = cache.getTile(cacheId, zoomLevel, tileIndex, area.getHeight(),
+            thumbnail, sampleRate, availableSamples, Colours::lightgreen);
+
+        float x = timeline.timeToX(tileIndex * tileSamples / sampleRate, area);
+        g.drawImage(tile, Rectangle<float>(x, (float) area.getY(), tileWidthOnScreen, (float) area.getHeight()),
+            RectanglePlacement::stretchToFit);
+    }
+}
+
+bool RecordingDisplayPanel::drawSamples(Graphics& g, Rectangle<int> area, double displayLength)
+{
+    const TimelineState& timeline = parentComponent.getTimeline();
+    double sampleRate = parentComponent.getSampleRate(recordingIndex);
+
+    // Reads just the visible samples, again only when the view moved
+    int64 firstSample = jmax((int64) 0, (int64) floor(timeline.getViewStart() * sampleRate) - 1);
+    int64 lastSample = (int64) ceil(jmin(displayLength, timeline.getViewEnd()) * sampleRate) + 1;
+    if (!readVisibleSamples(firstSample, lastSample))
+        return false; // Mono files or a gated take - the tiles are drawn instead
+
+    Graphics::ScopedSaveState state(g);
+    g.reduceClipRegion(area);
+    g.setColour(Colours::lightgreen);
+
+    int numChannels = visibleSamples.getNumChannels();
+    float channelHeight = area.getHeight() / (float) numChannels;
+    double samplesPerPixel = timeline.getSamplesPerPixel();
+
+    for (int ch = 0; ch < numChannels; ++ch)
+    {
+        const float* data = visibleSamples.getReadPointer(ch);
+        float centreY = area.getY() + channelHeight * (ch + 0.5f);
+        float halfHeight = channelHeight * 0.5f;
+
+        if (samplesPerPixel >= 1.0)
+        {
+            // More than one sample per pixel - min/max of each pixel column
+            for (int x = 0; x < area.getWidth(); ++x)
+            {
+                int64 start = (int64) (timeline.xToTime((float) (area.getX() + x), area) * sampleRate) - visibleStart;
+                int64 end = (int64) (timeline.xToTime((float) (area.getX() + x + 1), area) * sampleRate) - visibleStart;
+                start = jlimit((int64) 0, visibleLength, start);
+                end = jlimit(start, visibleLength, jmax(end, start + 1));
+
+                if (start >= visibleLength)
+                    break;
+
+                auto range = FloatVectorOperations::findMinAndMax(data + start, (int) (end - start));
+                g.drawVerticalLine(area.getX() + x, centreY - range.getEnd() * halfHeight, centreY - range.getStart() * halfHeight + 1.0f);
+            }
+        }
+        else
+        {
+            // Sample level - a line through the samples, with dots once they are far enough apart
+            Path path;
+            for (int64 i = 0; i < visibleLength; ++i)
+            {
+                float x = timeline.timeToX((visibleStart + i) / sampleRate, area);
+                float y = centreY - data[i] * halfHeight;
+
+                if (i == 0)
+                    path.startNewSubPath(x, y);
+                else
+                    path.lineTo(x, y);
+
+                if (timeline.getPixelsPerSecond() / sampleRate >= 6.0)
+                    g.fillEllipse(x - 2.0f, y - 2.0f, 4.0f, 4.0f);
+            }
+
+            g.strokePath(path, PathStrokeType(1.0f));
+        }
+    }
+}
+
+bool RecordingDisplayPanel::readVisibleSamples(int64 firstSample, int64 lastSample)
+{
+    File file = parentComponent.getRecordingFile(recordingIndex);
+    if (file != readerFile)
+    {
+        sampleReader = parentComponent.createReaderFor(file);
+        readerFile = file;
+        visibleLength = 0;
+    }
+
+    if (sampleReader == nullptr)
+        return false;
+
+    lastSample = jmin(lastSample, sampleReader->lengthInSamples);
+    if (firstSample == visibleStart && lastSample - firstSample == visibleLength)
+        return true; // Same range as last paint
+
+    visibleStart = firstSample;
+    visibleLength = jmax((int64) 0, lastSample - firstSample);
+    visibleSamples.setSize((int) sampleReader->numChannels, (int) jmax((int64) 1, visibleLength));
+    sampleReader->read(&visibleSamples, 0, (int) visibleLength, visibleStart, true, true);
+    return visibleLength > 0;
+}
+
+void RecordingDisplayPanel::mouseWheelMove(const MouseEvent& event, const MouseWheelDetails& wheel)
+{
+    TimelineState& timeline = parentComponent.getTimeline();
+    auto waveformArea = getLocalBounds().reduced(4);
+
+    if (event.mods.isCommandDown()) // Ctrl + wheel zooms around the mouse
+    {
+        timeline.zoomAround(pow(2.0, wheel.deltaY * 2.0), timeline.xToTime(event.position.x, waveformArea));
+    }
+    else if (event.mods.isShiftDown() || wheel.deltaX != 0.0f) // Shift + wheel or sideways wheel scrolls
+    {
+        float delta = wheel.deltaX != 0.0f ? wheel.deltaX : wheel.deltaY;
+        timeline.setViewStart(timeline.getViewStart() - delta * timeline.getVisibleLength() * 0.5);
+    }
+    else
+    {
+        Component::mouseWheelMove(event, wheel); // Normal wheel still scrolls the track list
+    }
+}
+
+void RecordingDisplayPanel::drawMarkers(Graphics& g, Rectangle<int> area)
+{
+    var markers = parentComponent.getRecordingAnalysis(recordingIndex)["markers"];
+    const TimelineState& timeline = parentComponent.getTimeline();
+    double sampleRate = parentComponent.getSampleRate(recordingIndex);
+
+    // Only the visible ones, found by binary search - a long take can have thousands
+    MarkerIndex::forEachInRange(markers, (int64) (timeline.getViewStart() * sampleRate), (int64) (timeline.getViewEnd() * sampleRate) + 1,
+        [&](int64 position, bool isOnset)
+        {
+            float x = timeline.timeToX(position / sampleRate, area);
+            g.setColour(isOnset ? Colours::yellow : Colours::cyan);
+            g.drawVerticalLine(roundToInt(x), (float) area.getY(), (float) area.getY() + (isOnset ? 8.0f : 14.0f)); // Short ticks along the top
+        });
+
+    if (markerCursor >= 0)
+    {
+        g.setColour(Colours::white.withAlpha(0.8f));
+        g.drawVerticalLine(roundToInt(timeline.timeToX(markerCursor / sampleRate, area)), (float) area.getY(), (float) area.getBottom());
+    }
+}
+
+void RecordingDisplayPanel::moveMarkerCursor(int64 position)
+{
+    markerCursor = position;
+
+    TimelineState& timeline = parentComponent.getTimeline();
+    double time = position / parentComponent.getSampleRate(recordingIndex);
+    if (time < timeline.getViewStart() || time > timeline.getViewEnd())
+        timeline.setViewStart(time - timeline.getVisibleLength() * 0.1); // Same margin as paging along with the recording
+
+    repaint();
+}
+
+bool RecordingDisplayPanel::keyPressed(const KeyPress& key)
+{
+    var markers = parentComponent.getRecordingAnalysis(recordingIndex)["markers"];
+
+    if (key.isKeyCode(KeyPress::rightKey) || key == KeyPress(KeyPress::tabKey))
+    {
+        int64 next = MarkerIndex::findNext(markers, markerCursor);
+        if (next >= 0)
+            moveMarkerCursor(next);
+        return true;
+    }
+
+    if (key.isKeyCode(KeyPress::leftKey) || key == KeyPress(KeyPress::tabKey, ModifierKeys::shiftModifier, 0))
+    {
+        int64 previous = MarkerIndex::findPrevious(markers, markerCursor);
+        if (previous >= 0)
+            moveMarkerCursor(previous);
+        return true;
+    }
+
+    return false;
+}
+
+bool RecordingDisplayPanel::recordingThis(const CaptureState& state) const
+{
+    return state.isRecording && parentComponent.getCurrentRecordingIndex() == recordingIndex;
+}
+
 void RecordingDisplayPanel::mouseDown(const MouseEvent& event)
 {
     // Check if clicked on X button
@@ -716,7 +1725,13 @@ void RecordingDisplayPanel::mouseDown(const MouseEvent& event)
     if (xButton.contains(event.getPosition())) // Check if click was inside X button
     {
         parentComponent.deleteRecording(recordingIndex); // Call delete with this recording's index
+        return;
     }
+
+    // Anywhere else puts the marker cursor there, the arrow keys go on from it
+    grabKeyboardFocus();
+    double time = parentComponent.getTimeline().xToTime(event.position.x, getLocalBounds().reduced(4));
+    moveMarkerCursor(jmax((int64) 0, (int64) (time * parentComponent.getSampleRate(recordingIndex))));
 }
 
 //==============================================================================
@@ -765,12 +1780,74 @@ public:
     void initialise(const String& commandLine) override
     {
         // Called when application starts
+        if (HeadlessOptions::isRequested(commandLine))
+        {
+            // Record from the command line without creating any window
+            HeadlessOptions options = HeadlessOptions::fromCommandLine(commandLine);
+            if (options.benchmarkWriters)
+            {
+                HeadlessRecorder::runWriterBenchmark(options);
+                quit();
+                return;
+            }
+
+            if (options.readTap.isNotEmpty()) // Reference reader of another recorder's tap
+            {
+                TapConsumer::Options tapOptions;
+                tapOptions.tapName = options.readTap;
+                tapOptions.outputFile = options.outputFile;
+                tapOptions.durationSeconds = options.durationSeconds;
+                tapOptions.readDelayMs = options.readDelayMs;
+                tapOptions.metricsInterval = options.metricsInterval;
+
+                tapConsumer.reset(new TapConsumer(tapOptions));
+                if (!tapConsumer->start())
+                {
+                    setApplicationReturnValue(1);
+                    quit();
+                }
+                return;
+            }
+
+            headlessRecorder.reset(new HeadlessRecorder(options));
+
+            if (!headlessRecorder->start())
+            {
+                setApplicationReturnValue(1);
+                quit();
+            }
+            return;
+        }
+
+        RealtimeChecker::setEnabled(true); // Does nothing unless it is compiled in (debug builds)
         mainWindow.reset(new MainWindow(getApplicationName())); // Create main window
+
+        String topologyError;
+        if (!ThreadTopology::configureFromCommandLine(commandLine, topologyError))
+        {
+            AlertWindow::showAsync(MessageBoxOptions()
+                .withTitle("Thread Topology")
+                .withMessage(topologyError + "\nThreads keep their normal priorities.")
+                .withButton("OK"),
+                nullptr);
+        }
+
+        String memoryError;
+        if (!MemoryGovernor::configureFromCommandLine(commandLine, memoryError))
+        {
+            AlertWindow::showAsync(MessageBoxOptions()
+                .withTitle("Memory Budget")
+                .withMessage(memoryError + "\nMemory is counted but not limited.")
+                .withButton("OK"),
+                nullptr);
+        }
     }
 
     void shutdown() override
     {
         // Called when application closes
+        headlessRecorder = nullptr; // Stops a headless take if it is still running
+        tapConsumer = nullptr;
         mainWindow = nullptr; // Delete main window
     }
 
@@ -782,6 +1859,8 @@ public:
 
 private:
     unique_ptr<MainWindow> mainWindow; // Smart pointer owns the window
+    unique_ptr<HeadlessRecorder> headlessRecorder; // Only used with --headless
+    unique_ptr<TapConsumer> tapConsumer; // Only used with --headless --read-tap
 };
 
 //==============================================================================
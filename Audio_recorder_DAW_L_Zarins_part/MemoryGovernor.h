@@ -0,0 +1,232 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <vector>
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Memory Governor - what the whole program holds in memory, and a budget
+// Everything that allocates per take or grows with the session keeps an
+// Account of its bytes under a subsystem (writer buffers, pre-roll, peaks and
+// so on). Those are needed for the take, so they're only counted. The caches
+// (decoded audio, waveform tiles) are asked for memory back instead: once a
+// second the governor gives them whatever the counted part leaves of the
+// budget. If even that isn't enough, new thumbnails get coarser peaks, and
+// getPressure() says how far over it is. No budget (the default) = the caches
+// keep their own limits and everything is just counted.
+// Use it through SharedResourcePointer<MemoryGovernor>, like AudioBlockCache.
+//==============================================================================
+class MemoryGovernor : private Timer
+{
+public:
+    enum Subsystem { thumbnails, writerBuffers, preRoll, analysis, aggregation, blockCache, waveformTiles, numSubsystems };
+
+    static const char* getSubsystemName(int subsystem)
+    {
+        static const char* names[] = { "thumbnails", "writer_buffers", "pre_roll", "analysis", "aggregation", "block_cache", "waveform_tiles" };
+        return names[subsystem];
+    }
+
+    // 0 = within budget, 1 = the caches were made smaller, 2 = they're at their minimum and peaks are coarser,
+    // 3 = what can't be given back is over the budget on its own
+    enum Pressure { none, cachesShrunk, coarserPeaks, overBudget };
+
+    MemoryGovernor() { startTimer(1000); }
+    ~MemoryGovernor() override { stopTimer(); }
+
+    //==========================================================================
+    // One owner's bytes in a subsystem, set from the owner's thread, gone when the account is deleted
+    class Account
+    {
+    public:
+        explicit Account(Subsystem accountSubsystem) : subsystem(accountSubsystem) {}
+        ~Account() { set(0); }
+
+        void set(size_t bytes)
+        {
+            governor->usage[(size_t) subsystem] += (int64) bytes - (int64) current;
+            current = bytes;
+        }
+
+        size_t get() const { return current; }
+
+    private:
+        SharedResourcePointer<MemoryGovernor> governor;
+        const Subsystem subsystem;
+        size_t current = 0;
+
+        JUCE_DECLARE_NON_COPYABLE(Account)
+    };
+
+    //==========================================================================
+    // Message thread - a cache that can give memory back. getUsed is polled, setBudget is called when its share changes
+    void addCache(Subsystem subsystem, function<size_t()> getUsed, function<void(size_t)> setBudget, size_t minBytes, size_t maxBytes)
+    {
+        removeCache(subsystem);
+        caches.push_back({ subsystem, move(getUsed), move(setBudget), minBytes, jmax(minBytes, maxBytes), 0 });
+        rebalance();
+    }
+
+    void removeCache(Subsystem subsystem)
+    {
+        for (auto it = caches.begin(); it != caches.end(); ++it)
+            if (it->subsystem == subsystem)
+            {
+                usage[(size_t) subsystem] = 0;
+                caches.erase(it);
+                return;
+            }
+    }
+
+    // Message thread - everything together (0 = no limit)
+    void setBudget(size_t bytes)
+    {
+        budget = bytes;
+        rebalance();
+    }
+
+    size_t getBudget() const { return budget; }
+
+    // "512M", "2G", "64K" or plain bytes, false if it isn't a size
+    static bool parseSize(const String& text, size_t& bytes)
+    {
+        String trimmed = text.trim().toUpperCase().trimCharactersAtEnd("B");
+        if (trimmed.isEmpty() || !trimmed.containsOnly("0123456789.KMG"))
+            return false;
+
+        double multiplier = trimmed.endsWithChar('G') ? 1024.0 * 1024.0 * 1024.0
+            : trimmed.endsWithChar('M') ? 1024.0 * 1024.0
+            : trimmed.endsWithChar('K') ? 1024.0 : 1.0;
+        bytes = (size_t) (trimmed.getDoubleValue() * multiplier);
+        return true;
+    }
+
+    // --memory-budget, message thread. Returns false (and the error) if it isn't a size
+    static bool configureFromCommandLine(const String& commandLine, String& error)
+    {
+        String text = ArgumentList("AudioRecorder", commandLine).getValueForOption("--memory-budget");
+        if (text.isEmpty())
+            return true;
+
+        size_t bytes = 0;
+        if (!parseSize(text, bytes))
+        {
+            error = "The memory budget has to be a size like 512M or 2G, not " + text;
+            return false;
+        }
+
+        SharedResourcePointer<MemoryGovernor>()->setBudget(bytes);
+        return true;
+    }
+
+    // Any thread
+    size_t getUsage(int subsystem) const { return (size_t) jmax((int64) 0, usage[(size_t) subsystem].load()); }
+
+    size_t getTotalUsage() const
+    {
+        size_t total = 0;
+        for (int subsystem = 0; subsystem < numSubsystems; ++subsystem)
+            total += getUsage(subsystem);
+        return total;
+    }
+
+    Pressure getPressure() const { return pressure; }
+
+    // Samples per peak for a new thumbnail - the normal resolution, coarser when the budget is tight
+    int getPeakResolution(int normalResolution) const
+    {
+        return normalResolution << jmax(0, (int) pressure - (int) cachesShrunk);
+    }
+
+    // Telemetry - "used_mb=41.2 budget_mb=256.0 pressure=0 writer_buffers=..." (the subsystems in bytes)
+    String getSummary() const
+    {
+        String summary = "used_mb=" + String(getTotalUsage() / (1024.0 * 1024.0), 1)
+            + " budget_mb=" + String(budget / (1024.0 * 1024.0), 1)
+            + " pressure=" + String((int) pressure);
+
+        for (int subsystem = 0; subsystem < numSubsystems; ++subsystem)
+            summary << " " << getSubsystemName(subsystem) << "=" << String((int64) getUsage(subsystem));
+        return summary;
+    }
+
+    // The same for a take's sidecar
+    var getReport() const
+    {
+        auto* report = new DynamicObject();
+        report->setProperty("budget_bytes", (int64) budget.load());
+        report->setProperty("used_bytes", (int64) getTotalUsage());
+        report->setProperty("pressure", (int) pressure);
+
+        auto* subsystems = new DynamicObject();
+        for (int subsystem = 0; subsystem < numSubsystems; ++subsystem)
+            subsystems->setProperty(getSubsystemName(subsystem), (int64) getUsage(subsystem));
+        report->setProperty("subsystems", var(subsystems));
+        return var(report);
+    }
+
+private:
+    struct Cache
+    {
+        Subsystem subsystem;
+        function<size_t()> getUsed;
+        function<void(size_t)> setBudget;
+        size_t minBytes, maxBytes;
+        size_t lastBudget;
+    };
+
+    void timerCallback() override { rebalance(); }
+
+    // Message thread - the caches share what the counted subsystems leave of the budget, in proportion to their own limits
+    void rebalance()
+    {
+        size_t fixed = 0, cachesMin = 0, cachesMax = 0;
+        for (int subsystem = 0; subsystem < numSubsystems; ++subsystem)
+            if (!isCache(subsystem))
+                fixed += getUsage(subsystem);
+
+        for (auto& cache : caches)
+        {
+            usage[(size_t) cache.subsystem] = (int64) cache.getUsed();
+            cachesMin += cache.minBytes;
+            cachesMax += cache.maxBytes;
+        }
+
+        size_t room = budget > fixed ? budget - fixed : 0;
+        pressure = budget == 0 || room >= cachesMax ? none
+            : room >= cachesMin ? cachesShrunk
+            : fixed < budget ? coarserPeaks : overBudget;
+
+        for (auto& cache : caches)
+        {
+            size_t share = budget == 0 || cachesMax == 0 ? cache.maxBytes
+                : (size_t) ((double) room * (double) cache.maxBytes / (double) cachesMax);
+            share = jlimit(cache.minBytes, cache.maxBytes, share);
+
+            if (share != cache.lastBudget)
+            {
+                cache.lastBudget = share;
+                cache.setBudget(share); // Evicts straight away if it's over
+            }
+        }
+    }
+
+    bool isCache(int subsystem) const
+    {
+        for (auto& cache : caches)
+            if (cache.subsystem == subsystem)
+                return true;
+        return false;
+    }
+
+    array<atomic<int64>, numSubsystems> usage{};
+    vector<Cache> caches; // Message thread only
+    atomic<size_t> budget{ 0 };
+    atomic<Pressure> pressure{ none };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MemoryGovernor)
+};
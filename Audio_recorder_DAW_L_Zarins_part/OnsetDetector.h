@@ -0,0 +1,256 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <vector>
+#include <functional>
+#include "AnalysisThread.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Onset Detector - finds where things happen in a take while it is recorded
+// Works in 5 ms hops. An onset is a hop whose high frequency energy (energy
+// of the first difference, so hits and plucks stand out more than swells)
+// jumps well above the hops just before it. A level change is when the
+// smoothed level has moved a whole step away from where it was last marked,
+// so it catches a section starting, stopping or getting much louder/quieter.
+// Everything is worked out as the samples come in (it's an analysis stage),
+// so the marker index is complete the moment the take stops.
+//==============================================================================
+class OnsetDetector : public AnalysisStage
+{
+public:
+    String getName() const override { return "markers"; }
+
+    void prepare(double newSampleRate, int newNumChannels) override
+    {
+        sampleRate = newSampleRate;
+        numChannels = jmax(1, newNumChannels);
+        hopLength = jmax(32, roundToInt(sampleRate * hopSeconds));
+        levelSmoothing = 1.0 - exp(-hopSeconds / levelTimeConstant);
+
+        previousSamples.assign((size_t) numChannels, 0.0f);
+        recentFlux.fill(silenceDb);
+        recentIndex = 0;
+        hopPosition = 0;
+        hopStart = 0;
+        transientEnergy = 0.0;
+        levelEnergy = 0.0;
+        smoothedLevel = 0.0;
+        markedLevelDb = silenceDb;
+        lastOnset = -1;
+
+        onsets.clear();
+        levelChanges.clear();
+        levels.clear();
+    }
+
+    void process(const AudioBuffer<float>& block, int numSamples) override
+    {
+        int done = 0;
+        while (done < numSamples)
+        {
+            int num = jmin(numSamples - done, hopLength - hopPosition);
+
+            for (int ch = 0; ch < jmin(numChannels, block.getNumChannels()); ++ch)
+            {
+                const float* data = block.getReadPointer(ch, done);
+                float previous = previousSamples[(size_t) ch];
+                double transient = 0.0, level = 0.0;
+
+                for (int i = 0; i < num; ++i)
+                {
+                    float difference = data[i] - previous;
+                    previous = data[i];
+                    transient += difference * difference;
+                    level += data[i] * data[i];
+                }
+
+                previousSamples[(size_t) ch] = previous;
+                transientEnergy += transient;
+                levelEnergy += level;
+            }
+
+            hopPosition += num;
+            done += num;
+
+            if (hopPosition == hopLength)
+                finishHop();
+        }
+    }
+
+    var getResults() override
+    {
+        auto* results = new DynamicObject();
+        results->setProperty("hop_samples", hopLength);
+        results->setProperty("onsets", toArray(onsets));
+        results->setProperty("level_changes", toArray(levelChanges));
+
+        Array<var> levelsDb;
+        for (float level : levels)
+            levelsDb.add(level);
+        results->setProperty("levels_db", levelsDb);
+
+        return var(results);
+    }
+
+private:
+    static constexpr double hopSeconds = 0.005;
+    static constexpr double levelTimeConstant = 0.3; // Seconds, the smoothed level doesn't follow single hits
+    static constexpr float silenceDb = -100.0f;
+    static constexpr float onsetFloorDb = -60.0f; // Quieter than this is never an onset
+    static constexpr float onsetRiseDb = 9.0f; // Above the average of the hops before it
+    static constexpr double minOnsetGap = 0.06; // Seconds, one hit is one onset
+    static constexpr float levelStepDb = 10.0f;
+    static constexpr size_t maxMarkers = 100000; // Of each kind, a take full of noise still has a small index
+
+    static float toDb(double energy) { return (float) jmax((double) silenceDb, 10.0 * log10(energy + 1.0e-12)); }
+
+    static Array<var> toArray(const vector<int64>& positions)
+    {
+        Array<var> array;
+        array.ensureStorageAllocated((int) positions.size());
+        for (int64 position : positions)
+            array.add(position);
+        return array;
+    }
+
+    void finishHop()
+    {
+        double perSample = 1.0 / (hopLength * numChannels);
+        float fluxDb = toDb(transientEnergy * perSample);
+        smoothedLevel += levelSmoothing * (levelEnergy * perSample - smoothedLevel);
+        float levelDb = toDb(smoothedLevel);
+
+        // Onset - high frequency energy well above the last few hops
+        float background = 0.0f;
+        for (float flux : recentFlux)
+            background += flux;
+        background /= (float) recentFlux.size();
+
+        bool farEnough = lastOnset < 0 || hopStart - lastOnset >= (int64) (minOnsetGap * sampleRate);
+        if (fluxDb > onsetFloorDb && fluxDb - background >= onsetRiseDb
+            && farEnough && onsets.size() < maxMarkers)
+        {
+            onsets.push_back(hopStart);
+            lastOnset = hopStart;
+        }
+
+        recentFlux[recentIndex] = fluxDb;
+        recentIndex = (recentIndex + 1) % recentFlux.size();
+
+        // Level change - a whole step from the last marked level
+        if (abs(levelDb - markedLevelDb) >= levelStepDb && levelChanges.size() < maxMarkers)
+        {
+            levelChanges.push_back(hopStart);
+            levels.push_back(round(levelDb));
+            markedLevelDb = levelDb;
+        }
+
+        hopStart += hopLength;
+        hopPosition = 0;
+        transientEnergy = 0.0;
+        levelEnergy = 0.0;
+    }
+
+    double sampleRate = 44100.0;
+    int numChannels = 1;
+    int hopLength = 220;
+    double levelSmoothing = 0.0;
+
+    vector<float> previousSamples; // Last sample of every channel, for the first difference
+    array<float, 10> recentFlux{}; // Last 50 ms of hops (silence before the take starts)
+    size_t recentIndex = 0;
+    int hopPosition = 0; // Samples into the current hop
+    int64 hopStart = 0; // First sample of the current hop in the take
+    double transientEnergy = 0.0, levelEnergy = 0.0, smoothedLevel = 0.0;
+    float markedLevelDb = silenceDb;
+    int64 lastOnset = -1;
+
+    vector<int64> onsets, levelChanges; // Sample positions, in order
+    vector<float> levels; // dB after each level change
+};
+
+//==============================================================================
+// Marker Index - looks things up in the "markers" section of a take
+// Both lists are sorted, so finding the next or previous event is a binary
+// search in each and the closer of the two wins.
+//==============================================================================
+struct MarkerIndex
+{
+    // First event after the position, or -1 if there is none
+    static int64 findNext(const var& markers, int64 position)
+    {
+        int64 next = -1;
+        for (auto* list : { markers["onsets"].getArray(), markers["level_changes"].getArray() })
+        {
+            if (list == nullptr)
+                continue;
+
+            int index = upperBound(*list, position);
+            if (index < list->size() && (next < 0 || (int64) (*list)[index] < next))
+                next = (int64) (*list)[index];
+        }
+        return next;
+    }
+
+    // Last event before the position, or -1 if there is none
+    static int64 findPrevious(const var& markers, int64 position)
+    {
+        int64 previous = -1;
+        for (auto* list : { markers["onsets"].getArray(), markers["level_changes"].getArray() })
+        {
+            if (list == nullptr)
+                continue;
+
+            int index = lowerBound(*list, position) - 1;
+            if (index >= 0)
+                previous = jmax(previous, (int64) (*list)[index]);
+        }
+        return previous;
+    }
+
+    // Every event from start up to (not including) end, in order per kind
+    static void forEachInRange(const var& markers, int64 start, int64 end, const function<void(int64 position, bool isOnset)>& callback)
+    {
+        for (bool isOnset : { true, false })
+        {
+            if (auto* list = markers[isOnset ? "onsets" : "level_changes"].getArray())
+            {
+                for (int index = lowerBound(*list, start); index < list->size() && (int64) (*list)[index] < end; ++index)
+                    callback((int64) (*list)[index], isOnset);
+            }
+        }
+    }
+
+private:
+    // First element greater than the position
+    static int upperBound(const Array<var>& list, int64 position)
+    {
+        int low = 0, high = list.size();
+        while (low < high)
+        {
+            int middle = (low + high) / 2;
+            if ((int64) list[middle] <= position)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return low;
+    }
+
+    // First element not less than the position
+    static int lowerBound(const Array<var>& list, int64 position)
+    {
+        int low = 0, high = list.size();
+        while (low < high)
+        {
+            int middle = (low + high) / 2;
+            if ((int64) list[middle] < position)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return low;
+    }
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+#include <vector>
+using namespace std;
+using namespace juce;
+
+// Debug builds have the checker compiled in, release builds get empty scopes
+// (build with AUDIO_RECORDER_RT_CHECKS=1 to have it in a release build too)
+#ifndef AUDIO_RECORDER_RT_CHECKS
+ #define AUDIO_RECORDER_RT_CHECKS JUCE_DEBUG
+#endif
+
+#if AUDIO_RECORDER_RT_CHECKS && !JUCE_WINDOWS
+ #include <execinfo.h>
+#endif
+
+#if AUDIO_RECORDER_RT_CHECKS && JUCE_WINDOWS
+extern "C" __declspec(dllimport) unsigned short __stdcall RtlCaptureStackBackTrace(unsigned long, unsigned long, void**, unsigned long*);
+#endif
+
+//==============================================================================
+// Realtime Checker - catches things the audio callback must never do
+// The callback marks its thread with a ScopedRealtime for as long as it runs.
+// The hooks in RealtimeCheckerHooks.h (malloc/free, mutex locks, waits, sleeps
+// and file I/O) call check() first, and anything that happens inside a marked
+// scope is recorded as a violation with the stack it came from. The same
+// place is only recorded once and counted after that, so a violation in every
+// block doesn't flood anything. Nothing is checked until setEnabled(true).
+//==============================================================================
+class RealtimeChecker
+{
+public:
+    struct Violation
+    {
+        String what; // "malloc", "pthread_mutex_lock", "operator new", ...
+        int64 count = 0; // How many times it happened from this place
+        String stackTrace; // Of the first time
+    };
+
+    static constexpr bool isAvailable() { return AUDIO_RECORDER_RT_CHECKS != 0; }
+
+    static void setEnabled(bool shouldBeEnabled) { enabled = shouldBeEnabled && isAvailable(); }
+    static bool isEnabled() { return enabled; }
+
+    // Marks the current thread as real time until it goes out of scope (they can be nested)
+    struct ScopedRealtime
+    {
+        ScopedRealtime() noexcept { ++getThreadState().realtimeDepth; }
+        ~ScopedRealtime() noexcept { --getThreadState().realtimeDepth; }
+    };
+
+    // Lets something known through inside a real time scope, only for things that really can't block
+    struct ScopedAllow
+    {
+        ScopedAllow() noexcept { ++getThreadState().allowDepth; }
+        ~ScopedAllow() noexcept { --getThreadState().allowDepth; }
+    };
+
+    // Called by the hooks before they do their work
+    static void check(const char* what) noexcept
+    {
+       #if AUDIO_RECORDER_RT_CHECKS
+        ThreadState& state = getThreadState();
+        if (state.realtimeDepth <= 0 || state.allowDepth > 0 || state.reporting || !enabled.load(memory_order_relaxed))
+            return;
+
+        state.reporting = true; // Whatever recording it does (allocating, locking) goes straight through
+        record(what);
+        state.reporting = false;
+       #else
+        ignoreUnused(what);
+       #endif
+    }
+
+    // Any thread - every place found so far
+    static vector<Violation> getViolations()
+    {
+        const SpinLock::ScopedLockType sl(getSites().lock);
+        vector<Violation> violations;
+        for (auto& site : getSites().list)
+            violations.push_back({ site.what, site.count, site.stackTrace });
+        return violations;
+    }
+
+    // Any thread - places that weren't handed out by this function before (for logging as they come)
+    static vector<Violation> takeNewViolations()
+    {
+        const SpinLock::ScopedLockType sl(getSites().lock);
+        vector<Violation> violations;
+        for (auto& site : getSites().list)
+        {
+            if (!site.taken)
+                violations.push_back({ site.what, site.count, site.stackTrace });
+            site.taken = true;
+        }
+        return violations;
+    }
+
+    static int64 getNumViolations() { return numViolations; }
+
+    static void clear()
+    {
+        const SpinLock::ScopedLockType sl(getSites().lock);
+        getSites().list.clear();
+        numViolations = 0;
+    }
+
+private:
+    static constexpr int maxFrames = 32;
+
+    struct ThreadState
+    {
+        int realtimeDepth = 0;
+        int allowDepth = 0;
+        bool reporting = false;
+    };
+
+    struct Site
+    {
+        String what;
+        uint64 hash = 0;
+        int64 count = 0;
+        String stackTrace;
+        bool taken = false;
+    };
+
+    struct Sites
+    {
+        SpinLock lock; // A spin lock, so it doesn't go through the hooked mutex functions
+        vector<Site> list;
+    };
+
+    static ThreadState& getThreadState() noexcept
+    {
+        static thread_local ThreadState state; // Constant initialised, so it's safe to use from inside malloc
+        return state;
+    }
+
+    static Sites& getSites()
+    {
+        static Sites sites;
+        return sites;
+    }
+
+   #if AUDIO_RECORDER_RT_CHECKS
+    // Only the raw return addresses are taken every time, the readable stack only for a new place
+    static void record(const char* what)
+    {
+        void* frames[maxFrames];
+       #if JUCE_WINDOWS
+        int numFrames = (int) RtlCaptureStackBackTrace(0, maxFrames, frames, nullptr);
+       #else
+        int numFrames = backtrace(frames, maxFrames);
+       #endif
+
+        uint64 hash = 14695981039346656037ull; // FNV-1a over what and where
+        for (const char* c = what; *c != 0; ++c)
+            hash = (hash ^ (uint64) (uint8) *c) * 1099511628211ull;
+        for (int i = 0; i < numFrames; ++i)
+            hash = (hash ^ (uint64) (pointer_sized_uint) frames[i]) * 1099511628211ull;
+
+        ++numViolations;
+        Sites& sites = getSites();
+        const SpinLock::ScopedLockType sl(sites.lock);
+
+        for (auto& site : sites.list)
+        {
+            if (site.hash == hash)
+            {
+                ++site.count;
+                return;
+            }
+        }
+
+        sites.list.push_back({ what, hash, 1, SystemStats::getStackBacktrace(), false });
+    }
+   #endif
+
+    static inline atomic<bool> enabled{ false };
+    static inline atomic<int64> numViolations{ 0 };
+};
@@ -0,0 +1,241 @@
+#pragma once
+
+// The functions here replace the ones from the C/C++ runtime for the whole program,
+// so this file is included once, by Main.cpp only
+
+#include "RealtimeChecker.h"
+
+#if AUDIO_RECORDER_RT_CHECKS
+
+//==============================================================================
+// Realtime Checker Hooks - the functions that report to RealtimeChecker
+// Linux: malloc and friends go to glibc's own __libc_ versions, everything
+// else to the next definition of the symbol (dlsym RTLD_NEXT), so std::mutex,
+// CriticalSection, WaitableEvent, Thread::sleep and file streams are all
+// caught. Other systems: only operator new/delete can be replaced portably,
+// so allocations are caught there and locks aren't.
+//==============================================================================
+#if JUCE_LINUX
+ #include <dlfcn.h>
+ #include <fcntl.h>
+ #include <pthread.h>
+ #include <semaphore.h>
+ #include <stdarg.h>
+ #include <time.h>
+ #include <unistd.h>
+
+extern "C"
+{
+    void* __libc_malloc(size_t) noexcept;
+    void* __libc_calloc(size_t, size_t) noexcept;
+    void* __libc_realloc(void*, size_t) noexcept;
+    void* __libc_memalign(size_t, size_t) noexcept;
+    void __libc_free(void*) noexcept;
+
+    void* malloc(size_t size) noexcept
+    {
+        RealtimeChecker::check("malloc");
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t count, size_t size) noexcept
+    {
+        RealtimeChecker::check("calloc");
+        return __libc_calloc(count, size);
+    }
+
+    void* realloc(void* pointer, size_t size) noexcept
+    {
+        RealtimeChecker::check("realloc");
+        return __libc_realloc(pointer, size);
+    }
+
+    void* memalign(size_t alignment, size_t size) noexcept
+    {
+        RealtimeChecker::check("memalign");
+        return __libc_memalign(alignment, size);
+    }
+
+    void* aligned_alloc(size_t alignment, size_t size) noexcept
+    {
+        RealtimeChecker::check("aligned_alloc");
+        return __libc_memalign(alignment, size);
+    }
+
+    int posix_memalign(void** result, size_t alignment, size_t size) noexcept
+    {
+        RealtimeChecker::check("posix_memalign");
+        if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+            return EINVAL;
+
+        *result = __libc_memalign(alignment, size);
+        return *result != nullptr || size == 0 ? 0 : ENOMEM;
+    }
+
+    void free(void* pointer) noexcept
+    {
+        if (pointer != nullptr)
+            RealtimeChecker::check("free");
+
+        __libc_free(pointer);
+    }
+}
+
+// Finds the real function the first time (dlsym can allocate, which is fine, the check comes first)
+#define REALTIME_CHECKER_NEXT(name) \
+    static auto next = reinterpret_cast<decltype(&name)>(dlsym(RTLD_NEXT, #name))
+
+extern "C"
+{
+    int pthread_mutex_lock(pthread_mutex_t* mutex) noexcept
+    {
+        RealtimeChecker::check("pthread_mutex_lock");
+        REALTIME_CHECKER_NEXT(pthread_mutex_lock);
+        return next(mutex);
+    }
+
+    int pthread_rwlock_rdlock(pthread_rwlock_t* lock) noexcept
+    {
+        RealtimeChecker::check("pthread_rwlock_rdlock");
+        REALTIME_CHECKER_NEXT(pthread_rwlock_rdlock);
+        return next(lock);
+    }
+
+    int pthread_rwlock_wrlock(pthread_rwlock_t* lock) noexcept
+    {
+        RealtimeChecker::check("pthread_rwlock_wrlock");
+        REALTIME_CHECKER_NEXT(pthread_rwlock_wrlock);
+        return next(lock);
+    }
+
+    int pthread_cond_wait(pthread_cond_t* condition, pthread_mutex_t* mutex)
+    {
+        RealtimeChecker::check("pthread_cond_wait");
+        REALTIME_CHECKER_NEXT(pthread_cond_wait);
+        return next(condition, mutex);
+    }
+
+    int pthread_cond_timedwait(pthread_cond_t* condition, pthread_mutex_t* mutex, const struct timespec* time)
+    {
+        RealtimeChecker::check("pthread_cond_timedwait");
+        REALTIME_CHECKER_NEXT(pthread_cond_timedwait);
+        return next(condition, mutex, time);
+    }
+
+    int sem_wait(sem_t* semaphore)
+    {
+        RealtimeChecker::check("sem_wait");
+        REALTIME_CHECKER_NEXT(sem_wait);
+        return next(semaphore);
+    }
+
+    int nanosleep(const struct timespec* time, struct timespec* remaining)
+    {
+        RealtimeChecker::check("nanosleep");
+        REALTIME_CHECKER_NEXT(nanosleep);
+        return next(time, remaining);
+    }
+
+    int clock_nanosleep(clockid_t clock, int flags, const struct timespec* time, struct timespec* remaining)
+    {
+        RealtimeChecker::check("clock_nanosleep");
+        REALTIME_CHECKER_NEXT(clock_nanosleep);
+        return next(clock, flags, time, remaining);
+    }
+
+    int usleep(useconds_t microseconds)
+    {
+        RealtimeChecker::check("usleep");
+        REALTIME_CHECKER_NEXT(usleep);
+        return next(microseconds);
+    }
+
+    int open(const char* path, int flags, ...)
+    {
+        mode_t mode = 0;
+        if ((flags & (O_CREAT | O_TMPFILE)) != 0)
+        {
+            va_list args;
+            va_start(args, flags);
+            mode = (mode_t) va_arg(args, int);
+            va_end(args);
+        }
+
+        RealtimeChecker::check("open");
+        REALTIME_CHECKER_NEXT(open);
+        return next(path, flags, mode);
+    }
+
+    ssize_t read(int file, void* data, size_t size)
+    {
+        RealtimeChecker::check("read");
+        REALTIME_CHECKER_NEXT(read);
+        return next(file, data, size);
+    }
+
+    ssize_t write(int file, const void* data, size_t size)
+    {
+        RealtimeChecker::check("write");
+        REALTIME_CHECKER_NEXT(write);
+        return next(file, data, size);
+    }
+
+    int fsync(int file)
+    {
+        RealtimeChecker::check("fsync");
+        REALTIME_CHECKER_NEXT(fsync);
+        return next(file);
+    }
+}
+
+#undef REALTIME_CHECKER_NEXT
+
+#else
+
+#include <new>
+
+void* operator new(size_t size)
+{
+    RealtimeChecker::check("operator new");
+    if (void* pointer = std::malloc(size == 0 ? 1 : size))
+        return pointer;
+
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    RealtimeChecker::check("operator new");
+   #if JUCE_WINDOWS
+    if (void* pointer = _aligned_malloc(size == 0 ? 1 : size, (size_t) alignment))
+   #else
+    void* pointer = nullptr;
+    if (posix_memalign(&pointer, jmax(sizeof(void*), (size_t) alignment), size == 0 ? 1 : size) == 0)
+   #endif
+        return pointer;
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept
+{
+    if (pointer != nullptr)
+        RealtimeChecker::check("operator delete");
+
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept
+{
+    if (pointer != nullptr)
+        RealtimeChecker::check("operator delete");
+
+   #if JUCE_WINDOWS
+    _aligned_free(pointer);
+   #else
+    std::free(pointer);
+   #endif
+}
+
+#endif
+#endif
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <functional>
+#include "AnalysisThread.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Segmented Take - one long take that was recorded into several files
+// A rolling take switches to the next file on an exact sample, so the parts
+// put back one after another are the take without a gap or an overlap. The
+// "segments" section of the take's .take.json lists every part with where it
+// starts, and createReader() turns that back into one reader for the whole
+// take. Parts are found by name without the extension, so a part that was
+// archived to FLAC in the meantime is still found.
+//==============================================================================
+struct SegmentedTake
+{
+    // Recording_..._part001.wav for segment 0 and so on
+    static File getSegmentFile(const File& file, int segment)
+    {
+        return file.getSiblingFile(file.getFileNameWithoutExtension()
+            + "_part" + String(segment + 1).paddedLeft('0', 3) + file.getFileExtension());
+    }
+
+    // The index for the sidecar - lengths of the parts (in samples) and the file(s) of each one
+    static var makeIndex(const vector<int64>& lengths, const Array<Array<File>>& files, int64 segmentSamples)
+    {
+        auto* index = new DynamicObject();
+        index->setProperty("segment_samples", segmentSamples);
+
+        Array<var> parts;
+        int64 start = 0;
+        for (size_t segment = 0; segment < lengths.size() && (int) segment < files.size(); ++segment)
+        {
+            auto* part = new DynamicObject();
+            part->setProperty("start", start);
+            part->setProperty("length", lengths[segment]);
+
+            Array<var> names;
+            for (auto& file : files[(int) segment])
+                names.add(file.getFileNameWithoutExtension());
+            part->setProperty("files", names);
+
+            parts.add(var(part));
+            start += lengths[segment];
+        }
+
+        index->setProperty("parts", parts);
+        index->setProperty("total_samples", start);
+        return var(index);
+    }
+
+    // The part with this name next to the first one, whatever its extension is now
+    static File findPart(const File& firstFile, const String& name)
+    {
+        for (auto& extension : { firstFile.getFileExtension(), String(".wav"), String(".flac"), String(".aiff") })
+        {
+            File file = firstFile.getSiblingFile(name + extension);
+            if (file.existsAsFile())
+                return file;
+        }
+
+        return {};
+    }
+
+    // One reader for the whole take if the file is the first part of one (with one file per part),
+    // otherwise just the file opened with openFile
+    static unique_ptr<AudioFormatReader> createReader(const File& file, const function<unique_ptr<AudioFormatReader>(const File&)>& openFile);
+};
+
+//==============================================================================
+// Segmented Take Reader - the parts of a rolling take read as one
+//==============================================================================
+class SegmentedTakeReader : public AudioFormatReader
+{
+public:
+    SegmentedTakeReader() : AudioFormatReader(nullptr, "Segmented Take") {}
+
+    // Parts have to be added in order and have the same format
+    bool addPart(unique_ptr<AudioFormatReader> part, int64 length)
+    {
+        if (part == nullptr || (!parts.isEmpty() && (part->numChannels != numChannels || part->sampleRate != sampleRate)))
+            return false;
+
+        if (parts.isEmpty())
+        {
+            sampleRate = part->sampleRate;
+            bitsPerSample = part->bitsPerSample;
+            numChannels = part->numChannels;
+            usesFloatingPointData = true; // Parts can be different formats (WAV and FLAC), so it's always read as float
+        }
+
+        starts.add(lengthInSamples);
+        lengthInSamples += jmin(length, part->lengthInSamples);
+        parts.add(part.release());
+        return true;
+    }
+
+    bool readSamples(int* const* destChannels, int numDestChannels, int startOffsetInDestBuffer,
+        int64 startSampleInFile, int numSamples) override
+    {
+        int done = 0;
+        while (done < numSamples)
+        {
+            int64 position = startSampleInFile + done;
+            int part = findPart(position);
+            int64 partEnd = part + 1 < starts.size() ? starts[part + 1] : lengthInSamples;
+            int num = (int) jmin((int64) (numSamples - done), jmax((int64) 0, partEnd - position));
+
+            if (part < 0 || num <= 0)
+            {
+                for (int ch = 0; ch < numDestChannels; ++ch) // Past the end
+                    if (destChannels[ch] != nullptr)
+                        FloatVectorOperations::clear(reinterpret_cast<float*>(destChannels[ch]) + startOffsetInDestBuffer + done, numSamples - done);
+                break;
+            }
+
+            // Read as float through an AudioBuffer pointing straight at the destination, so the part converts its own format
+            for (int ch = 0; ch < (int) numChannels && ch < maxChannels; ++ch)
+                channelPointers[(size_t) ch] = ch < numDestChannels && destChannels[ch] != nullptr
+                    ? reinterpret_cast<float*>(destChannels[ch]) + startOffsetInDestBuffer + done
+                    : scratch.getWritePointer(ch);
+
+            if (num > scratch.getNumSamples())
+                num = scratch.getNumSamples();
+
+            AudioBuffer<float> destination(channelPointers.data(), jmin((int) numChannels, maxChannels), num);
+            parts[part]->read(&destination, 0, num, position - starts[part], true, true);
+            done += num;
+        }
+
+        return true;
+    }
+
+private:
+    static constexpr int maxChannels = 64;
+
+    int findPart(int64 position) const
+    {
+        for (int part = starts.size(); --part >= 0;)
+            if (position >= starts[part])
+                return position < lengthInSamples ? part : -1;
+        return -1;
+    }
+
+    OwnedArray<AudioFormatReader> parts;
+    Array<int64> starts; // First sample of every part in the take
+    array<float*, maxChannels> channelPointers{};
+    AudioBuffer<float> scratch{ maxChannels, 8192 }; // Where channels nobody asked for go
+};
+
+inline unique_ptr<AudioFormatReader> SegmentedTake::createReader(const File& file, const function<unique_ptr<AudioFormatReader>(const File&)>& openFile)
+{
+    var index = TakeSidecar::load(file)["segments"];
+    if (!index.isObject())
+        return openFile(file);
+
+    auto reader = make_unique<SegmentedTakeReader>();
+    if (auto* parts = index["parts"].getArray())
+    {
+        for (auto& part : *parts)
+        {
+            if (part["files"].size() != 1
+                || !reader->addPart(openFile(findPart(file, part["files"][0].toString())), (int64) part["length"]))
+                return nullptr; // A part is missing, or the parts are one file per channel
+        }
+    }
+
+    return reader;
+}
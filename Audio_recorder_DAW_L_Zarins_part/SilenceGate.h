@@ -0,0 +1,231 @@
+#pragma once
+
+#include <JuceHeader.h>
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Gate Settings - when a gated take writes and when it doesn't
+//==============================================================================
+struct GateSettings
+{
+    bool enabled = false; // false = every sample is written like before
+    float thresholdDb = -45.0f; // Envelope level that opens the gate
+    float attackMs = 2.0f; // How fast the envelope follows a rising signal
+    float holdMs = 1000.0f; // How long the gate stays open after the envelope drops below the threshold
+    float releaseMs = 200.0f; // How fast the envelope falls
+    float preRollMs = 500.0f; // Audio from before the gate opened that is written too, so onsets aren't cut
+};
+
+//==============================================================================
+// Silence Gate - only lets the active parts of a take through to the writer
+// Audio thread: the level is found with one SIMD min/max pass per track for
+// every 64 sample piece, and a one pole envelope (attack / release) follows
+// the loudest track. While the gate is closed the tracks go into a pre-roll
+// ring instead of the file. When it opens the ring is written first.
+// The file ends up holding only the regions, one after another, and the
+// region index says where each of them was in the take (the timing index).
+// Nothing here allocates or locks once startTake() has run.
+//==============================================================================
+class SilenceGate
+{
+public:
+    struct Region
+    {
+        int64 takeStart; // Sample position in the take (as if everything had been written)
+        int64 fileStart; // Sample position in the file
+        int64 length;
+    };
+
+    static constexpr int detectorBlockSize = 64;
+    static constexpr int maxRegions = 65536; // After that the gate stays open, so the index never has to grow
+
+    // Message thread, before the take starts
+    void startTake(const GateSettings& newSettings, double sampleRate, int newNumTracks)
+    {
+        settings = newSettings;
+        numTracks = newNumTracks;
+
+        threshold = Decibels::decibelsToGain(settings.thresholdDb);
+        attackCoeff = getCoefficient(settings.attackMs, sampleRate);
+        releaseCoeff = getCoefficient(settings.releaseMs, sampleRate);
+        holdSamples = (int64) (settings.holdMs * 0.001 * sampleRate);
+
+        preRoll.setSize(numTracks, jmax(1, (int) (settings.preRollMs * 0.001 * sampleRate)));
+        preRoll.clear();
+        preRollPosition = 0;
+        preRollFilled = 0;
+
+        regions.clear();
+        regions.reserve(maxRegions);
+        envelope = 0.0f;
+        holdRemaining = 0;
+        samplesWritten = 0;
+        gateOpen = false;
+    }
+
+    bool isEnabled() const { return settings.enabled; }
+    bool isOpen() const { return gateOpen; } // For meters, read from any thread
+
+    // Audio thread - decides which parts of the block get written, write(channels, numSamples) is called for them
+    template <typename WriteFunction>
+    void process(const AudioBuffer<float>& tracks, int numSamples, int64 takePosition, WriteFunction&& write)
+    {
+        for (int start = 0; start < numSamples; start += detectorBlockSize)
+        {
+            int num = jmin(detectorBlockSize, numSamples - start);
+            updateEnvelope(tracks, start, num);
+
+            if (envelope >= threshold)
+            {
+                holdRemaining = holdSamples;
+
+                if (!gateOpen)
+                    open(takePosition + start, write);
+            }
+            else if (gateOpen && regions.size() < (size_t) maxRegions)
+            {
+                holdRemaining -= num;
+                if (holdRemaining <= 0)
+                    gateOpen = false; // This piece is silence already, it goes to the pre-roll
+            }
+
+            if (gateOpen)
+            {
+                for (int track = 0; track < numTracks; ++track)
+                    channelPointers[(size_t) track] = tracks.getReadPointer(track, start);
+
+                write(channelPointers.data(), num);
+                regions.back().length += num;
+                samplesWritten += num;
+            }
+            else
+            {
+                addToPreRoll(tracks, start, num);
+            }
+        }
+    }
+
+    // Message thread, after the take stopped - settings, regions and how much was left out
+    var getResults(int64 takeLength) const
+    {
+        auto* results = new DynamicObject();
+        results->setProperty("threshold_db", settings.thresholdDb);
+        results->setProperty("attack_ms", settings.attackMs);
+        results->setProperty("hold_ms", settings.holdMs);
+        results->setProperty("release_ms", settings.releaseMs);
+        results->setProperty("pre_roll_ms", settings.preRollMs);
+        results->setProperty("take_samples", takeLength);
+        results->setProperty("written_samples", samplesWritten);
+
+        Array<var> regionList;
+        for (auto& region : regions)
+        {
+            auto* entry = new DynamicObject();
+            entry->setProperty("take_start", region.takeStart);
+            entry->setProperty("file_start", region.fileStart);
+            entry->setProperty("length", region.length);
+            regionList.add(var(entry));
+        }
+
+        results->setProperty("regions", regionList);
+        return var(results);
+    }
+
+    const vector<Region>& getRegions() const { return regions; }
+
+    // The pre-roll ring and the reserved region index, for the memory governor
+    size_t getMemoryUsed() const
+    {
+        return sizeof(float) * (size_t) (preRoll.getNumChannels() * preRoll.getNumSamples()) + sizeof(Region) * regions.capacity();
+    }
+    int64 getSamplesWritten() const { return samplesWritten; }
+
+private:
+    static float getCoefficient(float timeMs, double sampleRate)
+    {
+        double samples = jmax(1.0, timeMs * 0.001 * sampleRate);
+        return (float) (1.0 - exp(-detectorBlockSize / samples)); // Per detector block
+    }
+
+    void updateEnvelope(const AudioBuffer<float>& tracks, int start, int num)
+    {
+        float peak = 0.0f;
+        for (int track = 0; track < numTracks; ++track)
+        {
+            auto range = FloatVectorOperations::findMinAndMax(tracks.getReadPointer(track, start), num);
+            peak = jmax(peak, -range.getStart(), range.getEnd());
+        }
+
+        envelope += (peak - envelope) * (peak > envelope ? attackCoeff : releaseCoeff);
+    }
+
+    // Writes what is in the pre-roll ring and starts a region (or carries on the last one if nothing was left out in between)
+    template <typename WriteFunction>
+    void open(int64 takePosition, WriteFunction&& write)
+    {
+        int64 regionStart = takePosition - preRollFilled;
+        int ringSize = preRoll.getNumSamples();
+        int oldest = (preRollPosition - preRollFilled + ringSize) % ringSize;
+        int firstPart = jmin(preRollFilled, ringSize - oldest);
+
+        writePreRoll(oldest, firstPart, write);
+        writePreRoll(0, preRollFilled - firstPart, write);
+
+        if (!regions.empty() && regions.back().takeStart + regions.back().length == regionStart)
+            regions.back().length += preRollFilled;
+        else
+            regions.push_back({ regionStart, samplesWritten, (int64) preRollFilled });
+
+        samplesWritten += preRollFilled;
+        preRollFilled = 0;
+        gateOpen = true;
+    }
+
+    template <typename WriteFunction>
+    void writePreRoll(int start, int num, WriteFunction&& write)
+    {
+        if (num <= 0)
+            return;
+
+        for (int track = 0; track < numTracks; ++track)
+            channelPointers[(size_t) track] = preRoll.getReadPointer(track, start);
+
+        write(channelPointers.data(), num);
+    }
+
+    void addToPreRoll(const AudioBuffer<float>& tracks, int start, int num)
+    {
+        int ringSize = preRoll.getNumSamples();
+        int done = 0;
+
+        while (done < num)
+        {
+            int part = jmin(num - done, ringSize - preRollPosition);
+            for (int track = 0; track < numTracks; ++track)
+                FloatVectorOperations::copy(preRoll.getWritePointer(track, preRollPosition), tracks.getReadPointer(track, start + done), part);
+
+            preRollPosition = (preRollPosition + part) % ringSize;
+            done += part;
+        }
+
+        preRollFilled = jmin(ringSize, preRollFilled + num);
+    }
+
+    GateSettings settings;
+    int numTracks = 0;
+    float threshold = 0.0f, attackCoeff = 1.0f, releaseCoeff = 1.0f;
+    int64 holdSamples = 0;
+
+    float envelope = 0.0f;
+    int64 holdRemaining = 0;
+    atomic<bool> gateOpen{ false };
+
+    AudioBuffer<float> preRoll; // Ring of the last closed samples of every track
+    int preRollPosition = 0; // Where the next sample goes
+    int preRollFilled = 0; // Samples in the ring that were not written yet
+
+    vector<Region> regions; // Reserved up front, never grows on the audio thread
+    int64 samplesWritten = 0;
+    array<const float*, 64> channelPointers{};
+};
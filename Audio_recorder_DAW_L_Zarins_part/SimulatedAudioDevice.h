@@ -0,0 +1,320 @@
+#pragma once
+
+#include <JuceHeader.h>
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Simulated Audio Device - a fake sound card for testing without hardware
+// Runs its own thread that calls the audio callback at the real sample rate
+// pace. The input is either a test tone ("Simulated Sine"), a WAV file that
+// is played into the inputs ("Simulated File"), or the device's own outputs
+// coming back in a fixed number of samples later ("Simulated Loopback", like
+// a cable from the outputs to the inputs - used to test latency calibration).
+// clockPpm makes its clock a little fast or slow, like a real interface
+// without word clock, to test the drift correction of aggregated devices.
+//==============================================================================
+struct SimulatedDeviceOptions
+{
+    File inputFile; // Used by the "Simulated File" device
+    int numInputChannels = 2;
+    int numOutputChannels = 2;
+    double speed = 1.0; // 1.0 = real time, 2.0 = twice as fast and so on
+    int loopbackLatency = 1000; // Samples from an output to the input it comes back into (at least one buffer)
+    double clockPpm = 0.0; // How much faster than its sample rate the device really runs (negative = slower)
+    bool markSeconds = false; // Test tone gets a click at the start of every real second, to measure alignment
+};
+
+class SimulatedAudioDevice : public AudioIODevice,
+    private Thread
+{
+public:
+    SimulatedAudioDevice(const String& deviceName, const SimulatedDeviceOptions& deviceOptions)
+        : AudioIODevice(deviceName, "Simulated"),
+        Thread("Simulated Audio Device"),
+        options(deviceOptions)
+    {
+    }
+
+    ~SimulatedAudioDevice() override
+    {
+        close();
+    }
+
+    StringArray getOutputChannelNames() override { return makeChannelNames("Output", options.numOutputChannels); }
+    StringArray getInputChannelNames() override { return makeChannelNames("Input", options.numInputChannels); }
+    Array<double> getAvailableSampleRates() override { return { 44100.0, 48000.0, 88200.0, 96000.0 }; }
+    Array<int> getAvailableBufferSizes() override { return { 32, 64, 128, 256, 512, 1024, 2048 }; }
+    int getDefaultBufferSize() override { return 512; }
+
+    String open(const BigInteger& inputChannels, const BigInteger& outputChannels,
+        double newSampleRate, int newBufferSize) override
+    {
+        close();
+
+        activeInputs = inputChannels;
+        activeInputs.setRange(options.numInputChannels, activeInputs.getHighestBit() + 1, false); // Can't use channels we don't have
+        activeOutputs = outputChannels;
+        activeOutputs.setRange(options.numOutputChannels, activeOutputs.getHighestBit() + 1, false);
+
+        sampleRate = newSampleRate > 0.0 ? newSampleRate : 48000.0;
+        bufferSize = newBufferSize > 0 ? newBufferSize : getDefaultBufferSize();
+
+        if (getName() == "Simulated File")
+        {
+            AudioFormatManager formatManager;
+            formatManager.registerBasicFormats();
+            fileReader.reset(formatManager.createReaderFor(options.inputFile));
+
+            if (fileReader == nullptr)
+            {
+                lastError = "Can't read input file " + options.inputFile.getFullPathName();
+                return lastError;
+            }
+        }
+
+        inputBuffer.setSize(jmax(1, activeInputs.countNumberOfSetBits()), bufferSize);
+        outputBuffer.setSize(jmax(1, activeOutputs.countNumberOfSetBits()), bufferSize);
+
+        if (getName() == "Simulated Loopback")
+        {
+            // An output block can come back in the next block at the earliest
+            loopbackLatency = jmax(options.loopbackLatency, bufferSize);
+            loopbackLine.setSize(outputBuffer.getNumChannels(), nextPowerOfTwo(loopbackLatency + 2 * bufferSize));
+            loopbackLine.clear();
+        }
+        samplePosition = 0;
+        deviceOpen = true;
+        lastError = {};
+
+        startThread(Thread::Priority::highest);
+        return {};
+    }
+
+    void close() override
+    {
+        stop();
+        stopThread(2000);
+        fileReader.reset();
+        deviceOpen = false;
+    }
+
+    bool isOpen() override { return deviceOpen; }
+
+    void start(AudioIODeviceCallback* newCallback) override
+    {
+        if (newCallback != nullptr)
+            newCallback->audioDeviceAboutToStart(this);
+
+        const ScopedLock sl(callbackLock);
+        callback = newCallback;
+    }
+
+    void stop() override
+    {
+        AudioIODeviceCallback* oldCallback = nullptr;
+        {
+            const ScopedLock sl(callbackLock);
+            oldCallback = callback;
+            callback = nullptr;
+        }
+
+        if (oldCallback != nullptr)
+            oldCallback->audioDeviceStopped();
+    }
+
+    bool isPlaying() override { return callback != nullptr; }
+    String getLastError() override { return lastError; }
+    int getCurrentBufferSizeSamples() override { return bufferSize; }
+    double getCurrentSampleRate() override { return sampleRate; }
+    int getCurrentBitDepth() override { return 32; }
+    BigInteger getActiveOutputChannels() const override { return activeOutputs; }
+    BigInteger getActiveInputChannels() const override { return activeInputs; }
+    // Like many real drivers the loopback device only reports its buffers, not the whole round trip
+    int getOutputLatencyInSamples() override { return getName() == "Simulated Loopback" ? bufferSize : 0; }
+    int getInputLatencyInSamples() override { return getName() == "Simulated Loopback" ? bufferSize : 0; }
+
+    // Length of the file input, so the headless mode knows when the file has ended
+    int64 getFileLengthInSamples() const { return fileReader != nullptr ? fileReader->lengthInSamples : 0; }
+
+private:
+    static StringArray makeChannelNames(const String& prefix, int numChannels)
+    {
+        StringArray names;
+        for (int i = 0; i < numChannels; ++i)
+            names.add(prefix + " " + String(i + 1));
+        return names;
+    }
+
+    void run() override
+    {
+        double nextBlockTime = Time::getMillisecondCounterHiRes();
+
+        while (!threadShouldExit())
+        {
+            fillInputs();
+
+            {
+                const ScopedLock sl(callbackLock);
+
+                if (callback != nullptr)
+                {
+                    outputBuffer.clear();
+                    callback->audioDeviceIOCallbackWithContext(inputBuffer.getArrayOfReadPointers(),
+                        activeInputs.countNumberOfSetBits(),
+                        outputBuffer.getArrayOfWritePointers(),
+                        activeOutputs.countNumberOfSetBits(),
+                        bufferSize,
+                        {});
+                }
+            }
+
+            if (loopbackLine.getNumSamples() > 0)
+                storeLoopbackOutputs();
+
+            samplePosition += bufferSize;
+
+            // Wait until the next block would be due on a real sound card
+            nextBlockTime += 1000.0 * bufferSize / (getActualSampleRate() * options.speed);
+            double waitMs = nextBlockTime - Time::getMillisecondCounterHiRes();
+
+            if (waitMs > 1.0)
+                wait((int) waitMs);
+            else if (waitMs < -500.0)
+                nextBlockTime = Time::getMillisecondCounterHiRes(); // We fell far behind, don't try to catch up
+        }
+    }
+
+    void fillInputs()
+    {
+        if (fileReader != nullptr)
+        {
+            inputBuffer.clear();
+            fileReader->read(&inputBuffer, 0, bufferSize, samplePosition, true, true); // Past the end this reads silence
+            return;
+        }
+
+        if (loopbackLine.getNumSamples() > 0)
+        {
+            // Output channel ch comes back in on input ch (wrapping around), with a little noise like a real cable
+            int mask = loopbackLine.getNumSamples() - 1;
+            for (int ch = 0; ch < inputBuffer.getNumChannels(); ++ch)
+            {
+                float* data = inputBuffer.getWritePointer(ch);
+                const float* line = loopbackLine.getReadPointer(ch % loopbackLine.getNumChannels());
+
+                for (int i = 0; i < bufferSize; ++i)
+                {
+                    int64 outputPosition = samplePosition + i - loopbackLatency;
+                    float noise = 0.0003f * (random.nextFloat() * 2.0f - 1.0f);
+                    data[i] = (outputPosition >= 0 ? line[outputPosition & mask] : 0.0f) + noise;
+                }
+            }
+            return;
+        }
+
+        // Test tone - a different note on every channel so routing mistakes are easy to hear
+        // (in real time, a fast clock gets more samples of the same tone)
+        double actualRate = getActualSampleRate();
+        for (int ch = 0; ch < inputBuffer.getNumChannels(); ++ch)
+        {
+            float* data = inputBuffer.getWritePointer(ch);
+            double frequency = 220.0 * (ch + 1);
+            double phaseStep = MathConstants<double>::twoPi * frequency / actualRate;
+
+            for (int i = 0; i < bufferSize; ++i)
+                data[i] = 0.25f * (float) sin(phaseStep * (double) (samplePosition + i));
+
+            if (options.markSeconds)
+            {
+                // The sample nearest to every whole second of real time
+                for (int64 second = (int64) ceil((samplePosition - 0.5) / actualRate); ; ++second)
+                {
+                    int64 position = (int64) floor(second * actualRate + 0.5);
+                    if (position >= samplePosition + bufferSize)
+                        break;
+                    if (position >= samplePosition)
+                        data[position - samplePosition] += 0.5f;
+                }
+            }
+        }
+    }
+
+    double getActualSampleRate() const { return sampleRate * (1.0 + options.clockPpm * 1.0e-6); }
+
+    // Keeps the last outputs so they can come back in as inputs
+    void storeLoopbackOutputs()
+    {
+        int mask = loopbackLine.getNumSamples() - 1;
+        for (int ch = 0; ch < loopbackLine.getNumChannels(); ++ch)
+        {
+            float* line = loopbackLine.getWritePointer(ch);
+            const float* data = outputBuffer.getReadPointer(ch);
+
+            for (int i = 0; i < bufferSize; ++i)
+                line[(samplePosition + i) & mask] = data[i];
+        }
+    }
+
+    SimulatedDeviceOptions options;
+    unique_ptr<AudioFormatReader> fileReader; // Only used by the file device
+    AudioBuffer<float> loopbackLine; // Only used by the loopback device, ring of the last outputs
+    int loopbackLatency = 0;
+    Random random;
+
+    CriticalSection callbackLock;
+    AudioIODeviceCallback* callback = nullptr;
+
+    AudioBuffer<float> inputBuffer;
+    AudioBuffer<float> outputBuffer;
+    BigInteger activeInputs, activeOutputs;
+    double sampleRate = 48000.0;
+    int bufferSize = 512;
+    int64 samplePosition = 0;
+    bool deviceOpen = false;
+    String lastError;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SimulatedAudioDevice)
+};
+
+//==============================================================================
+// Device type so the simulated devices can be picked in an AudioDeviceManager
+// like any real driver
+//==============================================================================
+class SimulatedAudioDeviceType : public AudioIODeviceType
+{
+public:
+    explicit SimulatedAudioDeviceType(const SimulatedDeviceOptions& deviceOptions)
+        : AudioIODeviceType("Simulated"), options(deviceOptions)
+    {
+    }
+
+    void scanForDevices() override {}
+
+    StringArray getDeviceNames(bool wantInputNames) const override
+    {
+        return { "Simulated Sine", "Simulated File", "Simulated Loopback" };
+    }
+
+    int getDefaultDeviceIndex(bool forInput) const override { return 0; }
+
+    int getIndexOfDevice(AudioIODevice* device, bool asInput) const override
+    {
+        return device != nullptr ? getDeviceNames(asInput).indexOf(device->getName()) : -1;
+    }
+
+    bool hasSeparateInputsAndOutputs() const override { return false; }
+
+    AudioIODevice* createDevice(const String& outputDeviceName, const String& inputDeviceName) override
+    {
+        String name = outputDeviceName.isNotEmpty() ? outputDeviceName : inputDeviceName;
+
+        if (getDeviceNames(false).contains(name))
+            return new SimulatedAudioDevice(name, options);
+
+        return nullptr;
+    }
+
+private:
+    SimulatedDeviceOptions options;
+};
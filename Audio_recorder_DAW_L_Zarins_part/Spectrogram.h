@@ -0,0 +1,292 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "AnalysisThread.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Simple FFT - radix 2 FFT with its tables worked out once
+// The twiddle factors and bit reversal order are made in the constructor, so
+// every frame after that only does the butterflies.
+//==============================================================================
+class SimpleFFT
+{
+public:
+    explicit SimpleFFT(int fftOrder)
+        : size(1 << fftOrder), twiddles((size_t) size / 2), bitReversed((size_t) size)
+    {
+        for (int i = 0; i < size / 2; ++i)
+            twiddles[(size_t) i] = polar(1.0f, (float) (-MathConstants<double>::twoPi * i / size));
+
+        for (int i = 0; i < size; ++i)
+        {
+            int reversed = 0;
+            for (int bit = 0; bit < fftOrder; ++bit)
+                if ((i >> bit) & 1)
+                    reversed |= 1 << (fftOrder - 1 - bit);
+
+            bitReversed[(size_t) i] = reversed;
+        }
+    }
+
+    int getSize() const { return size; }
+
+    // In place transform of size complex values
+    void perform(complex<float>* data) const
+    {
+        for (int i = 0; i < size; ++i)
+            if (i < bitReversed[(size_t) i])
+                swap(data[i], data[bitReversed[(size_t) i]]);
+
+        for (int length = 2; length <= size; length <<= 1)
+        {
+            int half = length / 2;
+            int twiddleStep = size / length;
+
+            for (int start = 0; start < size; start += length)
+            {
+                for (int k = 0; k < half; ++k)
+                {
+                    complex<float> t = twiddles[(size_t) (k * twiddleStep)] * data[start + k + half];
+                    data[start + k + half] = data[start + k] - t;
+                    data[start + k] += t;
+                }
+            }
+        }
+    }
+
+private:
+    int size;
+    vector<complex<float>> twiddles;
+    vector<int> bitReversed;
+};
+
+//==============================================================================
+// Spectrogram Analyser - turns the take into coloured spectrogram columns
+// Runs as an analysis stage: every hop the channels are mixed to mono,
+// windowed and transformed, and one column of pixels goes into a lock free
+// FIFO for the message thread. All buffers are made once in prepare().
+//==============================================================================
+class SpectrogramAnalyser : public AnalysisStage
+{
+public:
+    static constexpr int fftOrder = 10; // 1024 point FFT
+    static constexpr int fftSize = 1 << fftOrder;
+    static constexpr int hopSize = fftSize / 2; // 50 % overlap
+    static constexpr int numRows = 128; // Pixels per column (log frequency)
+    static constexpr int maxColumns = 512; // FIFO size in columns
+
+    SpectrogramAnalyser()
+        : fft(fftOrder), window((size_t) fftSize), frame((size_t) fftSize), input((size_t) fftSize),
+        columnData((size_t) (maxColumns * numRows))
+    {
+        for (int i = 0; i < fftSize; ++i)
+            window[(size_t) i] = 0.5f - 0.5f * cos(MathConstants<float>::twoPi * i / (fftSize - 1)); // Hann
+
+        // Black - blue - purple - orange - yellow colour map
+        ColourGradient gradient(Colours::black, 0.0f, 0.0f, Colours::yellow, 1.0f, 0.0f, false);
+        gradient.addColour(0.3, Colours::darkblue);
+        gradient.addColour(0.55, Colours::purple);
+        gradient.addColour(0.8, Colours::orange);
+
+        for (int i = 0; i < (int) palette.size(); ++i)
+            palette[(size_t) i] = gradient.getColourAtPosition(i / (double) (palette.size() - 1)).getARGB();
+    }
+
+    String getName() const override { return "spectrogram"; }
+
+    void prepare(double newSampleRate, int newNumChannels) override
+    {
+        sampleRate = newSampleRate;
+        numChannels = newNumChannels;
+        hopPosition = 0;
+        fill(input.begin(), input.end(), 0.0f);
+        columnFifo.reset();
+        droppedColumns = 0;
+
+        // Each row covers a log spaced band from 30 Hz up to Nyquist
+        double lowest = 30.0, highest = sampleRate / 2.0;
+        for (int row = 0; row <= numRows; ++row)
+        {
+            double frequency = lowest * pow(highest / lowest, row / (double) numRows);
+            rowEdges[(size_t) row] = jlimit(1, fftSize / 2, roundToInt(frequency * fftSize / sampleRate));
+        }
+    }
+
+    void process(const AudioBuffer<float>& block, int numSamples) override
+    {
+        float gain = 1.0f / jmax(1, numChannels);
+        int position = 0;
+
+        while (position < numSamples)
+        {
+            int num = jmin(numSamples - position, hopSize - hopPosition);
+
+            // Mono mix into the newest part of the input window
+            float* dest = input.data() + (fftSize - hopSize) + hopPosition;
+            FloatVectorOperations::clear(dest, num);
+            for (int ch = 0; ch < numChannels; ++ch)
+                FloatVectorOperations::addWithMultiply(dest, block.getReadPointer(ch, position), gain, num);
+
+            hopPosition += num;
+            position += num;
+
+            if (hopPosition == hopSize)
+            {
+                hopPosition = 0;
+                makeColumn();
+                memmove(input.data(), input.data() + hopSize, sizeof(float) * (size_t) (fftSize - hopSize)); // Slide the window
+            }
+        }
+    }
+
+    var getResults() override
+    {
+        auto* results = new DynamicObject();
+        results->setProperty("dropped_columns", droppedColumns.load());
+        return var(results);
+    }
+
+    // Message thread - hands every new column (numRows ARGB pixels, lowest frequency first) to the callback
+    template <typename ColumnCallback>
+    int readColumns(ColumnCallback&& callback)
+    {
+        int start1, size1, start2, size2;
+        columnFifo.prepareToRead(columnFifo.getNumReady(), start1, size1, start2, size2);
+
+        for (int i = 0; i < size1; ++i)
+            callback(columnData.data() + (size_t) (start1 + i) * numRows);
+        for (int i = 0; i < size2; ++i)
+            callback(columnData.data() + (size_t) (start2 + i) * numRows);
+
+        columnFifo.finishedRead(size1 + size2);
+        return size1 + size2;
+    }
+
+    double getColumnsPerSecond() const { return sampleRate / hopSize; }
+
+private:
+    void makeColumn()
+    {
+        for (int i = 0; i < fftSize; ++i)
+            frame[(size_t) i] = complex<float>(input[(size_t) i] * window[(size_t) i], 0.0f);
+
+        fft.perform(frame.data());
+
+        int start1, size1, start2, size2;
+        columnFifo.prepareToWrite(1, start1, size1, start2, size2);
+        if (size1 == 0)
+        {
+            ++droppedColumns; // Nobody is reading (the spectrogram is hidden), just skip
+            return;
+        }
+
+        uint32* column = columnData.data() + (size_t) start1 * numRows;
+        const float normalise = 4.0f / fftSize; // Full scale sine is about 0 dB
+
+        for (int row = 0; row < numRows; ++row)
+        {
+            float magnitude = 0.0f;
+            for (int bin = rowEdges[(size_t) row]; bin <= jmax(rowEdges[(size_t) row], rowEdges[(size_t) row + 1] - 1); ++bin)
+                magnitude = jmax(magnitude, abs(frame[(size_t) bin]));
+
+            float decibels = Decibels::gainToDecibels(magnitude * normalise, -100.0f);
+            int index = jlimit(0, (int) palette.size() - 1, (int) ((decibels + 100.0f) / 100.0f * (palette.size() - 1)));
+            column[row] = palette[(size_t) index];
+        }
+
+        columnFifo.finishedWrite(1);
+    }
+
+    SimpleFFT fft; // The FFT plan, reused for every frame
+    vector<float> window;
+    vector<complex<float>> frame;
+    vector<float> input; // Last fftSize samples of the mono mix
+    array<int, numRows + 1> rowEdges{};
+    array<uint32, 256> palette{};
+
+    double sampleRate = 48000.0;
+    int numChannels = 1;
+    int hopPosition = 0; // Samples already in the newest hop
+
+    AbstractFifo columnFifo{ maxColumns };
+    vector<uint32> columnData;
+    atomic<int> droppedColumns{ 0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SpectrogramAnalyser)
+};
+
+//==============================================================================
+// Spectrogram Tiles - a ring of cached images holding the latest columns
+// New columns are written into the newest tile once and never recalculated,
+// painting only draws the tiles. The ring has a fixed size, so a long take
+// costs the same as a short one (only the most recent part is shown).
+//==============================================================================
+class SpectrogramTiles
+{
+public:
+    static constexpr int tileWidth = 64; // Columns per tile
+    static constexpr int numTiles = 16; // About 11 seconds at 48 kHz
+
+    SpectrogramTiles()
+    {
+        for (auto& tile : tiles)
+            tile = Image(Image::ARGB, tileWidth, SpectrogramAnalyser::numRows, true);
+    }
+
+    void clear()
+    {
+        for (auto& tile : tiles)
+            tile.clear(tile.getBounds());
+
+        totalColumns = 0;
+    }
+
+    // Message thread - copies the new columns from the analyser into the tiles
+    bool pullColumns(SpectrogramAnalyser& analyser)
+    {
+        return analyser.readColumns([this](const uint32* column) { addColumn(column); }) > 0;
+    }
+
+    // Draws the ring with the newest column at the right edge of the area
+    void draw(Graphics& g, Rectangle<int> area) const
+    {
+        if (totalColumns == 0 || area.isEmpty())
+            return;
+
+        float columnWidth = area.getWidth() / (float) (tileWidth * numTiles);
+        int64 newestTile = (totalColumns - 1) / tileWidth;
+
+        for (int i = 0; i < numTiles && newestTile - i >= 0; ++i)
+        {
+            int64 tileNumber = newestTile - i;
+            int64 columnsAfterTileStart = totalColumns - tileNumber * tileWidth;
+            float x = area.getRight() - columnsAfterTileStart * columnWidth;
+
+            g.drawImage(tiles[(size_t) (tileNumber % numTiles)],
+                Rectangle<float>(x, (float) area.getY(), tileWidth * columnWidth, (float) area.getHeight()),
+                RectanglePlacement::stretchToFit);
+        }
+    }
+
+private:
+    void addColumn(const uint32* column)
+    {
+        int64 tileNumber = totalColumns / tileWidth;
+        int x = (int) (totalColumns % tileWidth);
+        Image& tile = tiles[(size_t) (tileNumber % numTiles)];
+
+        if (x == 0)
+            tile.clear(tile.getBounds()); // Reusing the oldest tile
+
+        Image::BitmapData bitmap(tile, x, 0, 1, SpectrogramAnalyser::numRows, Image::BitmapData::writeOnly);
+        for (int row = 0; row < SpectrogramAnalyser::numRows; ++row)
+            bitmap.setPixelColour(0, SpectrogramAnalyser::numRows - 1 - row, Colour(column[row])); // Low frequencies at the bottom
+
+        ++totalColumns;
+    }
+
+    array<Image, numTiles> tiles;
+    int64 totalColumns = 0;
+};
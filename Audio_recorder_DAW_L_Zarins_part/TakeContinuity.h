@@ -0,0 +1,256 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <array>
+#include <atomic>
+#include <functional>
+#include "DeviceAggregator.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Take Continuity - a take that outlives its device
+// A USB interface that drops out for a moment, a driver that restarts with
+// another buffer size, or a device that comes back at another sample rate
+// doesn't end the take. The engine keeps the same writers and thumbnail and
+// goes on where it stopped; the classes here are what it needs for that:
+// a converter from the device's new rate to the take's (the file can't
+// change its rate halfway), a log of every interruption for the take's
+// "interruptions" section, and a reconnector that opens the take's device
+// again when it comes back.
+//==============================================================================
+
+//==============================================================================
+// Take Rate Converter - device rate to take rate, with the same windowed sinc
+// the aggregated devices go through. It keeps the last numTaps samples of
+// every track between blocks, so the blocks join without a click.
+//==============================================================================
+class TakeRateConverter
+{
+public:
+    // Message thread, the device is stopped - maxBlockSize is the most samples one process() gets
+    void prepare(double deviceRate, double takeRate, int numTracks, int maxBlockSize)
+    {
+        ratio = deviceRate / takeRate;
+        active = deviceRate > 0.0 && takeRate > 0.0 && deviceRate != takeRate;
+        if (!active)
+            return;
+
+        resampler.prepare(ratio);
+        history.setSize(numTracks, AdaptiveResampler::numTaps + maxBlockSize, false, true, true);
+        output.setSize(numTracks, (int) ceil(maxBlockSize / ratio) + 4, false, true, true);
+
+        // Starts on silence, the first output sample is the first input sample
+        history.clear();
+        numHistory = AdaptiveResampler::halfTaps - 1;
+        readPosition = numHistory;
+    }
+
+    bool isActive() const { return active; }
+    double getRatio() const { return ratio; }
+
+    // Audio thread - numSamples of every track at the device's rate in, returns how many came out at the take's
+    int process(const AudioBuffer<float>& input, int numTracks, int numSamples)
+    {
+        for (int track = 0; track < numTracks; ++track)
+            history.copyFrom(track, numHistory, input, track, 0, numSamples);
+        numHistory += numSamples;
+
+        // Every tap of an output sample has to be there already
+        int numOutput = 0;
+        while (floor(readPosition) + AdaptiveResampler::halfTaps < numHistory && numOutput < output.getNumSamples())
+        {
+            double whole = floor(readPosition);
+            resampler.getCoefficients(readPosition - whole, coefficients.data());
+            int first = (int) whole - AdaptiveResampler::halfTaps + 1;
+
+            for (int track = 0; track < numTracks; ++track)
+                output.getWritePointer(track)[numOutput] = AdaptiveResampler::apply(history.getReadPointer(track, first), coefficients.data());
+
+            readPosition += ratio;
+            ++numOutput;
+        }
+
+        // Only what the next output sample still needs stays
+        int keepFrom = jlimit(0, numHistory, (int) floor(readPosition) - AdaptiveResampler::halfTaps + 1);
+        for (int track = 0; track < numTracks; ++track)
+        {
+            float* data = history.getWritePointer(track);
+            memmove(data, data + keepFrom, sizeof(float) * (size_t) (numHistory - keepFrom));
+        }
+        numHistory -= keepFrom;
+        readPosition -= keepFrom;
+
+        return numOutput;
+    }
+
+    const AudioBuffer<float>& getOutput() const { return output; }
+
+private:
+    AdaptiveResampler resampler;
+    AudioBuffer<float> history; // Input not used up yet, from the oldest sample a tap still needs
+    AudioBuffer<float> output;
+    array<float, AdaptiveResampler::numTaps> coefficients{};
+    double ratio = 1.0; // Device samples per take sample
+    double readPosition = 0.0; // In history, with the fraction
+    int numHistory = 0;
+    bool active = false;
+};
+
+//==============================================================================
+// Interruption Log - where the device went away during a take and how long
+// for. Nothing is recorded while the device is gone, so the file goes on
+// straight after the gap - this is how anyone lining the take up with
+// something else finds out where the missing time was.
+//==============================================================================
+class InterruptionLog
+{
+public:
+    // Message thread, when a take starts
+    void reset(double rate, int blockSize)
+    {
+        const ScopedLock sl(lock);
+        entries.clear();
+        numInterruptions = 0;
+        stoppedAt = 0.0;
+        sampleRate = rate;
+        bufferSize = blockSize;
+    }
+
+    // The device stopped (or was lost) with this many samples in the take
+    void deviceStopped(int64 takeSample)
+    {
+        const ScopedLock sl(lock);
+        stoppedAt = Time::getMillisecondCounterHiRes();
+        stoppedSample = takeSample;
+    }
+
+    // The device started again, possibly with another rate and block size
+    void deviceStarted(double rate, int blockSize, bool resampled)
+    {
+        const ScopedLock sl(lock);
+        if (stoppedAt <= 0.0) // It was running already
+            return;
+
+        auto* entry = new DynamicObject();
+        entry->setProperty("sample", stoppedSample);
+        entry->setProperty("gap_seconds", (Time::getMillisecondCounterHiRes() - stoppedAt) * 0.001);
+        entry->setProperty("from_sample_rate", sampleRate);
+        entry->setProperty("sample_rate", rate);
+        entry->setProperty("from_buffer_size", bufferSize);
+        entry->setProperty("buffer_size", blockSize);
+        entry->setProperty("resampled", resampled);
+        entries.add(var(entry));
+
+        stoppedAt = 0.0;
+        sampleRate = rate;
+        bufferSize = blockSize;
+        ++numInterruptions;
+    }
+
+    bool isDeviceStopped() const
+    {
+        const ScopedLock sl(lock);
+        return stoppedAt > 0.0;
+    }
+
+    int getNumInterruptions() const { return numInterruptions; }
+
+    var getReport() const
+    {
+        const ScopedLock sl(lock);
+        return entries;
+    }
+
+private:
+    CriticalSection lock; // Message thread and finalizer only, never the audio thread
+    Array<var> entries;
+    atomic<int> numInterruptions{ 0 };
+    double stoppedAt = 0.0; // Milliseconds, 0 = the device is running
+    int64 stoppedSample = 0;
+    double sampleRate = 0.0;
+    int bufferSize = 0;
+};
+
+//==============================================================================
+// Device Reconnector - opens the take's device again when it comes back
+// When a device disappears the device manager closes it (and may fall back
+// to another one). Once a second, while a take runs, this checks whether the
+// device the take started on is there again and switches back to it with
+// the same setup. Message thread only.
+//==============================================================================
+class DeviceReconnector : private Timer
+{
+public:
+    DeviceReconnector(AudioDeviceManager& managerToUse, function<bool()> isTakeRunningToUse)
+        : manager(managerToUse), isTakeRunning(move(isTakeRunningToUse))
+    {
+    }
+
+    ~DeviceReconnector() override { stopTimer(); }
+
+    // When a take starts - the device it's on now is the one to go back to
+    void rememberDevice()
+    {
+        auto* device = manager.getCurrentAudioDevice();
+        if (device == nullptr)
+            return;
+
+        setup = manager.getAudioDeviceSetup();
+        typeName = manager.getCurrentAudioDeviceType();
+        deviceName = device->getName();
+        startTimer(1000);
+    }
+
+    int getNumReconnects() const { return numReconnects; }
+
+    // Why the last try didn't work, empty if it did
+    const String& getLastError() const { return lastError; }
+
+private:
+    void timerCallback() override
+    {
+        if (!isTakeRunning())
+        {
+            stopTimer();
+            return;
+        }
+
+        auto* device = manager.getCurrentAudioDevice();
+        if (device != nullptr && device->getName() == deviceName)
+            return;
+
+        // Only once the device is listed again, opening one that isn't there can take seconds
+        auto* type = findType();
+        if (type == nullptr)
+            return;
+
+        type->scanForDevices();
+        if (!type->getDeviceNames(true).contains(deviceName) && !type->getDeviceNames(false).contains(deviceName))
+            return;
+
+        if (manager.getCurrentAudioDeviceType() != typeName)
+            manager.setCurrentAudioDeviceType(typeName, false);
+
+        lastError = manager.setAudioDeviceSetup(setup, true);
+        if (lastError.isEmpty())
+            ++numReconnects;
+    }
+
+    AudioIODeviceType* findType() const
+    {
+        for (auto* type : manager.getAvailableDeviceTypes())
+            if (type->getTypeName() == typeName)
+                return type;
+        return nullptr;
+    }
+
+    AudioDeviceManager& manager;
+    function<bool()> isTakeRunning;
+    AudioDeviceManager::AudioDeviceSetup setup;
+    String typeName, deviceName;
+    String lastError;
+    int numReconnects = 0;
+
+    JUCE_DECLARE_NON_COPYABLE(DeviceReconnector)
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+#include "ThreadTopology.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Take Destinations - the same take written to more than one place
+// A destination is a folder (a backup disk, say) and a gain (a safety copy
+// 12 dB down). The audio thread hands every destination the tracks it has
+// already read, but each one has its own writer thread and its own queue,
+// so a slow or dead disk only fills its own queue and loses its own blocks -
+// the primary file and the other destinations never wait for it. Every
+// write goes through a stream that checks it, so a disk that fills up or
+// goes away shows up as a failed destination straight away (and gets no
+// more blocks).
+//==============================================================================
+struct DestinationSettings
+{
+    File folder; // Empty = next to the primary take
+    float gainDb = 0.0f; // Below 0 for a safety copy
+
+    // Same name as the take file, with the gain in it if there is one (and "_mirror" if it would be the take file itself)
+    File getFileFor(const File& takeFile) const
+    {
+        File directory = folder == File() ? takeFile.getParentDirectory() : folder;
+        String suffix = gainDb != 0.0f ? "_" + String(roundToInt(gainDb)) + "dB" : String();
+        File file = directory.getChildFile(takeFile.getFileNameWithoutExtension() + suffix + takeFile.getFileExtension());
+
+        return file != takeFile ? file
+            : directory.getChildFile(takeFile.getFileNameWithoutExtension() + "_mirror" + takeFile.getFileExtension());
+    }
+
+    // "D:/Backup", "D:/Backup@-12", or just "@-12" for a safety copy next to the take
+    static DestinationSettings parse(const String& text)
+    {
+        DestinationSettings settings;
+        String path = text.upToLastOccurrenceOf("@", false, false);
+
+        if (text.contains("@"))
+            settings.gainDb = jlimit(-60.0f, 0.0f, text.fromLastOccurrenceOf("@", false, false).getFloatValue());
+        else
+            path = text;
+
+        if (path.isNotEmpty())
+            settings.folder = File::getCurrentWorkingDirectory().getChildFile(path);
+        return settings;
+    }
+};
+
+//==============================================================================
+// How one destination is doing - counted by the audio thread and its writer thread, read by anyone
+//==============================================================================
+struct DestinationHealth
+{
+    atomic<int> droppedBlocks{ 0 }; // Its queue was full
+    atomic<int64> bytesWritten{ 0 };
+    atomic<bool> failed{ false }; // The disk said no, nothing more goes to it this take
+
+    void reset()
+    {
+        droppedBlocks = 0;
+        bytesWritten = 0;
+        failed = false;
+        const SpinLock::ScopedLockType sl(messageLock);
+        message = {};
+    }
+
+    // The first reason is the one that's kept
+    void fail(const String& reason)
+    {
+        {
+            const SpinLock::ScopedLockType sl(messageLock);
+            if (message.isEmpty())
+                message = reason;
+        }
+        failed = true;
+    }
+
+    String getMessage() const
+    {
+        const SpinLock::ScopedLockType sl(messageLock);
+        return message;
+    }
+
+    String getStatus() const { return failed ? "failed" : droppedBlocks > 0 ? "dropping" : "ok"; }
+
+    // What goes into the take's "destinations" section
+    var getReport(const File& file, float gainDb) const
+    {
+        auto* report = new DynamicObject();
+        report->setProperty("file", file.getFullPathName());
+        report->setProperty("gain_db", gainDb);
+        report->setProperty("status", getStatus());
+        report->setProperty("dropped_blocks", droppedBlocks.load());
+        report->setProperty("bytes_written", bytesWritten.load());
+        if (failed)
+            report->setProperty("message", getMessage());
+        return var(report);
+    }
+
+private:
+    mutable SpinLock messageLock;
+    String message;
+};
+
+//==============================================================================
+// Health Checking Stream - the file stream under a destination's writers
+// Counts what reached the file and marks the destination failed on the first
+// write, seek or flush the file system refused.
+//==============================================================================
+class HealthCheckingStream : public OutputStream
+{
+public:
+    HealthCheckingStream(unique_ptr<FileOutputStream> streamToUse, DestinationHealth& healthToUpdate)
+        : stream(move(streamToUse)), health(healthToUpdate)
+    {
+    }
+
+    void flush() override
+    {
+        stream->flush();
+        check(true);
+    }
+
+    bool setPosition(int64 newPosition) override { return check(stream->setPosition(newPosition)); }
+    int64 getPosition() override { return stream->getPosition(); }
+
+    bool write(const void* data, size_t numBytes) override
+    {
+        if (!check(stream->write(data, numBytes)))
+            return false;
+
+        health.bytesWritten += (int64) numBytes;
+        return true;
+    }
+
+private:
+    bool check(bool succeeded)
+    {
+        if (succeeded && !stream->getStatus().failed())
+            return true;
+
+        health.fail(stream->getStatus().failed() ? stream->getStatus().getErrorMessage()
+                                                 : "Could not write " + stream->getFile().getFullPathName());
+        return false;
+    }
+
+    unique_ptr<FileOutputStream> stream;
+    DestinationHealth& health;
+};
+
+//==============================================================================
+// Take Mirror - one extra destination of a take, with its own writer thread
+// The writers are made by the CaptureEngine (same format and conversion as
+// the primary), this only holds them, their thread and the health.
+//==============================================================================
+struct TakeMirror
+{
+    TakeMirror(const DestinationSettings& destination, int index)
+        : settings(destination), gain(Decibels::decibelsToGain(destination.gainDb)),
+          thread("Take Mirror " + String(index + 1))
+    {
+        thread.addTimeSliceClient(&role);
+    }
+
+    ~TakeMirror()
+    {
+        writers.clear(); // Flushes what's left, their buffers belong to the thread
+        thread.removeTimeSliceClient(&role);
+        thread.stopThread(2000);
+    }
+
+    // Finalizer thread - flushes and closes the files, the health stays for the report
+    void finish()
+    {
+        writers.clear();
+        thread.stopThread(2000);
+    }
+
+    // Audio thread - never waits, a full queue costs this destination the block and nothing else
+    void write(int file, const float* const* tracks, int numSamples)
+    {
+        if (health.failed || file >= writers.size())
+            return;
+
+        if (!writers.getUnchecked(file)->write(tracks, numSamples))
+            ++health.droppedBlocks;
+    }
+
+    var getReport() const { return health.getReport(files[0], settings.gainDb); }
+
+    const DestinationSettings settings;
+    const float gain;
+    TimeSliceThread thread;
+    ThreadTopology::TimeSliceRole role{ ThreadTopology::writer };
+    OwnedArray<AudioFormatWriter::ThreadedWriter> writers; // One per take file, like the primary
+    Array<File> files;
+    DestinationHealth health;
+
+    JUCE_DECLARE_NON_COPYABLE(TakeMirror)
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <iostream>
+#include "CaptureTap.h"
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Tap Consumer - the reference reader of the shared memory tap
+// Another copy of the program started with --read-tap follows a recorder's
+// tap: prints how far it got, how far behind it is and its overruns, and
+// writes what it read into a WAV file if it's given one. --read-delay makes
+// it deliberately slow, to see that the recorder doesn't care.
+// Example:
+//   AudioRecorder --headless --read-tap=AudioRecorder --output=tap.wav --duration=60
+//   AudioRecorder --headless --read-tap=AudioRecorder --read-delay=500
+//==============================================================================
+class TapConsumer : private Thread
+{
+public:
+    struct Options
+    {
+        String tapName;
+        File outputFile; // Empty = only measure
+        double durationSeconds = 0.0; // 0 = until the recorder closes the tap
+        int readDelayMs = 0; // Extra wait after every read
+        double metricsInterval = 1.0;
+    };
+
+    explicit TapConsumer(const Options& consumerOptions)
+        : Thread("Tap Consumer"), options(consumerOptions)
+    {
+    }
+
+    ~TapConsumer() override
+    {
+        stopThread(5000);
+    }
+
+    bool start()
+    {
+        if (!reader.open(options.tapName))
+        {
+            printLine("tap status=error message=\"No tap called " + options.tapName + " ("
+                + getCaptureTapFile(options.tapName).getFullPathName() + ")\"");
+            return false;
+        }
+
+        printLine("tap status=open file=\"" + getCaptureTapFile(options.tapName).getFullPathName() + "\""
+            + " channels=" + String(reader.getNumChannels())
+            + " sample_rate=" + String(reader.getSampleRate())
+            + " take=" + String(reader.getTakeCounter())
+            + " recording=" + String(reader.isRecording() ? "yes" : "no"));
+
+        if (options.outputFile != File() && !openOutput())
+        {
+            printLine("tap status=error message=\"Could not write " + options.outputFile.getFullPathName() + "\"");
+            return false;
+        }
+
+        startThread();
+        return true;
+    }
+
+private:
+    static void printLine(const String& line)
+    {
+        cout << line << endl;
+    }
+
+    bool openOutput()
+    {
+        options.outputFile.deleteFile();
+        unique_ptr<OutputStream> stream(options.outputFile.createOutputStream());
+        if (stream == nullptr)
+            return false;
+
+        writer.reset(WavAudioFormat().createWriterFor(stream.get(), reader.getSampleRate(),
+            (unsigned int) reader.getNumChannels(), 32, {}, 0));
+        if (writer == nullptr)
+            return false;
+
+        stream.release();
+        return true;
+    }
+
+    void run() override
+    {
+        int64 framesToRead = (int64) (options.durationSeconds * reader.getSampleRate());
+        int64 framesRead = 0;
+        double nextMetrics = options.metricsInterval;
+        float peak = 0.0f;
+
+        while (!threadShouldExit() && (framesToRead <= 0 || framesRead < framesToRead))
+        {
+            int got = reader.read(maxFramesPerRead, [&](const float* const* channels, int numFrames, uint64)
+            {
+                // Straight from the shared memory, nothing copied on the way
+                for (int ch = 0; ch < reader.getNumChannels(); ++ch)
+                {
+                    auto range = FloatVectorOperations::findMinAndMax(channels[ch], numFrames);
+                    peak = jmax(peak, -range.getStart(), range.getEnd());
+                }
+
+                if (writer != nullptr)
+                    writer->writeFromFloatArrays(channels, reader.getNumChannels(), numFrames);
+            });
+
+            framesRead += got;
+
+            if (framesRead / reader.getSampleRate() >= nextMetrics)
+            {
+                printMetrics(framesRead, peak);
+                peak = 0.0f;
+                nextMetrics += options.metricsInterval;
+            }
+
+            if (reader.isClosedByRecorder())
+                break;
+
+            wait(got == 0 ? 5 : options.readDelayMs); // Polls, the recorder never signals anyone
+        }
+
+        printMetrics(framesRead, peak);
+        writer = nullptr; // Finishes the file
+        printLine("tap status=finished frames=" + String(framesRead) + " overruns=" + String(reader.getOverruns())
+            + " lost_frames=" + String(reader.getLostFrames()));
+
+        MessageManager::callAsync([] { JUCEApplicationBase::quit(); });
+    }
+
+    void printMetrics(int64 framesRead, float peak)
+    {
+        printLine("tap_metrics frames=" + String(framesRead)
+            + " seconds=" + String(framesRead / reader.getSampleRate(), 2)
+            + " take=" + String(reader.getTakeCounter())
+            + " overruns=" + String(reader.getOverruns())
+            + " lost_frames=" + String(reader.getLostFrames())
+            + " publisher_overruns=" + String((int64) reader.getPublisherOverruns())
+            + " peak_db=" + String(Decibels::gainToDecibels(peak), 1));
+    }
+
+    static constexpr int maxFramesPerRead = 8192;
+
+    Options options;
+    CaptureTapReader reader;
+    unique_ptr<AudioFormatWriter> writer;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(TapConsumer)
+};
@@ -0,0 +1,381 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+using namespace std;
+using namespace juce;
+
+#if JUCE_LINUX || JUCE_MAC
+ #include <pthread.h>
+ #include <sched.h>
+ #include <sys/resource.h>
+ #include <unistd.h>
+#endif
+
+#if JUCE_LINUX
+ #include <sys/syscall.h>
+#endif
+
+#if JUCE_WINDOWS
+extern "C"
+{
+    __declspec(dllimport) void* __stdcall GetCurrentThread();
+    __declspec(dllimport) int __stdcall SetThreadPriority(void*, int);
+    __declspec(dllimport) pointer_sized_uint __stdcall SetThreadAffinityMask(void*, pointer_sized_uint);
+    __declspec(dllimport) unsigned long __stdcall GetLastError();
+}
+#endif
+
+//==============================================================================
+// Thread Topology - which threads run how urgently, and on which CPUs
+// Every thread has a role. Real time roles get SCHED_FIFO (time critical on
+// Windows), the others a nice level, and each role can be kept to a set of
+// CPUs. With isolate_audio the other roles stay off the audio CPUs, so our
+// own writer and analysis work can't get in the way of the callback. Threads
+// apply their role to themselves (no handles to other threads needed), so
+// each thread calls applyToCurrentThread() where it runs - after the first
+// time that's one atomic compare. What the system refused is kept per role
+// and comes back from getReport().
+//
+// Nothing is touched until it's configured, with JSON from --thread-topology
+// (a file or the text itself) or from thread-topology.json next to the
+// latency settings, e.g.
+//   {"audio": {"realtime": 80, "cpus": "2-3"}, "writer": {"nice": -5, "cpus": "1"},
+//    "analysis": {"nice": 10}, "isolate_audio": true}
+//==============================================================================
+class ThreadTopology
+{
+public:
+    enum Role { audio, writer, analysis, background, ui, numRoles };
+
+    static const char* getRoleName(int role)
+    {
+        static const char* names[] = { "audio", "writer", "analysis", "background", "ui" };
+        return names[role];
+    }
+
+    // Replaces the whole configuration, roles that aren't in it get the defaults. Returns false for bad JSON.
+    static bool configure(const var& config, String& error)
+    {
+        if (!config.isObject() && !config.isVoid())
+        {
+            error = "The thread topology has to be a JSON object";
+            return false;
+        }
+
+        uint64 allCpus = getAllCpus();
+        for (int role = 0; role < numRoles; ++role)
+        {
+            var settings = config[getRoleName(role)];
+            RoleState& state = getRoles()[(size_t) role];
+
+            state.realtimePriority = jlimit(0, 99, (int) settings.getProperty("realtime", role == audio ? defaultAudioPriority : 0));
+            state.nice = jlimit(-20, 19, (int) settings.getProperty("nice", getDefaultNice(role)));
+
+            uint64 cpus = parseCpus(settings["cpus"].toString()) & allCpus;
+            if (settings["cpus"].toString().isNotEmpty() && cpus == 0)
+            {
+                error = String(getRoleName(role)) + " has no CPUs this machine has (" + settings["cpus"].toString() + ")";
+                return false;
+            }
+            state.cpus = cpus;
+
+            state.threads = 0;
+            state.priorityError = 0;
+            state.affinityError = 0;
+        }
+
+        isolateAudio = (bool) config.getProperty("isolate_audio", false);
+        ++generation; // Every thread applies it again the next time it checks
+        return true;
+    }
+
+    // A JSON text, or a file with it in
+    static bool configure(const String& fileOrJson, String& error)
+    {
+        String text = fileOrJson.trimStart().startsWith("{") ? fileOrJson
+            : File::getCurrentWorkingDirectory().getChildFile(fileOrJson).loadFileAsString();
+
+        var config;
+        Result result = JSON::parse(text, config);
+        if (result.failed() || text.isEmpty())
+        {
+            error = "Could not read the thread topology " + fileOrJson + (result.failed() ? ": " + result.getErrorMessage() : String());
+            return false;
+        }
+
+        return configure(config, error);
+    }
+
+    static File getDefaultFile()
+    {
+        return File::getSpecialLocation(File::userApplicationDataDirectory)
+            .getChildFile("AudioRecorder").getChildFile("thread-topology.json");
+    }
+
+    // --thread-topology, otherwise the default file if there is one. Returns false (and the error) if it can't be used.
+    static bool configureFromCommandLine(const String& commandLine, String& error)
+    {
+        String topology = ArgumentList("AudioRecorder", commandLine).getValueForOption("--thread-topology");
+        if (topology.isEmpty() && getDefaultFile().existsAsFile())
+            topology = getDefaultFile().getFullPathName();
+
+        return topology.isEmpty() || configure(topology, error);
+    }
+
+    static bool isConfigured() { return generation > 0; }
+
+    // Any thread - cheap unless the configuration changed since this thread last applied it
+    static void applyToCurrentThread(Role role) noexcept
+    {
+        ThreadState& thread = getThreadState();
+        int current = generation.load(memory_order_acquire);
+        if (current == 0 || (thread.generation == current && thread.role == role))
+            return;
+
+        thread.generation = current;
+        thread.role = role;
+        apply(role);
+    }
+
+    // For TimeSliceThreads - applies the role on the thread, and again every quarter second in case it changed
+    struct TimeSliceRole : public TimeSliceClient
+    {
+        explicit TimeSliceRole(Role roleToApply) : role(roleToApply) {}
+
+        int useTimeSlice() override
+        {
+            applyToCurrentThread(role);
+            return 250;
+        }
+
+        Role role;
+    };
+
+    // Message thread - one line per role with what it asked for and what it got, and warnings after that
+    static StringArray getReport()
+    {
+        StringArray lines;
+        uint64 audioCpus = getRoles()[audio].cpus;
+
+        for (int role = 0; role < numRoles; ++role)
+        {
+            const RoleState& state = getRoles()[(size_t) role];
+            int priorityError = state.priorityError, affinityError = state.affinityError;
+            uint64 cpus = getEffectiveCpus(role);
+
+            String line = "role=" + String(getRoleName(role)) + " threads=" + String(state.threads.load())
+                + " scheduling=" + (state.realtimePriority > 0 ? "realtime:" + String(state.realtimePriority) : "nice:" + String(state.nice))
+                + " cpus=" + (cpus != 0 ? formatCpus(cpus) : String("any"));
+
+            if (priorityError == 0 && affinityError == 0)
+                line << " status=ok";
+            else
+                line << " status=failed" << describeError("priority", priorityError, state.realtimePriority > 0)
+                     << describeError("affinity", affinityError, false);
+
+            lines.add(line);
+        }
+
+       #if JUCE_LINUX
+        // Our threads keep off the audio CPUs, the rest of the system only does with isolcpus
+        if (audioCpus != 0)
+        {
+            uint64 isolated = parseCpus(File("/sys/devices/system/cpu/isolated").loadFileAsString().trim());
+            if ((audioCpus & ~isolated) != 0)
+                lines.add("warning=\"audio CPUs " + formatCpus(audioCpus) + " aren't isolated from other programs (isolcpus="
+                    + (isolated != 0 ? formatCpus(isolated) : String("none")) + ")\"");
+        }
+       #endif
+
+        return lines;
+    }
+
+    static bool hasFailures()
+    {
+        for (auto& state : getRoles())
+            if (state.priorityError != 0 || state.affinityError != 0)
+                return true;
+        return false;
+    }
+
+    // "0-1,4" to a mask of CPUs (0 based, like the kernel counts them)
+    static uint64 parseCpus(const String& text)
+    {
+        uint64 mask = 0;
+        for (auto& part : StringArray::fromTokens(text, ",", {}))
+        {
+            int first = part.upToFirstOccurrenceOf("-", false, false).trim().getIntValue();
+            int last = part.contains("-") ? part.fromFirstOccurrenceOf("-", false, false).trim().getIntValue() : first;
+
+            for (int cpu = jmax(0, first); cpu <= last && cpu < 64; ++cpu)
+                mask |= (uint64) 1 << cpu;
+        }
+        return mask;
+    }
+
+    static String formatCpus(uint64 mask)
+    {
+        StringArray parts;
+        for (int cpu = 0; cpu < 64; ++cpu)
+        {
+            if ((mask & ((uint64) 1 << cpu)) == 0)
+                continue;
+
+            int last = cpu;
+            while (last + 1 < 64 && (mask & ((uint64) 1 << (last + 1))) != 0)
+                ++last;
+
+            parts.add(last > cpu ? String(cpu) + "-" + String(last) : String(cpu));
+            cpu = last;
+        }
+        return parts.joinIntoString(",");
+    }
+
+private:
+    static constexpr int defaultAudioPriority = 70; // Above ordinary real time work, below sound card IRQ threads tuned up to 80+
+
+    struct RoleState
+    {
+        atomic<int> realtimePriority{ 0 }; // 1-99, 0 = not real time
+        atomic<int> nice{ 0 };
+        atomic<uint64> cpus{ 0 }; // 0 = any
+        atomic<int> threads{ 0 }; // How many threads applied it
+        atomic<int> priorityError{ 0 }; // errno (GetLastError on Windows) of the last failure, or -1 = not supported here
+        atomic<int> affinityError{ 0 };
+    };
+
+    struct ThreadState
+    {
+        int generation = 0;
+        int role = -1;
+    };
+
+    // The writer must keep up and the rest can wait, none of these need any permission
+    static int getDefaultNice(int role)
+    {
+        switch (role)
+        {
+            case analysis: return 10;
+            case background: return 15;
+            default: return 0;
+        }
+    }
+
+    static array<RoleState, numRoles>& getRoles()
+    {
+        static array<RoleState, numRoles> roles;
+        return roles;
+    }
+
+    static ThreadState& getThreadState() noexcept
+    {
+        static thread_local ThreadState state;
+        return state;
+    }
+
+    static uint64 getAllCpus()
+    {
+        int numCpus = jlimit(1, 64, SystemStats::getNumCpus());
+        return numCpus == 64 ? ~(uint64) 0 : (((uint64) 1 << numCpus) - 1);
+    }
+
+    // What a role really runs on - with isolate_audio, roles without their own CPUs get everything but the audio ones
+    static uint64 getEffectiveCpus(int role)
+    {
+        uint64 cpus = getRoles()[(size_t) role].cpus;
+        uint64 audioCpus = getRoles()[audio].cpus;
+
+        if (cpus == 0 && role != audio && isolateAudio && audioCpus != 0 && (getAllCpus() & ~audioCpus) != 0)
+            cpus = getAllCpus() & ~audioCpus;
+
+        return cpus;
+    }
+
+    static String describeError(const String& what, int error, bool realtime)
+    {
+        if (error == 0)
+            return {};
+
+        if (error == -1)
+            return " " + what + "=\"not supported on this system\"";
+
+       #if JUCE_LINUX || JUCE_MAC
+        String text = String(strerror(error));
+        if (error == EPERM && what == "priority")
+            text << (realtime ? " - needs CAP_SYS_NICE or an rtprio limit (/etc/security/limits.conf)"
+                              : " - a negative nice needs CAP_SYS_NICE or a nice limit");
+        return " " + what + "=\"" + text + "\"";
+       #else
+        ignoreUnused(realtime);
+        return " " + what + "=\"error " + String(error) + "\"";
+       #endif
+    }
+
+    // Runs on the thread itself, so it doesn't allocate or lock (the audio thread does this too)
+    static void apply(Role role) noexcept
+    {
+        RoleState& state = getRoles()[(size_t) role];
+        int realtimePriority = state.realtimePriority, nice = state.nice;
+        uint64 cpus = getEffectiveCpus(role);
+        int priorityError = 0, affinityError = 0;
+
+       #if JUCE_MAC
+        if (role == audio)
+            realtimePriority = -1; // CoreAudio's thread is already time constrained, SCHED_FIFO would be a step down
+       #endif
+
+       #if JUCE_LINUX || JUCE_MAC
+        sched_param param{};
+        param.sched_priority = jmax(0, realtimePriority);
+        if (realtimePriority >= 0)
+            priorityError = pthread_setschedparam(pthread_self(), realtimePriority > 0 ? SCHED_FIFO : SCHED_OTHER, &param);
+
+        if (priorityError == 0 && realtimePriority == 0)
+        {
+          #if JUCE_LINUX
+            // On Linux the nice level belongs to the thread (its tid), not the whole process
+            if (setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), nice) != 0)
+                priorityError = errno;
+          #else
+            if (nice != 0)
+                priorityError = -1;
+          #endif
+        }
+
+        if (cpus != 0)
+        {
+          #if JUCE_LINUX
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu = 0; cpu < 64; ++cpu)
+                if ((cpus & ((uint64) 1 << cpu)) != 0)
+                    CPU_SET(cpu, &set);
+            affinityError = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+          #else
+            affinityError = -1; // macOS only has affinity hints
+          #endif
+        }
+       #elif JUCE_WINDOWS
+        int priority = realtimePriority > 0 ? 15 // THREAD_PRIORITY_TIME_CRITICAL
+                     : nice <= -10 ? 2 : nice < 0 ? 1 : nice == 0 ? 0 : nice <= 10 ? -1 : -2;
+        if (SetThreadPriority(GetCurrentThread(), priority) == 0)
+            priorityError = (int) GetLastError();
+
+        if (cpus != 0 && SetThreadAffinityMask(GetCurrentThread(), (pointer_sized_uint) cpus) == 0)
+            affinityError = (int) GetLastError();
+       #else
+        ignoreUnused(realtimePriority, nice, cpus);
+        priorityError = -1;
+       #endif
+
+        ++state.threads;
+        if (priorityError != 0)
+            state.priorityError = priorityError;
+        if (affinityError != 0)
+            state.affinityError = affinityError;
+    }
+
+    static inline atomic<int> generation{ 0 };
+    static inline atomic<bool> isolateAudio{ false };
+};
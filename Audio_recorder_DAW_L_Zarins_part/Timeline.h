@@ -0,0 +1,155 @@
+#pragma once
+
+#include <JuceHeader.h>
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Timeline State - the zoom and scroll position shared by all tracks
+// Time 0 is the start of every take. pixelsPerSecond goes from "whole
+// session fits the width" down to sample level (16 pixels per sample).
+// In fit mode the zoom follows the session length as recordings grow.
+//==============================================================================
+class TimelineState
+{
+public:
+    double getViewStart() const { return viewStart; }
+    double getPixelsPerSecond() const { return pixelsPerSecond; }
+    double getVisibleLength() const { return viewWidth / pixelsPerSecond; }
+    double getViewEnd() const { return viewStart + getVisibleLength(); }
+    double getSessionLength() const { return sessionLength; }
+    double getSamplesPerPixel() const { return sampleRate / pixelsPerSecond; }
+    bool isFittingSession() const { return fitToSession; }
+
+    float timeToX(double seconds, Rectangle<int> area) const { return (float) (area.getX() + (seconds - viewStart) * pixelsPerSecond); }
+    double xToTime(float x, Rectangle<int> area) const { return viewStart + (x - area.getX()) / pixelsPerSecond; }
+
+    // Width in pixels of the waveform area all tracks share
+    void setViewWidth(int newWidth)
+    {
+        viewWidth = jmax(1, newWidth);
+        update();
+    }
+
+    void setSessionLength(double seconds, double newSampleRate)
+    {
+        if (seconds == sessionLength && newSampleRate == sampleRate)
+            return;
+
+        sessionLength = seconds;
+        sampleRate = newSampleRate;
+        update();
+    }
+
+    void setViewStart(double seconds)
+    {
+        viewStart = seconds;
+        update();
+    }
+
+    // Zooms by factor (2 = twice as close) keeping anchorTime at the same place on screen
+    void zoomAround(double factor, double anchorTime)
+    {
+        double anchorOffset = (anchorTime - viewStart) * pixelsPerSecond;
+        fitToSession = false;
+        pixelsPerSecond = jlimit(getMinPixelsPerSecond(), getMaxPixelsPerSecond(), pixelsPerSecond * factor);
+        viewStart = anchorTime - anchorOffset / pixelsPerSecond;
+        update();
+    }
+
+    void zoomToFit()
+    {
+        fitToSession = true;
+        update();
+    }
+
+    function<void()> onChange; // Called whenever zoom or scroll changed
+
+private:
+    double getMinPixelsPerSecond() const { return viewWidth / jmax(1.0, sessionLength); }
+    double getMaxPixelsPerSecond() const { return sampleRate * 16.0; }
+
+    void update()
+    {
+        double oldStart = viewStart, oldZoom = pixelsPerSecond;
+
+        if (fitToSession)
+        {
+            pixelsPerSecond = getMinPixelsPerSecond();
+            viewStart = 0.0;
+        }
+
+        pixelsPerSecond = jlimit(getMinPixelsPerSecond(), getMaxPixelsPerSecond(), pixelsPerSecond);
+        viewStart = jlimit(0.0, jmax(0.0, sessionLength - getVisibleLength()), viewStart);
+
+        if ((viewStart != oldStart || pixelsPerSecond != oldZoom) && onChange != nullptr)
+            onChange();
+    }
+
+    double viewStart = 0.0; // Seconds at the left edge
+    double pixelsPerSecond = 100.0;
+    double sessionLength = 0.0; // Longest take in seconds
+    double sampleRate = 44100.0;
+    int viewWidth = 1000;
+    bool fitToSession = true;
+};
+
+//==============================================================================
+// Time Ruler - the time scale drawn above the tracks
+//==============================================================================
+class TimeRuler : public Component
+{
+public:
+    explicit TimeRuler(TimelineState& state) : timeline(state) {}
+
+    void paint(Graphics& g) override
+    {
+        g.fillAll(Colour(0xFF2A2A2A)); // Darker than the tracks
+
+        auto area = getLocalBounds();
+        double step = getTickStep();
+        double firstTick = ceil(timeline.getViewStart() / step) * step;
+
+        g.setFont(11.0f);
+        for (double time = firstTick; time <= timeline.getViewEnd(); time += step)
+        {
+            float x = timeline.timeToX(time, area);
+
+            g.setColour(Colours::grey);
+            g.drawVerticalLine(roundToInt(x), (float) area.getBottom() - 8.0f, (float) area.getBottom());
+
+            g.setColour(Colours::white);
+            g.drawText(formatTime(time, step), roundToInt(x) + 3, 0, 80, area.getHeight() - 6, Justification::centredLeft);
+        }
+    }
+
+private:
+    // Smallest nice step that keeps labels at least 80 pixels apart
+    double getTickStep() const
+    {
+        static const double steps[] = { 0.00001, 0.00002, 0.00005, 0.0001, 0.0002, 0.0005, 0.001, 0.002, 0.005,
+            0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0, 2.0, 5.0, 10.0, 15.0, 30.0, 60.0, 120.0, 300.0, 600.0, 1800.0, 3600.0 };
+
+        for (double step : steps)
+            if (step * timeline.getPixelsPerSecond() >= 80.0)
+                return step;
+
+        return 7200.0;
+    }
+
+    static String formatTime(double seconds, double step)
+    {
+        if (step >= 1.0)
+        {
+            int total = roundToInt(seconds);
+            return String(total / 3600 > 0 ? String(total / 3600) + ":" : String())
+                + String((total / 60) % 60).paddedLeft('0', total >= 3600 ? 2 : 1) + ":"
+                + String(total % 60).paddedLeft('0', 2);
+        }
+
+        int decimals = jlimit(1, 5, (int) ceil(-log10(step)));
+        return String(seconds, decimals) + "s";
+    }
+
+    TimelineState& timeline;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Triple Buffer - hands a whole struct from one thread to another, lock free
+// The writer fills its own slot and swaps it with the middle one, the reader
+// swaps the middle one with its own slot when there is something new. Nobody
+// ever waits and the reader always gets one complete publish, never half of
+// two. Each slot and each side's index sit on their own cache line, so the
+// audio thread writing doesn't keep throwing the UI's line out (and back).
+// One writer thread and one reader thread only.
+//==============================================================================
+template <typename State>
+class TripleBuffer
+{
+public:
+    static constexpr size_t cacheLineSize = 64;
+
+    // Writer - the slot to fill, every field has to be written before publish()
+    State& getWriteSlot() { return slots[(size_t) backIndex].state; }
+
+    // Writer - makes the filled slot the newest one
+    void publish()
+    {
+        int previous = middle.exchange(backIndex | newDataBit, memory_order_acq_rel);
+        backIndex = previous & indexMask;
+    }
+
+    // Reader - the newest published state (or the same one again if nothing new came)
+    const State& read()
+    {
+        if ((middle.load(memory_order_relaxed) & newDataBit) != 0)
+        {
+            int previous = middle.exchange(frontIndex, memory_order_acq_rel);
+            frontIndex = previous & indexMask;
+        }
+
+        return slots[(size_t) frontIndex].state;
+    }
+
+private:
+    static constexpr int indexMask = 3;
+    static constexpr int newDataBit = 4;
+
+    struct alignas(cacheLineSize) Slot
+    {
+        State state{};
+    };
+
+    array<Slot, 3> slots;
+    alignas(cacheLineSize) atomic<int> middle{ 1 }; // Shared by both sides
+    alignas(cacheLineSize) int backIndex = 0; // Writer only
+    alignas(cacheLineSize) int frontIndex = 2; // Reader only
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <list>
+#include <map>
+using namespace std;
+using namespace juce;
+
+//==============================================================================
+// Waveform Tile Cache - rendered waveform images, shared by all tracks
+// Each tile is a fixed 256 pixel wide image of one track at one zoom level
+// (zoom level z = 2^z samples per pixel). Once a tile is drawn it is only
+// drawn again when the audio under it changes, so painting is mostly image
+// blits. The least recently used tiles are thrown away when the cache goes
+// over its memory budget.
+//==============================================================================
+class WaveformTileCache
+{
+public:
+    static constexpr int tileWidth = 256; // Pixels per tile
+
+    explicit WaveformTileCache(size_t budgetBytes = 64 * 1024 * 1024) : memoryBudget(budgetBytes) {}
+
+    // Zoom level whose samples per pixel is closest to the one asked for
+    static int getZoomLevelFor(double samplesPerPixel)
+    {
+        return jlimit(0, 30, roundToInt(log2(jmax(1.0, samplesPerPixel))));
+    }
+
+    static double getSamplesPerPixel(int zoomLevel) { return (double) (1LL << zoomLevel); }
+
+    // Returns the tile, drawing it first if it is missing or the audio under it changed
+    // availableSamples = how much of the track exists right now (grows while recording)
+    Image getTile(int64 trackId, int zoomLevel, int64 tileIndex, int height,
+        AudioThumbnail& thumbnail, double sampleRate, int64 availableSamples, Colour colour)
+    {
+        TileKey key{ trackId, zoomLevel, tileIndex };
+        int version = getTrackVersion(trackId);
+        int64 tileStart = tileIndex * tileWidth * (1LL << zoomLevel);
+        int64 tileEnd = tileStart + tileWidth * (1LL << zoomLevel);
+
+        auto found = tiles.find(key);
+        if (found != tiles.end())
+        {
+            Tile& tile = *found->second;
+            bool audioChanged = tile.version != version
+                || tile.image.getHeight() != height
+                || (tile.renderedSamples < tileEnd && availableSamples > tile.renderedSamples); // Tile was drawn while the take was still growing
+
+            if (!audioChanged)
+            {
+                leastRecentlyUsed.splice(leastRecentlyUsed.begin(), leastRecentlyUsed, found->second); // Now the most recent
+                return tile.image;
+            }
+
+            removeTile(found);
+        }
+
+        Tile tile;
+        tile.key = key;
+        tile.version = version;
+        tile.renderedSamples = availableSamples;
+        tile.image = Image(Image::ARGB, tileWidth, jmax(1, height), true);
+
+        if (availableSamples > tileStart)
+        {
+            Graphics g(tile.image);
+            g.setColour(colour);
+            thumbnail.drawChannels(g, tile.image.getBounds(), tileStart / sampleRate, tileEnd / sampleRate, 1.0f);
+        }
+
+        leastRecentlyUsed.push_front(tile);
+        tiles[key] = leastRecentlyUsed.begin();
+        bytesUsed += getTileBytes(tile);
+        evictToBudget();
+
+        return leastRecentlyUsed.front().image;
+    }
+
+    // The audio or the edit of a track changed, all of its tiles have to be drawn again
+    void invalidateTrack(int64 trackId)
+    {
+        ++trackVersions[trackId];
+    }
+
+    // Track was deleted, frees its tiles
+    void removeTrack(int64 trackId)
+    {
+        for (auto it = tiles.begin(); it != tiles.end();)
+        {
+            auto next = std::next(it);
+            if (it->first.trackId == trackId)
+                removeTile(it);
+            it = next;
+        }
+
+        trackVersions.erase(trackId);
+    }
+
+    void setMemoryBudget(size_t newBudgetBytes)
+    {
+        memoryBudget = newBudgetBytes;
+        evictToBudget();
+    }
+
+    size_t getMemoryUsed() const { return bytesUsed; }
+    size_t getMemoryBudget() const { return memoryBudget; }
+    int getNumTiles() const { return (int) tiles.size(); }
+
+private:
+    struct TileKey
+    {
+        int64 trackId;
+        int zoomLevel;
+        int64 tileIndex;
+
+        bool operator<(const TileKey& other) const
+        {
+            return tie(trackId, zoomLevel, tileIndex) < tie(other.trackId, other.zoomLevel, other.tileIndex);
+        }
+    };
+
+    struct Tile
+    {
+        TileKey key;
+        int version = 0;
+        int64 renderedSamples = 0; // How much of the track existed when this tile was drawn
+        Image image;
+    };
+
+    using TileList = list<Tile>;
+
+    static size_t getTileBytes(const Tile& tile)
+    {
+        return (size_t) tile.image.getWidth() * (size_t) tile.image.getHeight() * 4;
+    }
+
+    int getTrackVersion(int64 trackId) const
+    {
+        auto found = trackVersions.find(trackId);
+        return found != trackVersions.end() ? found->second : 0;
+    }
+
+    void removeTile(map<TileKey, TileList::iterator>::iterator entry)
+    {
+        bytesUsed -= getTileBytes(*entry->second);
+        leastRecentlyUsed.erase(entry->second);
+        tiles.erase(entry);
+    }
+
+    void evictToBudget()
+    {
+        // Keep at least the tile just drawn, even if the budget is tiny
+        while (bytesUsed > memoryBudget && leastRecentlyUsed.size() > 1)
+            removeTile(tiles.find(leastRecentlyUsed.back().key));
+    }
+
+    TileList leastRecentlyUsed; // Most recently used at the front
+    map<TileKey, TileList::iterator> tiles;
+    map<int64, int> trackVersions;
+    size_t memoryBudget;
+    size_t bytesUsed = 0;
+};